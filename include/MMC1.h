@@ -14,8 +14,8 @@ struct MMC1 {
 uint8_t MMC1Setup(void);
 void mmc1Reset(void);
 void mmc1Write(uint16_t, uint8_t);
-void loadChrBank0(void);
-void loadChrBank1(void);
-void loadProgramBank();
+void loadMirroring(void);
+void loadChrBanks(void);
+void loadProgramBank(void);
 
 #endif
@@ -0,0 +1,20 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+// Set while a benchmark times a frame; enables the subsystem timers.
+// Like the bound console, the timers belong to the calling thread, so
+// batch workers don't share them.
+extern __thread uint8_t benchProfiling;
+
+// Host time spent in the PPU (including rendering) and in
+// renderScanline() alone, in nanoseconds.
+extern __thread uint64_t benchPPUTime;
+extern __thread uint64_t benchRenderTime;
+
+uint64_t benchClock(void);
+void runBenchmark(const char *, const char *, uint64_t, uint32_t);
+void printJSONString(const char *);
+
+#endif
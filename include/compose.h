@@ -0,0 +1,63 @@
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ppu.h"
+
+// Ways of composing and converting pixels, from slowest to fastest.
+// The SIMD ones are only available on x86 hosts with the instruction
+// set.
+enum ComposeKind {
+  COMPOSE_SCALAR,
+  COMPOSE_SSSE3,
+  COMPOSE_AVX2,
+  COMPOSE_KINDS
+};
+
+// Pixel formats frames are converted to when presented or exported.
+enum PixelFormat {
+  PIXEL_ARGB8888,   // 32-bit pixels in host byte order
+  PIXEL_RGB565,     // 16-bit pixels in host byte order
+  PIXEL_RGB24,      // red, green and blue bytes
+  PIXEL_FORMATS
+};
+
+// Bytes per pixel of each format.
+extern const uint8_t pixelBytes[PIXEL_FORMATS];
+
+// Composes the pixels of background tiles: each tile's decoded row,
+// with its palette bits (0, 4, 8 or 12) added to every pixel, looked
+// up in the NES colours of the 16 background palette entries.
+//
+//   out: Where to write 8 pixels per tile.
+//   rows: Decoded row of each tile.
+//   upper: Palette bits of each tile.
+//   count: Number of tiles.
+//   colors: NES colour of each background palette entry.
+typedef void (*ComposeFunction)(uint8_t *, const TileRow *, const uint8_t *, int, const uint8_t *);
+
+// Converts pixels of NES colours (0-63) into a pixel format, looking
+// up each byte of a pixel in a table of 64.
+//
+//   out: Where to write the pixels.
+//   colors: NES colour of each pixel.
+//   count: Number of pixels.
+//   planes: Table of each byte of the pixel format.
+//   bytes: Bytes per pixel, 2, 3 or 4.
+typedef void (*ConvertFunction)(uint8_t *, const uint8_t *, int, const uint8_t (*)[64], int);
+
+// The fastest functions the host supports, selected by composeInit().
+extern ComposeFunction composeTiles;
+extern ConvertFunction convertPixels;
+extern enum ComposeKind composeKind;
+
+extern const char * const composeNames[COMPOSE_KINDS];
+
+void composeInit(void);
+ComposeFunction composeFunction(enum ComposeKind);
+ConvertFunction convertFunction(enum ComposeKind);
+void convertFrame(uint8_t *, size_t, const uint8_t *, const uint8_t *, enum PixelFormat);
+
+#endif
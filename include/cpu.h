@@ -1,8 +1,16 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 
+#include "registers.h"
+
+// Sources that can assert the IRQ line.
+#define IRQ_SOURCE_FRAME (1 << 0)
+#define IRQ_SOURCE_MAPPER (1 << 1)
+
 typedef enum AddressMode{ ZERO_PAGE, ZERO_PAGE_X, ZERO_PAGE_Y,
                    ABSOLUTE,  ABSOLUTE_X,  ABSOLUTE_Y,
                    INDIRECT,  INDIRECT_X,  INDIRECT_Y,
@@ -14,17 +22,97 @@ typedef struct FunctionExecute {
   union {
     void (*FunctionEx_0Arg)(void);
     void (*FunctionEx_1Arg)(AddressMode);
-    void (*FunctionEx_2Arg)(uint8_t, AddressMode);
-    void (*FunctionEx_3Arg)(uint8_t, uint8_t, AddressMode);
-  }
+    void (*FunctionEx_2Arg)(AddressMode, uint8_t);
+    void (*FunctionEx_3Arg)(AddressMode, uint8_t, uint8_t);
+  };
 } FunctionExecute;
 
 struct opcode {
   uint8_t code[3];
   enum AddressMode addrMode;
   u_int8_t operands;
-} extern const opcodes[256];
+};
+
+extern const struct opcode opcodes[256];
+
+/**
+ * Everything step() needs to decode and execute one opcode,
+ * packed into 16 bytes so four descriptors share a cache line.
+ * pcIncrement is zero for instructions that load the program
+ * counter themselves (JMP, JSR, RTI).
+ */
+typedef struct OpcodeDescriptor {
+  FunctionExecute execute;
+  uint8_t cycles;
+  uint8_t operands;
+  uint8_t addrMode;
+  uint8_t pcIncrement;
+  uint8_t flags;
+} __attribute__((aligned(16))) OpcodeDescriptor;
+
+/**
+ * Lazily evaluated flags. Most instructions only produce N, Z, C or V
+ * for the next one to overwrite, so instead of updating regs.p bit by
+ * bit they save the result and operands here and mark the flag lazy.
+ * While a flag's bit is set in lazyFlags its bit in regs.p is stale:
+ * getFlagX() derives it on demand, and statusRegister() folds every
+ * lazy flag back into regs.p before the register is pushed or logged.
+ * The translated code of the JIT sets them the same way.
+ */
+#define FLAG_CARRY 0x01
+#define FLAG_ZERO 0x02
+#define FLAG_OVERFLOW 0x40
+#define FLAG_NEGATIVE 0x80
+
+// Bits of OpcodeDescriptor.flags.
+#define OPCODE_IDLE_SAFE 0x01
+#define OPCODE_WRITES 0x02
+
+/**
+ * A decoded instruction as cached by step(). Holds the opcode
+ * (indexing the descriptor table) and its resolved operand bytes.
+ */
+typedef struct DecodedInstruction {
+  uint8_t opcode;
+  uint8_t arg1;
+  uint8_t arg2;
+  uint8_t valid;
+} DecodedInstruction;
+
+// The most recent candidate idle loop and the CPU state
+// recorded the last time execution arrived at its head.
+typedef struct IdleLoop {
+  uint16_t head;
+  uint8_t length;
+  uint8_t armed;
+  struct registers regs;
+  uint16_t latch;
+  uint64_t cycle;
+  uint32_t steps;
+  uint32_t interrupts;
+} IdleLoop;
+
+// Instruction trace logger (-l), shared by every console.
+extern uint8_t logger;
+extern FILE *logFile;
 
-uint32_t step(void);
+uint8_t getBit(uint8_t, uint8_t);
+void SZFlags(uint8_t);
+uint8_t statusRegister(void);
+uint8_t peekStatusRegister(void);
+void setStatusRegister(uint8_t);
+void initDispatchTable(void);
+void invalidateProgramBank(uint8_t);
+void invalidateRAMInstruction(uint16_t);
+const DecodedInstruction * fetchInstruction(uint16_t);
+void executeInstruction(void);
+void raiseNMI(void);
+void assertIRQ(uint8_t);
+void releaseIRQ(uint8_t);
+void initInterrupts(void);
+void dispatchEvents(void);
+uint8_t idleLoopIteration(uint32_t, uint32_t *, uint32_t *);
+uint64_t skipCycles(uint32_t);
+uint64_t step(void);
 
 #endif
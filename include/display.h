@@ -1,12 +1,32 @@
 #ifndef DISPLAY_H
 #define DISPLAY_H
 
-void init(void);
-void handleEvent(void);
-void prepareScene(void);
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ppu.h"
+
+#define SCREEN_WIDTH 256
+#define SCREEN_HEIGHT 240
+
+// Receives each completed frame: the NES colour of every dot, and the
+// emphasis bits of every scanline (see convertFrame()).
+typedef void (*FrameSink)(const uint8_t *, const uint8_t *);
+
+// Pixel formats the headless backend can dump frames in.
+enum DumpFormat {
+  DUMP_PPM,      // binary PPM (P6) image per frame
+  DUMP_RAW,      // 32-bit ARGB pixels in host byte order
+  DUMP_RGB565    // 16-bit RGB565 pixels in host byte order
+};
+
 void presentScene(void);
 void cleanup(void);
-void doInput(void);
-void runDisplay(void);
+void renderScanline(const uint8_t *, const TileRow *, uint16_t);
+uint32_t color2int(struct color);
+void setFrameSink(FrameSink);
+uint64_t frameHash(void);
+void headlessInit(const char *, enum DumpFormat);
+uint8_t savePPM(const char *, const uint8_t *, const uint8_t *);
 
 #endif
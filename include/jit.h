@@ -0,0 +1,37 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#include "memory.h"
+
+enum CpuBackend { CPU_INTERP, CPU_JIT, CPU_JIT_DIFF };
+
+// How accesses to memory mapped I/O are handled. Differential mode
+// records them while the interpreter runs a block, and replays them
+// to the translated block in place of the handlers.
+enum BusTrace { BUS_DIRECT, BUS_RECORD, BUS_REPLAY };
+
+/**
+ * A translated basic block of PRG ROM.
+ * code returns the number of instructions it executed, fewer
+ * than instructions if it stopped early for a due event.
+ * last is the address of the final byte of the block's
+ * last instruction, so a bank flush can find blocks that
+ * straddle $BFFF/$C000.
+ */
+typedef struct JitBlock {
+  uint32_t (*code)(void);
+  uint16_t last;
+  uint16_t instructions;
+} JitBlock;
+
+uint8_t jitInit(enum CpuBackend);
+void jitInvalidateBank(uint8_t);
+uint64_t jitStep(void);
+void jitReport(void);
+uint8_t jitBusRead(uint16_t, ReadHandler);
+void jitBusWrite(uint16_t, uint8_t, WriteHandler);
+void jitRelease(void);
+
+#endif
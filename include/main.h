@@ -1,6 +1,7 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <stdio.h>
 
@@ -14,13 +15,8 @@ struct Header {
   u_int8_t n_chr_banks; // 8 KB chunks
   u_int8_t n_ram_banks; // 8 KB chunks
 };
-extern struct Header head;
-
-signed char loadHeader(FILE*, struct Header*);
+long loadHeader(const uint8_t*, size_t, struct Header*);
 unsigned char * cpuStartup(void);
 unsigned char * ppuStartup(void);
 
-uint8_t logger;
-FILE *logFile;
-
 #endif
@@ -1,6 +1,37 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stdint.h>
+
+// Controller buttons, in the order the shift register reports them.
+#define BUTTON_A      0x01
+#define BUTTON_B      0x02
+#define BUTTON_SELECT 0x04
+#define BUTTON_START  0x08
+#define BUTTON_UP     0x10
+#define BUTTON_DOWN   0x20
+#define BUTTON_LEFT   0x40
+#define BUTTON_RIGHT  0x80
+
+typedef uint8_t (*ReadHandler)(uint16_t);
+typedef void (*WriteHandler)(uint16_t, uint8_t);
+
+// Describes one 256 byte page of the CPU address space. Accesses go
+// straight to host memory when it is mapped, otherwise to the handler.
+typedef struct MemoryPage {
+  uint8_t * read;
+  uint8_t * write;
+  ReadHandler readHandler;
+  WriteHandler writeHandler;
+  uint8_t decoded;   // Writes must drop cached decoded instructions.
+} MemoryPage;
+
+void initMemoryMap(void);
+void mapPages(uint8_t, uint8_t, uint8_t *, uint8_t *);
+void setPageHandlers(uint8_t, uint8_t, ReadHandler, WriteHandler);
+void setMapperWriteHandler(WriteHandler);
+void mapProgramBank(uint8_t, uint32_t);
+
 uint8_t readByte(unsigned short);
 uint8_t readZeroPage(uint8_t);
 void writeByte(unsigned short, uint8_t);
@@ -1,6 +1,8 @@
 #ifndef MEMORY_MAPPED_H
 #define MEMORY_MAPPED_H
 
+#include <stdint.h>
+
 #define PPUCTRL_NAME_TBL_MASK 0b11
 #define PPUCTRL_VRAM_INC_MASK (1 << 2)
 #define PPUCTRL_SPRITE_ADDR_MASK (1 << 3)
@@ -37,6 +39,53 @@ typedef struct {
   uint16_t PPUWriteLatch; // Actually an 8-bit latch, for now will be ignored
 } MemoryMappedRegisters;
 
-MemoryMappedRegisters ppuRegisters;
+// $2000 (PPUCTRL)
+void setBaseNameTableAddr(uint8_t);
+void setVRAMIncrement(uint8_t);
+void setSpritePatternAddress(uint8_t);
+void setBackgroundPatternAddress(uint8_t);
+void setSpriteSize(uint8_t);
+void setPPUMasterSlave(uint8_t);
+void setNMIGeneration(uint8_t);
+uint8_t getBaseNameTableAddress(void);
+uint8_t getVRAMIncrement(void);
+uint8_t getSpritePatternAddress(void);
+uint8_t getBackgroundPatternAddress(void);
+uint8_t getSpriteSize(void);
+uint8_t getPPUMasterSlave(void);
+uint8_t getNMIGeneration(void);
+
+// $2001 (PPUMASK)
+void setGrayScale(uint8_t);
+void setBackgroundLeftEightPixelsActive(uint8_t);
+void setSpriteLeftEightPixelsActive(uint8_t);
+void setBackground(uint8_t);
+void setSprites(uint8_t);
+void setEmphasizeRed(uint8_t);
+void setEmphasizeGreen(uint8_t);
+void setEmphasizeBlue(uint8_t);
+uint8_t getGrayScale(void);
+uint8_t getBackgroundLeftEightPixelsActive(void);
+uint8_t getSpriteLeftEightPixelsActive(void);
+uint8_t getBackground(void);
+uint8_t getSprites(void);
+uint8_t getEmphasizeRed(void);
+uint8_t getEmphasizeGreen(void);
+uint8_t getEmphasizeBlue(void);
+
+// $2002 (PPUSTATUS)
+void setSpriteOverflow(uint8_t);
+void setSpriteZeroHits(uint8_t);
+void setVerticalBlankStart(uint8_t);
+uint8_t getSpriteOverflow(void);
+uint8_t getSpriteZeroHits(void);
+uint8_t getVerticalBlankStart(void);
+
+// $2003-$2007
+void OAMAddressWrite(uint8_t);
+void OAMDataWrite(uint8_t);
+void scrollWrite(uint8_t);
+void addressWrite(uint8_t);
+void dataWrite(uint8_t);
 
 #endif
@@ -0,0 +1,30 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+
+// Identifies input movies, and the layout version they were written with.
+#define MOVIE_MAGIC 0x4D53454Eu   // "NESM"
+#define MOVIE_VERSION 1
+
+// Controller ports recorded, one byte each per frame.
+#define MOVIE_PORTS 2
+
+// Start of every movie file. The savestate the movie starts from
+// follows, then the input of every frame.
+typedef struct MovieHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ports;
+  uint32_t stateSize;        // Bytes of the starting savestate.
+  uint64_t frames;
+} MovieHeader;
+
+uint8_t movieRecord(void);
+int movieLoad(const char *);
+void movieInput(const uint8_t *);
+uint64_t movieLength(void);
+int movieSave(const char *);
+void movieRelease(void);
+
+#endif
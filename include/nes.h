@@ -0,0 +1,227 @@
+#ifndef NES_H
+#define NES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "display.h"
+#include "main.h"
+#include "memory.h"
+#include "memoryMappedIO.h"
+#include "MMC1.h"
+#include "ppu.h"
+#include "registers.h"
+#include "scheduler.h"
+
+// Frames per second of the NTSC NES.
+#define NTSC_FRAME_RATE 60.0988
+
+struct JitState;
+struct RewindBuffer;
+struct Movie;
+
+/**
+ * One console: the cartridge and every piece of state the emulated
+ * hardware can change. Code always works on the console bound to the
+ * calling thread (nes), so independent consoles can run in parallel
+ * threads of one process. Tables that never change after startup,
+ * such as the opcode descriptors and the palette, are shared.
+ */
+struct nes {
+  // Cartridge: the read-only mapping of the .nes file.
+  struct Header head;
+  uint8_t * image;
+  size_t imageSize;
+  uint8_t * programData;
+  uint8_t * graphicData;
+  uint64_t romHash;            // See cartridgeHash().
+  uint8_t romHashed;           // Set once romHash is computed.
+  struct MMC1 mmc1;
+
+  // CPU.
+  struct registers regs;
+
+  // Master clock: CPU cycles since power-up. Every other component
+  // is timed against it.
+  uint64_t cycle;
+
+  // Value of cycle when the current instruction (or translated block)
+  // started; the CPU timestamp seen by the PPU on register accesses.
+  uint64_t instructionCycle;
+
+  // Number of instructions retired so far, including those of
+  // skipped idle loop iterations and translated blocks.
+  uint64_t instructionCount;
+
+  uint8_t irqLine;             // Sources asserting the (level-triggered) IRQ line.
+  uint32_t interruptCount;     // NMIs and IRQs serviced so far.
+  uint8_t halted;              // Set once a KIL opcode has jammed the CPU.
+
+  // Lazily evaluated flags: see the flag functions in cpu.c.
+  uint8_t lazyFlags;
+  uint8_t lazyResult;          // N and Z
+  uint8_t lazyCarry;           // C, 0 or 1
+  uint8_t lazyOverflowA, lazyOverflowB, lazyOverflowResult;   // V
+
+  // Decoded instructions keyed by program counter. PRG ROM ($8000-$FFFF)
+  // is flushed per 8 KB window on remap, CPU RAM per byte on write.
+  // Code running anywhere else is decoded on every step.
+  DecodedInstruction decodedROM[0x8000];
+  DecodedInstruction decodedRAM[0x0800];
+  DecodedInstruction decodedUncached;
+
+  IdleLoop idle;
+  uint64_t (*cpuStep)(void);   // step() or jitStep().
+  struct JitState * jit;       // Translation cache, if the JIT is in use.
+  uint8_t busTrace;            // enum BusTrace, set by differential mode.
+
+  // Components of CPU memory.
+  uint8_t ram[0x0800];
+  uint8_t apu_io_reg[0x0020];
+  uint8_t exp_rom[0x1FE0];
+  uint8_t sram[0x2000];
+
+  // Standard controllers on ports 1 and 2 ($4016/$4017): the buttons
+  // held this frame, and the shift registers they are read out of.
+  uint8_t buttons[2];
+  uint8_t buttonShift[2];
+  uint8_t controllerStrobe;
+  uint64_t inputFrames;        // Frames of input taken since power-up.
+
+  // PRG ROM ($8000-$FFFF) as four 8 KB windows into the
+  // cartridge program data, switched by the mapper.
+  uint8_t * prgBanks[4];
+
+  // Called for writes to $8000-$FFFF, if the mapper has registers.
+  WriteHandler mapperWrite;
+
+  // Maps each 256 byte page of the CPU address space ($XX00-$XXFF)
+  // to host memory or to the handlers of its registers.
+  MemoryPage pageTable[0x100];
+
+  // Event scheduler.
+  Scheduler scheduler;
+  uint64_t eventHorizon;       // Timestamp of the earliest pending event.
+
+  // PPU registers in CPU memory ($2000-$2007).
+  MemoryMappedRegisters ppuRegisters;
+
+  // The two patten tables in PPU memory ($0000-$1FFF) as
+  // eight 1 KB windows into the cartridge CHR ROM (or CHR RAM),
+  // switched by the mapper.
+  uint8_t * chrBanks[8];
+  uint8_t chrRAM[0x2000];
+
+  // The same windows decoded into tile rows, 8 per 16 byte tile, for
+  // the renderer. CHR ROM is decoded once at load, CHR RAM a row at a
+  // time as it is written.
+  TileRow * tileBanks[8];
+  TileRow * chrROMTiles;
+  TileRow chrRAMTiles[0x2000 / 2];
+
+  // Object attribute memory containing data for 64 sprites.
+  uint8_t primaryOAM[256];
+  uint8_t secondaryOAM[32];
+  uint8_t activeSprite[4];
+  uint8_t secondaryOAMAddr;
+  uint8_t spriteEvalIdx;
+  uint8_t allSpritesEvaluated;
+  uint8_t spriteByte;
+
+  // CIRAM: the console's two nametables, and two more for cartridges
+  // with four-screen RAM.
+  NameTable nameTables[4];
+
+  // Palette bits (0, 4, 8 or 12) of each tile of each nametable,
+  // expanded from the attribute bytes as they are written.
+  uint8_t tilePalettes[4][NT_TILES];
+
+  // The nametable, and its tile palettes, seen at $2000, $2400, $2800
+  // and $2C00. Bound by setMirroring().
+  uint8_t * nameTableSlots[4];
+  uint8_t * paletteSlots[4];
+
+  // The mirroring type for the name tables, and
+  // frame and scanline status as an enumerated type.
+  enum MirroringType mirror;
+  enum FrameStatus lineType;
+  enum ScanlineStatus cycleType;
+
+  // The current count for the scanline and each cycle within.
+  uint16_t scanCount, cycleCount;
+
+  // Number of frames completed, counted at the start of vertical blank.
+  uint64_t frameCount;
+
+  // CPU cycle the PPU has been run up to.
+  uint64_t ppuCycle;
+
+  // The more recent nametable byte that was fetched.
+  uint16_t NTByte;
+
+  // The image and sprite palettes in PPU memory.
+  uint8_t imagePalette[0x10];
+  uint8_t spritePalette[0x10];
+
+  // NES colour of each palette entry, image then sprite, under the
+  // current greyscale bit of PPUMASK. Kept up to date by palette and
+  // mask writes.
+  uint8_t paletteColors[0x20];
+
+  // The palette bits and the decoded tile row of each background tile
+  // fetched for the next scanline.
+  uint8_t pixelBuffer[PIXEL_BUF_SZ];
+  TileRow tileRows[FETCH_CYCLES_PER_SCANLINE];
+
+  // Pixels from the end of each scanline to be
+  // placed at the beginning of the next scanline.
+  uint8_t preRenderPixels[0x10];
+
+  // The picture the PPU renders into: the NES colour of every dot,
+  // and the PPUMASK emphasis bits of every scanline. Holds the
+  // completed frame whenever runFrame() returns; it is converted to
+  // a pixel format only when presented or exported.
+  uint8_t frameBuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+  uint8_t frameEmphasis[SCREEN_HEIGHT];
+
+  // Video backend that shows completed frames, if any.
+  FrameSink frameSink;
+
+  // Set while running frames nobody will see (run-ahead): the PPU
+  // runs as usual but pixels are not composed or presented.
+  uint8_t skipPicture;
+
+  // Savestate of the real frame while run-ahead speculates.
+  uint8_t * aheadState;
+
+  // Idle loop fast-forwarding in runFrame().
+  uint32_t loopCycles, loopSteps;
+
+  // Savestate history, if rewinding is enabled.
+  struct RewindBuffer * rewindBuffer;
+
+  // Input movie being recorded or replayed, if any.
+  struct Movie * movie;
+};
+
+// Statistics of one emulated frame, returned by runFrame().
+typedef struct FrameStats {
+  uint64_t cycles;         // CPU cycles emulated.
+  uint64_t instructions;   // CPU instructions retired.
+  uint64_t wallTime;       // Host time taken, in nanoseconds.
+} FrameStats;
+
+// The console bound to the calling thread.
+extern __thread struct nes * nes;
+
+struct nes * nesCreate(void);
+void nesDestroy(struct nes *);
+void nesBind(struct nes *);
+int nesLoadROM(const char *);
+uint64_t cartridgeHash(void);
+int nesPowerUp(void);
+FrameStats runFrame(void);
+FrameStats runFrameAhead(uint32_t);
+
+#endif
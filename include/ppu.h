@@ -1,7 +1,21 @@
 #ifndef PPU_H
 #define PPU_H
 
-enum MirroringType { HORIZONTAL, VERTICAL, ONE_SCREEN, FOUR_SCREEN };
+#include <stddef.h>
+#include <stdint.h>
+
+// 30 standard fetch cycles, two pre-render fetch cycles 
+#define FETCH_CYCLES_PER_SCANLINE 32
+
+#define PIXEL_BUF_SZ FETCH_CYCLES_PER_SCANLINE
+
+// A row of a pattern table tile, decoded from its two bitplanes into
+// one 2-bit pixel per byte, leftmost pixel in the low byte.
+typedef uint64_t TileRow;
+
+// ONE_SCREEN shows the first nametable everywhere, ONE_SCREEN_UPPER
+// the second.
+enum MirroringType { HORIZONTAL, VERTICAL, ONE_SCREEN, FOUR_SCREEN, ONE_SCREEN_UPPER };
 
 enum FrameStatus { VISIBLE, V_BLANK, POST_RENDER, PRE_RENDER };
 
@@ -9,9 +23,13 @@ enum ScanlineStatus { STANDARD_FETCH, UNUSED_FETCH, H_BLANK, PRE_FETCH };
 
 //enum InterruptType { IRQ, NMI, RESET, NONE };
 
+// Tiles of a nametable. Its attribute bytes follow them.
+#define NT_TILES (32*30)
+
+// A 1 KB nametable: the tile index of each of the 32x30 background
+// tiles, then the attribute bytes that give their palettes.
 typedef struct {
-  uint8_t tbl[32*30];
-  uint8_t attr[8*8];
+  uint8_t bytes[0x400];
 } NameTable;
 
 typedef struct {
@@ -25,13 +43,30 @@ struct color {
   uint8_t rgb[3];
 } __attribute__((packed));
 
+// The NES colours, indexed by palette entry.
+extern const struct color palette[64];
+
+// ARGB value of each NES colour under each combination of the PPUMASK
+// emphasis bits (bits 5-7 shifted down), built by initColorTables().
+extern uint32_t emphasisColors[8][64];
+
 void loadPPU(uint8_t *);
 
 uint8_t readPictureByte(uint16_t);
+void writePictureByte(void);
+void mapCharacterBank(uint8_t, uint32_t);
+void decodeTiles(TileRow *, const uint8_t *, size_t);
+uint8_t decodeCharacterROM(void);
+void ppuStep(void);
+void ppuRun(uint32_t);
+void ppuCatchUp(uint64_t);
+void ppuInit(void);
+void setMirroring(uint8_t);
+void initColorTables(void);
+void updatePaletteColors(void);
+uint32_t ppuDotsUntilStatusChange(void);
 
 void devPrintPatternTable0(void);
 void devPrintNameTable0(void);
-uint8_t imagePalette[0x10];
-uint8_t spritePalette[0x10];
 
 #endif
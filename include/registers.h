@@ -12,6 +12,8 @@ struct registers {
   uint8_t y;
 };
 
-void registerPowerup(struct registers*);
+void cpuRegisterPowerup(struct registers*);
+void ppuRegisterPowerup(void);
+uint8_t registersEqual(const struct registers *, const struct registers *);
 
 #endif
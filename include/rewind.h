@@ -0,0 +1,25 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Frames between keyframes. Every other frame is stored as a delta
+// against the latest keyframe, so any frame decodes from two records.
+#define REWIND_KEYFRAME_INTERVAL 60
+
+// Occupancy of the rewind ring, for reports.
+typedef struct RewindStats {
+  size_t capacity;         // Size of the ring in bytes.
+  size_t used;             // Bytes held by the recorded frames.
+  uint32_t frames;         // Frames that can be rewound to.
+  uint32_t keyframes;
+} RewindStats;
+
+uint8_t rewindInit(size_t);
+void rewindCapture(void);
+uint8_t rewindBack(void);
+void rewindGetStats(RewindStats *);
+void rewindRelease(void);
+
+#endif
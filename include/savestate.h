@@ -0,0 +1,29 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Identifies savestates, and the layout version they were written with.
+#define STATE_MAGIC 0x5345534Eu   // "NESS"
+#define STATE_VERSION 7
+
+// Set in StateHeader.flags if CHR RAM follows the console state.
+#define STATE_CHR_RAM 1
+
+// Start of every savestate.
+typedef struct StateHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;             // Bytes, including this header.
+  uint32_t flags;
+  uint64_t romHash;          // The cartridge the state belongs to.
+} StateHeader;
+
+size_t stateSize(void);
+size_t stateSave(uint8_t *, size_t);
+int stateLoad(const uint8_t *, size_t);
+int stateSaveFile(const char *);
+int stateLoadFile(const char *);
+
+#endif
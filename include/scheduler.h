@@ -0,0 +1,41 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+// Timed events. At most one event of each type is pending.
+enum EventType {
+  EVENT_PPU,          // PPUSTATUS is about to change; catch the PPU up.
+  EVENT_NMI,          // The PPU raised an NMI.
+  EVENT_IRQ,          // The IRQ line may need servicing.
+  EVENT_FRAME_IRQ,    // APU frame counter interrupt.
+  EVENT_MAPPER_IRQ,   // Mapper scanline or cycle counter interrupt.
+  EVENT_COUNT
+};
+
+typedef void (*EventHandler)(uint64_t);
+
+// The padding is spelled out so that every byte of an Event has a
+// defined value; savestates store the heap as raw bytes.
+typedef struct {
+  uint64_t time;
+  uint8_t type;
+  uint8_t reserved[7];
+} Event;
+
+// Binary min-heap of pending events ordered by timestamp.
+// slot[type] is the heap index of the event plus one, or 0 if none.
+// The timestamp of the earliest event is kept in nes->eventHorizon.
+typedef struct Scheduler {
+  Event heap[EVENT_COUNT];
+  uint8_t slot[EVENT_COUNT];
+  uint8_t heapSize;
+  EventHandler handlers[EVENT_COUNT];
+} Scheduler;
+
+void registerEventHandler(enum EventType, EventHandler);
+void scheduleEvent(enum EventType, uint64_t);
+void cancelEvent(enum EventType);
+void runEvents(uint64_t);
+
+#endif
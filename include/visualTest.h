@@ -1,7 +1,12 @@
 #ifndef VISUAL_TEST_H
 #define VISUAL_TEST_H
 
+#include <stdint.h>
+
 unsigned char runDisplay(void);
-void displayInit(void);
+void displayInit(uint8_t);
+uint8_t getDisplayStatus(void);
+uint8_t displayRewindHeld(void);
+void displayReadButtons(uint8_t *);
 
 #endif
@@ -4,28 +4,11 @@
 #include "mappers.h"
 #include "cpu.h"
 #include "main.h"
+#include "memory.h"
 #include "ppu.h"
+#include "nes.h"
 #define KB 1024
 
-extern struct MMC1 mmc1;
-extern struct Header head;
-extern uint8_t prg_rom_lower[0x4000];
-extern uint8_t prg_rom_upper[0x4000];
-
-extern uint8_t pTable0[0x1000];
-extern uint8_t pTable1[0x1000];
-
-extern NameTable nTable0;
-extern NameTable nTable1;
-extern NameTable nTable2;
-extern NameTable nTable3;
-
-extern struct PPU ppu;
-
-// Declare pointers to the cartridge PRG ROM and CHR ROM.
-extern uint8_t * programData;
-extern uint8_t * graphicData;
-
 
 /**
  * Resets the shift register for this memory mapper,
@@ -33,7 +16,7 @@ extern uint8_t * graphicData;
  * and during a reset via a mmc1 write.
  */
 void mmc1Reset(void) {
-  mmc1.shift = 0x10;
+  nes->mmc1.shift = 0x10;
 }
 
 
@@ -57,102 +40,123 @@ void mmc1Reset(void) {
 
 
 void mmc1Write(uint16_t addr, uint8_t val) {
-  if (getBit(val, 7)) mmc1Reset();
+  // A reset also returns PRG ROM to its power-on mode.
+  if (getBit(val, 7)) {
+    mmc1Reset();
+    nes->mmc1.mainControl |= 0b00001100;
+    loadProgramBank();
+    return;
+  }
  
  // Fifth bit write, shift and then load shift register
  // into another register.
- if (getBit(mmc1.shift, 0)) {
-    mmc1.shift = (mmc1.shift >> 1) | (getBit(val, 0) << 4);
-    if (addr > 0x8000 && addr < 0xA000) {
-      mmc1.mainControl = mmc1.shift;
+ if (getBit(nes->mmc1.shift, 0)) {
+    nes->mmc1.shift = (nes->mmc1.shift >> 1) | (getBit(val, 0) << 4);
+    if (addr >= 0x8000 && addr < 0xA000) {
+      nes->mmc1.mainControl = nes->mmc1.shift;
+      loadMirroring();
+      loadProgramBank();
+      loadChrBanks();
     } else if (addr >= 0xA000 && addr < 0xC000) {
-      mmc1.chrBank0 = mmc1.shift;
+      nes->mmc1.chrBank0 = nes->mmc1.shift;
+      loadChrBanks();
     } else if (addr >= 0xC000 && addr < 0xE000) {
-      mmc1.chrBank1 = mmc1.shift;
-    } else if (addr >= 0xE000) {
-      mmc1.prgBank = mmc1.shift;
+      nes->mmc1.chrBank1 = nes->mmc1.shift;
+      loadChrBanks();
     } else {
-      printf("Error: Unexpected address at mmc1Write.\n");
-      exit(1);
+      nes->mmc1.prgBank = nes->mmc1.shift;
+      loadProgramBank();
     }
     mmc1Reset();
   } else {
-    mmc1.shift = (mmc1.shift >> 1) | (getBit(val, 0) << 4);
+    nes->mmc1.shift = (nes->mmc1.shift >> 1) | (getBit(val, 0) << 4);
   }
 }
 
 
 /**
  * Sets the mmc1 registers to their respective
- * power-on values, and loads this file's pointers
- * to the cartridge data.
- *
- * @param p: program data pointer.
- * @param g: graphical data pointer.
+ * power-on values and maps the initial banks.
  */
 uint8_t MMC1Setup(void) {
-  mmc1.mainControl = mmc1.mainControl | 0b00000100;
+  nes->mmc1.mainControl = nes->mmc1.mainControl | 0b00001100;
   mmc1Reset();
+  setMapperWriteHandler(mmc1Write);
+  loadProgramBank();
+  loadChrBanks();
   return 1;
 }
 
 
 
 /**
- * Loads a CHR ROM bank into the ppu memory. Can be loaded into
- * memory in two different ways, based on the value in the 
- * main control register.
- *
- * @param pTablePtr0: Pointer to the start of the first pattern table.
- * @param pTablePtr1: Pointer to the start of the second pattern table.
+ * Maps the CHR ROM bank(s) into the pattern tables. Can be mapped
+ * in two different ways, based on the value in the main control
+ * register. Bank numbers count 4 KB banks.
  */
-void loadChrBanks(uint8_t * pTablePtr0, uint8_t * pTablePtr1) {
-  // Declare and initialize variables to access memory.
-  uint8_t bankNumber = mmc1.chrBank0 & 0b00011111;
-  unsigned long addrStart = 8*KB*bankNumber;
-  
-  // This will load two separate 4 KB banks into memory.
-  if (getBit(mmc1.mainControl, 4)) {
-    memcpy(graphicData + addrStart, pTablePtr0, 4*KB);
-    bankNumber = mmc1.chrBank1 & 0b00011111;
-    addrStart = 8*KB*bankNumber;
-    memcpy(graphicData + addrStart, pTablePtr1, 4*KB);
-  } 
-  // This will load one 8 KB bank into memory.
-  else {
-    memcpy(graphicData + addrStart, pTablePtr0, 4*KB);
-    addrStart += 4*KB;
-    memcpy(graphicData + addrStart, pTablePtr1, 4*KB);
+void loadChrBanks(void) {
+  uint32_t bank0 = nes->mmc1.chrBank0 & 0b00011111;
+  uint32_t bank1 = nes->mmc1.chrBank1 & 0b00011111;
+
+  // Two separate 4 KB banks, one per pattern table.
+  // Otherwise one 8 KB bank, ignoring the low bit.
+  if (!getBit(nes->mmc1.mainControl, 4)) {
+    bank0 &= ~1;
+    bank1 = bank0 + 1;
+  }
+  for (uint8_t window = 0; window < 4; window++) {
+    mapCharacterBank(window, 4 * bank0 + window);
+    mapCharacterBank(window + 4, 4 * bank1 + window);
   }
 }
 
 
 /**
- * Loads a PRG ROM bank into the cpu memory. The first
- * four bits indicate the address of the 16 KB bank(s) in
- * cartridge memory, while the fifth bit indicates
- * the PRG RAM chip is enabled (not yet implemented).
+ * Sets the nametable mirroring selected by the first two bits of the
+ * main control register. Until the control register is first written
+ * the cartridge header's mirroring stays.
  */
-void loadProgramBank() {
-  // Declare and initialize variables to access memory.
-  uint8_t bankNumber = mmc1.prgBank & 0b00001111;
-  unsigned long addrStart = 16*KB*bankNumber;
-
-  // One 16 KB bank is loaded into memory
-  if (getBit(mmc1.mainControl, 3)) {
-    // Bank is loaded into lower PRG ROM
-    if (getBit(mmc1.mainControl, 2)) {
-      memcpy(programData + addrStart, prg_rom_lower, 16*KB);
+void loadMirroring(void) {
+  static const uint8_t mirroring[4] = { ONE_SCREEN, ONE_SCREEN_UPPER, VERTICAL, HORIZONTAL };
+  setMirroring(mirroring[nes->mmc1.mainControl & 0b00000011]);
+}
+
+
+/**
+ * Maps a 16 KB bank into the lower ($8000) or upper ($C000) half
+ * of PRG ROM.
+ */
+static void mapProgramHalf(uint8_t half, uint32_t bank) {
+  mapProgramBank(2 * half, 2 * bank);
+  mapProgramBank(2 * half + 1, 2 * bank + 1);
+}
+
+
+/**
+ * Maps the PRG ROM bank(s) into the cpu memory. The first
+ * four bits indicate the 16 KB bank in cartridge memory,
+ * while the fifth bit indicates the PRG RAM chip is enabled
+ * (not yet implemented).
+ */
+void loadProgramBank(void) {
+  uint32_t bank = nes->mmc1.prgBank & 0b00001111;
+
+  // One 16 KB bank is switched, the other is fixed.
+  if (getBit(nes->mmc1.mainControl, 3)) {
+    // Bank is switched into lower PRG ROM, last bank fixed at $C000.
+    if (getBit(nes->mmc1.mainControl, 2)) {
+      mapProgramHalf(0, bank);
+      mapProgramHalf(1, nes->head.n_prg_banks - 1);
     } 
-    // Bank is loaded into upper PRG ROM  
-    else memcpy(programData + addrStart, prg_rom_upper, 16*KB);
+    // Bank is switched into upper PRG ROM, first bank fixed at $8000.
+    else {
+      mapProgramHalf(0, 0);
+      mapProgramHalf(1, bank);
+    }
   } 
-  // Two 16 KB banks are loaded into memory.
+  // One 32 KB bank, ignoring the low bit.
   else {
-    memcpy(programData + addrStart, prg_rom_lower, 16*KB);
-    addrStart += 16*KB;
-    memcpy(programData + addrStart, prg_rom_upper, 16*KB);
+    mapProgramHalf(0, bank & ~1);
+    mapProgramHalf(1, (bank & ~1) + 1);
   }
 }
-
-
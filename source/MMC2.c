@@ -1,8 +1,34 @@
 // MMC2 memory mapper formally known as UxROM.
-#include "mappers.h"
 #include <stdint.h>
 
+#include "mappers.h"
+#include "memory.h"
+#include "ppu.h"
+#include "nes.h"
+
+
+/**
+ * Switches the 16 KB bank at $8000 to the one selected by the
+ * value written anywhere in $8000-$FFFF.
+ */
+static void uxromWrite(uint16_t addr, uint8_t val) {
+  (void) addr;
+  mapProgramBank(0, 2 * val);
+  mapProgramBank(1, 2 * val + 1);
+}
+
 
+/**
+ * Maps the first 16 KB bank at $8000 and fixes the last one at
+ * $C000. CHR is a single unbanked 8 KB, usually RAM.
+ */
 uint8_t MMC2Setup(void) {
+  uint32_t last = 2 * (nes->head.n_prg_banks - 1);
+  mapProgramBank(0, 0);
+  mapProgramBank(1, 1);
+  mapProgramBank(2, last);
+  mapProgramBank(3, last + 1);
+  for (uint8_t window = 0; window < 8; window++) mapCharacterBank(window, window);
+  setMapperWriteHandler(uxromWrite);
   return 1;
 }
@@ -1,7 +1,29 @@
 // MMC3 memory mapper formally known as CNROM.
-#include "mappers.h"
 #include <stdint.h>
 
+#include "mappers.h"
+#include "memory.h"
+#include "ppu.h"
+#include "nes.h"
+
+
+/**
+ * Switches the 8 KB of CHR to the bank selected by the value
+ * written anywhere in $8000-$FFFF.
+ */
+static void cnromWrite(uint16_t addr, uint8_t val) {
+  (void) addr;
+  for (uint8_t window = 0; window < 8; window++) mapCharacterBank(window, 8 * val + window);
+}
+
+
+/**
+ * Maps 16 or 32 KB of PRG ROM like NROM, and the first 8 KB bank
+ * of CHR ROM.
+ */
 uint8_t MMC3Setup(void) {
+  for (uint8_t window = 0; window < 4; window++) mapProgramBank(window, window);
+  for (uint8_t window = 0; window < 8; window++) mapCharacterBank(window, window);
+  setMapperWriteHandler(cnromWrite);
   return 1;
 }
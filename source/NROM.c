@@ -2,31 +2,19 @@
 #include <stdint.h>
 
 #include "mappers.h"
+#include "memory.h"
 #include "main.h"
 #include "ppu.h"
+#include "nes.h"
 
-extern uint8_t prg_rom_lower[0x4000];
-extern uint8_t prg_rom_upper[0x4000];
-
-extern uint8_t pTable0[0x1000];
-extern uint8_t pTable1[0x1000];
-
-// Redeclare external variable.
-extern struct Header head;
-extern uint8_t * programData;
-extern uint8_t * graphicData;
-
+/**
+ * Maps the whole cartridge: 16 or 32 KB of PRG ROM (a single
+ * 16 KB bank is mirrored at $C000) and 8 KB of CHR.
+ * NROM has no registers, so writes to $8000-$FFFF are ignored.
+ */
 uint8_t NROMSetup(void) {
-  if (head.n_chr_banks == 1) {
-    memcpy(pTable0, graphicData + 0x1000, 0x1000);
-    memcpy(pTable1, graphicData + 0x1000, 0x1000);
-  }
-  if (head.n_prg_banks == 1) {
-    memcpy(prg_rom_lower, programData, 0x4000);
-    memcpy(prg_rom_upper, programData, 0x4000);
-  } else {
-    memcpy(prg_rom_lower, programData, 0x4000);
-    memcpy(prg_rom_upper, programData + 0x4000, 0x4000);
-  }
+  for (uint8_t window = 0; window < 4; window++) mapProgramBank(window, window);
+  for (uint8_t window = 0; window < 8; window++) mapCharacterBank(window, window);
+  setMapperWriteHandler(NULL);
   return 1;
 }
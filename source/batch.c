@@ -0,0 +1,360 @@
+/**
+ * Batch runner. Runs a list of ROM jobs on headless consoles spread
+ * over a pool of worker threads, and prints per-job and aggregate
+ * throughput as JSON.
+ *
+ * The job file holds one job per line:
+ *
+ *   ROM FRAMES [ppm=FILE] [movie=FILE]
+ *
+ * FRAMES is the number of frames to run, ppm= saves the last frame as
+ * a PPM image, and movie= replays an input movie recorded with
+ * display --record. Blank lines and lines starting with # are ignored.
+ *
+ * Jobs are dealt out to the workers' queues up front. A worker takes
+ * jobs from the back of its own queue and, once that is empty, steals
+ * from the front of the others', so long jobs don't leave threads idle.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "compose.h"
+#include "cpu.h"
+#include "display.h"
+#include "jit.h"
+#include "movie.h"
+#include "nes.h"
+
+// Longest line of the job file.
+#define JOB_LINE_MAX 4096
+
+// A ROM job and, once it has run, its results.
+typedef struct Job {
+  char * rom;
+  uint64_t frames;
+  char * ppm;
+  char * movie;
+
+  const char * error;      // Why the job failed, or NULL.
+  uint64_t framesRun;      // Fewer than frames if the CPU halted.
+  uint64_t cycles;
+  uint64_t instructions;
+  uint64_t wallTime;       // Host time spent in runFrame(), in nanoseconds.
+  uint64_t cpuTime;        // CPU time of its worker thread over those frames.
+  uint64_t hash;           // FNV-1a hash of the last frame's pixels.
+  uint8_t halted;
+  int worker;
+} Job;
+
+// A worker thread and its queue of job indices. The owner takes
+// from the tail and thieves from the head, both under lock.
+typedef struct Worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int * queue;
+  int head, tail;
+  int id;
+} Worker;
+
+static Job * jobs;
+static int jobCount;
+static Worker * workers;
+static int workerCount;
+static enum CpuBackend backend = CPU_INTERP;
+
+
+/**
+ * Reads the CPU time consumed by the calling thread. Unlike the wall
+ * clock it stops while the thread waits for a core.
+ *
+ * @returns: CPU time in nanoseconds.
+ */
+static uint64_t threadClock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+/**
+ * Reads the job file.
+ *
+ * @param path: Path of the job file.
+ */
+static void loadJobs(const char * path) {
+  FILE * file = fopen(path, "r");
+  if (!file) {
+    printf("Error: Unable to open job file \"%s\".\n", path);
+    exit(1);
+  }
+  char line[JOB_LINE_MAX];
+  int capacity = 0, lineNumber = 0;
+  while (fgets(line, sizeof(line), file)) {
+    lineNumber++;
+    char * rom = strtok(line, " \t\r\n");
+    if (!rom || rom[0] == '#') continue;
+    char * frames = strtok(NULL, " \t\r\n");
+    char * end = NULL;
+    uint64_t count = frames ? strtoull(frames, &end, 10) : 0;
+    if (!frames || *end || !count) {
+      printf("Error: Line %d of the job file needs a ROM and a frame count.\n", lineNumber);
+      exit(1);
+    }
+    if (jobCount == capacity) {
+      capacity = capacity ? 2 * capacity : 16;
+      jobs = realloc(jobs, capacity * sizeof(Job));
+      if (!jobs) {
+        printf("Error: Out of memory.\n");
+        exit(1);
+      }
+    }
+    Job * job = &jobs[jobCount++];
+    memset(job, 0, sizeof(Job));
+    job->rom = strdup(rom);
+    job->frames = count;
+    for (char * option; (option = strtok(NULL, " \t\r\n")); ) {
+      if (!strncmp(option, "ppm=", 4)) {
+        job->ppm = strdup(option + 4);
+      } else if (!strncmp(option, "movie=", 6)) {
+        job->movie = strdup(option + 6);
+      } else {
+        printf("Error: Unknown job option \"%s\" on line %d.\n", option, lineNumber);
+        exit(1);
+      }
+    }
+  }
+  fclose(file);
+}
+
+
+/**
+ * Runs a job on a new console bound to the calling thread.
+ *
+ * @param job: The job to run.
+ */
+static void runJob(Job * job) {
+  nesBind(nesCreate());
+  if (!nes) {
+    job->error = "out of memory";
+    return;
+  }
+  switch (nesLoadROM(job->rom)) {
+    case -1:
+      job->error = "unable to open the ROM";
+      break;
+    case -2:
+      job->error = "not a valid .nes file";
+      break;
+  }
+  if (!job->error) {
+    switch (nesPowerUp()) {
+      case -1:
+        job->error = "mapper not supported";
+        break;
+      case -2:
+        job->error = "unable to set up the mapper";
+        break;
+    }
+  }
+  if (!job->error) {
+    switch (job->movie ? movieLoad(job->movie) : 0) {
+      case -1:
+        job->error = "not a readable movie";
+        break;
+      case -2:
+        job->error = "movie recorded on another cartridge";
+        break;
+    }
+  }
+  if (!job->error) {
+    jitInit(backend);
+    uint64_t start = threadClock();
+    for (job->framesRun = 0; job->framesRun < job->frames && !nes->halted; job->framesRun++) {
+      uint8_t buttons[MOVIE_PORTS] = { 0 };
+      movieInput(buttons);
+      FrameStats stats = runFrame();
+      job->cycles += stats.cycles;
+      job->instructions += stats.instructions;
+      job->wallTime += stats.wallTime;
+    }
+    job->cpuTime = threadClock() - start;
+    job->halted = nes->halted;
+    job->hash = frameHash();
+    if (job->ppm && !savePPM(job->ppm, nes->frameBuffer, nes->frameEmphasis)) {
+      job->error = "unable to write the PPM file";
+    }
+  }
+  nesDestroy(nes);
+}
+
+
+/**
+ * Takes the next job for a worker: the newest of its own queue,
+ * otherwise the oldest of another worker's queue.
+ *
+ * @param self: The worker asking for a job.
+ *
+ * @returns: Index of the job, or -1 once every queue is empty.
+ */
+static int takeJob(Worker * self) {
+  int job = -1;
+  pthread_mutex_lock(&self->lock);
+  if (self->head < self->tail) job = self->queue[--self->tail];
+  pthread_mutex_unlock(&self->lock);
+
+  for (int i = 1; job < 0 && i < workerCount; i++) {
+    Worker * victim = &workers[(self->id + i) % workerCount];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail) job = victim->queue[victim->head++];
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return job;
+}
+
+
+/**
+ * Worker thread: runs jobs until there are none left.
+ */
+static void * workerMain(void * arg) {
+  Worker * self = arg;
+  for (int job; (job = takeJob(self)) >= 0; ) {
+    jobs[job].worker = self->id;
+    runJob(&jobs[job]);
+  }
+  return NULL;
+}
+
+
+/**
+ * Prints the results of every job and the totals as JSON.
+ *
+ * @param wallTime: Host time taken by the whole batch, in nanoseconds.
+ */
+static void printReport(uint64_t wallTime) {
+  const char * names[] = { "interp", "jit", "diff" };
+  uint64_t frames = 0, instructions = 0, jobTime = 0, cpuTime = 0;
+  int failed = 0;
+
+  printf("{\n  \"backend\": \"%s\",\n", names[backend]);
+  printf("  \"threads\": %d,\n", workerCount);
+  printf("  \"jobs\": [");
+  for (int i = 0; i < jobCount; i++) {
+    Job * job = &jobs[i];
+    double seconds = job->wallTime / 1e9;
+    printf("%s\n    {\n      \"rom\": ", i ? "," : "");
+    printJSONString(job->rom);
+    if (job->error) {
+      printf(",\n      \"error\": ");
+      printJSONString(job->error);
+      printf("\n    }");
+      failed++;
+      continue;
+    }
+    printf(",\n      \"thread\": %d,\n", job->worker);
+    printf("      \"frames\": %" PRIu64 ",\n", job->framesRun);
+    printf("      \"halted\": %s,\n", job->halted ? "true" : "false");
+    printf("      \"cycles\": %" PRIu64 ",\n", job->cycles);
+    printf("      \"instructions\": %" PRIu64 ",\n", job->instructions);
+    printf("      \"frame_hash\": \"%016" PRIx64 "\",\n", job->hash);
+    printf("      \"seconds\": %.6f,\n", seconds);
+    printf("      \"cpu_seconds\": %.6f,\n", job->cpuTime / 1e9);
+    printf("      \"fps\": %.2f,\n", seconds ? job->framesRun / seconds : 0);
+    printf("      \"mips\": %.3f\n    }", seconds ? job->instructions / seconds / 1e6 : 0);
+    frames += job->framesRun;
+    instructions += job->instructions;
+    jobTime += job->wallTime;
+    cpuTime += job->cpuTime;
+  }
+
+  double seconds = wallTime / 1e9;
+  printf("\n  ],\n  \"total\": {\n");
+  printf("    \"jobs\": %d,\n", jobCount);
+  printf("    \"failed\": %d,\n", failed);
+  printf("    \"frames\": %" PRIu64 ",\n", frames);
+  printf("    \"instructions\": %" PRIu64 ",\n", instructions);
+  printf("    \"seconds\": %.6f,\n", seconds);
+  printf("    \"job_seconds\": %.6f,\n", jobTime / 1e9);
+  printf("    \"cpu_seconds\": %.6f,\n", cpuTime / 1e9);
+  printf("    \"fps\": %.2f,\n", seconds ? frames / seconds : 0);
+  printf("    \"mips\": %.3f,\n", seconds ? instructions / seconds / 1e6 : 0);
+  // CPU time over wall time: how many cores were kept busy. Summed
+  // wall time would also count time a worker spent waiting for a core.
+  printf("    \"parallelism\": %.2f\n", seconds ? cpuTime / 1e9 / seconds : 0);
+  printf("  }\n}\n");
+}
+
+
+/**
+ * Runs the batch given on the command line:
+ *
+ *   batch JOBFILE [--threads N] [--cpu=interp|jit|diff]
+ *
+ * The thread count defaults to the number of online cores.
+ */
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Error: Expected a job file.\n");
+    exit(1);
+  }
+  workerCount = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      workerCount = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--cpu=interp")) {
+      backend = CPU_INTERP;
+    } else if (!strcmp(argv[i], "--cpu=jit")) {
+      backend = CPU_JIT;
+    } else if (!strcmp(argv[i], "--cpu=diff")) {
+      backend = CPU_JIT_DIFF;
+    } else {
+      printf("Error: Unknown option \"%s\".\n", argv[i]);
+      exit(1);
+    }
+  }
+  loadJobs(argv[1]);
+  if (workerCount < 1) workerCount = 1;
+  if (workerCount > jobCount) workerCount = jobCount ? jobCount : 1;
+
+  // Deal the jobs out round-robin.
+  workers = calloc(workerCount, sizeof(Worker));
+  int * queues = malloc((jobCount + 1) * sizeof(int) * workerCount);
+  if (!workers || !queues) {
+    printf("Error: Out of memory.\n");
+    exit(1);
+  }
+  for (int w = 0; w < workerCount; w++) {
+    workers[w].id = w;
+    workers[w].queue = queues + w * (jobCount + 1);
+    pthread_mutex_init(&workers[w].lock, NULL);
+  }
+  for (int i = 0; i < jobCount; i++) {
+    Worker * worker = &workers[i % workerCount];
+    worker->queue[worker->tail++] = i;
+  }
+
+  initDispatchTable();
+  composeInit();
+  initColorTables();
+  uint64_t start = benchClock();
+  for (int w = 0; w < workerCount; w++) {
+    if (pthread_create(&workers[w].thread, NULL, workerMain, &workers[w])) {
+      printf("Error: Unable to start worker thread.\n");
+      exit(1);
+    }
+  }
+  for (int w = 0; w < workerCount; w++) pthread_join(workers[w].thread, NULL);
+  printReport(benchClock() - start);
+
+  for (int i = 0; i < jobCount; i++) {
+    if (jobs[i].error) return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,340 @@
+/**
+ * Benchmark mode (--bench). Runs a ROM headless for a fixed number
+ * of frames and prints the emulated totals, the host throughput and
+ * the share of host time taken by each subsystem as JSON. Subsystems
+ * are only timed on a sample of the frames (see BENCH_PROFILE_INTERVAL).
+ *
+ * The emulated totals and the frame hash only depend on the ROM, the
+ * frame count and the CPU backend, so repeated runs can be compared.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "compose.h"
+#include "display.h"
+#include "main.h"
+#include "movie.h"
+#include "nes.h"
+#include "rewind.h"
+#include "savestate.h"
+
+// Subsystems are timed on one frame in this many. Timing reads the
+// clock around every PPU catch-up and scanline, which costs enough to
+// slow the timed frames, so the others run untimed and the totals and
+// throughput stay close to an unprofiled run.
+#define BENCH_PROFILE_INTERVAL 16
+
+// Savestate round trips timed at the end of a benchmark.
+#define BENCH_STATE_ROUNDS 1000
+
+// Frames stepped back through to time rewinding.
+#define BENCH_REWIND_STEPS 600
+
+// Scanlines composed by each function in the compose microbenchmark,
+// cycling through a set of random ones.
+#define BENCH_COMPOSE_LINES 20000
+#define BENCH_COMPOSE_INPUTS 64
+
+// The tiles of a scanline composed into the frame buffer.
+#define BENCH_COMPOSE_TILES 30
+
+// Frames converted to each pixel format by each function in the
+// convert microbenchmark.
+#define BENCH_CONVERT_FRAMES 200
+
+__thread uint8_t benchProfiling = 0;
+__thread uint64_t benchPPUTime = 0;
+__thread uint64_t benchRenderTime = 0;
+
+
+/**
+ * Reads the host's monotonic clock.
+ *
+ * @returns: Current time in nanoseconds.
+ */
+uint64_t benchClock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+/**
+ * Prints a string as a JSON string literal.
+ */
+void printJSONString(const char * s) {
+  putchar('"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') putchar('\\');
+    if ((unsigned char) *s < 0x20) printf("\\u%04x", *s);
+    else putchar(*s);
+  }
+  putchar('"');
+}
+
+
+/**
+ * Prints the rewind figures of a benchmark: how much history the ring
+ * holds, the memory taken per second of history, and the cost of
+ * capturing and of stepping back. Steps back through the history,
+ * so it must come after everything else is measured.
+ *
+ * @param frames: Number of frames run.
+ * @param captureTime: Host time spent capturing, in nanoseconds.
+ * @param wallTime: Host time spent emulating, in nanoseconds.
+ */
+static void printRewindReport(uint64_t frames, uint64_t captureTime, uint64_t wallTime) {
+  RewindStats stats;
+  rewindGetStats(&stats);
+  double history = stats.frames / NTSC_FRAME_RATE;
+
+  uint64_t steps = 0, start = benchClock();
+  while (steps < BENCH_REWIND_STEPS && rewindBack()) steps++;
+  uint64_t stepTime = benchClock() - start;
+
+  printf("  \"rewind\": {\n");
+  printf("    \"ring_bytes\": %zu,\n", stats.capacity);
+  printf("    \"used_bytes\": %zu,\n", stats.used);
+  printf("    \"frames\": %" PRIu32 ",\n", stats.frames);
+  printf("    \"keyframes\": %" PRIu32 ",\n", stats.keyframes);
+  printf("    \"seconds\": %.2f,\n", history);
+  printf("    \"bytes_per_second\": %.0f,\n", history ? stats.used / history : 0);
+  printf("    \"capture_us\": %.3f,\n", frames ? captureTime / 1e3 / frames : 0);
+  printf("    \"capture_share\": %.4f,\n", wallTime ? (double) captureTime / wallTime : 0);
+  printf("    \"step_back_us\": %.3f\n", steps ? stepTime / 1e3 / steps : 0);
+  printf("  },\n");
+}
+
+
+/**
+ * Composes tiles the way renderScanline() did before composing was
+ * vectorized, a pixel at a time through the palette: the reference
+ * the compose functions are checked and timed against.
+ */
+static void composeReference(uint8_t * out, const TileRow * rows, const uint8_t * upper,
+                             int count, const uint8_t * imagePalette) {
+  for (int tile = 0; tile < count; tile++) {
+    for (int x = 0; x < 8; x++) {
+      uint8_t index = upper[tile] | ((rows[tile] >> (8 * x)) & 0x03);
+      out[8*tile + x] = imagePalette[index];
+    }
+  }
+}
+
+
+/**
+ * Prints the compose microbenchmark: every compose function the host
+ * supports, and the reference loop, run on the same random scanlines.
+ * Each function's output is checked against the reference.
+ */
+static void printComposeReport(void) {
+  static TileRow rows[BENCH_COMPOSE_INPUTS][BENCH_COMPOSE_TILES];
+  static uint8_t upper[BENCH_COMPOSE_INPUTS][BENCH_COMPOSE_TILES];
+  static uint8_t imagePalette[BENCH_COMPOSE_INPUTS][16];
+  static uint8_t expected[BENCH_COMPOSE_INPUTS][8 * BENCH_COMPOSE_TILES];
+  uint8_t pixels[8 * BENCH_COMPOSE_TILES];
+
+  // xorshift64, so every run composes the same scanlines.
+  uint64_t seed = 0x9E3779B97F4A7C15ull;
+#define RANDOM() (seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17)
+  for (int i = 0; i < BENCH_COMPOSE_INPUTS; i++) {
+    for (int t = 0; t < BENCH_COMPOSE_TILES; t++) {
+      rows[i][t] = RANDOM() & 0x0303030303030303ull;
+      upper[i][t] = RANDOM() & 0x0C;
+    }
+    for (int p = 0; p < 16; p++) imagePalette[i][p] = RANDOM() % 64;
+  }
+#undef RANDOM
+
+  uint64_t start = benchClock();
+  for (int line = 0; line < BENCH_COMPOSE_LINES; line++) {
+    int i = line % BENCH_COMPOSE_INPUTS;
+    composeReference(expected[i], rows[i], upper[i], BENCH_COMPOSE_TILES, imagePalette[i]);
+  }
+  double referenceTime = (double) (benchClock() - start) / BENCH_COMPOSE_LINES;
+
+  printf("  \"compose\": {\n");
+  printf("    \"selected\": \"%s\",\n", composeNames[composeKind]);
+  printf("    \"reference_ns_per_line\": %.1f", referenceTime);
+  for (int kind = COMPOSE_SCALAR; kind < COMPOSE_KINDS; kind++) {
+    ComposeFunction compose = composeFunction(kind);
+    if (!compose) continue;
+    uint64_t start = benchClock();
+    for (int line = 0; line < BENCH_COMPOSE_LINES; line++) {
+      int i = line % BENCH_COMPOSE_INPUTS;
+      compose(pixels, rows[i], upper[i], BENCH_COMPOSE_TILES, imagePalette[i]);
+    }
+    double time = (double) (benchClock() - start) / BENCH_COMPOSE_LINES;
+
+    uint8_t exact = 1;
+    for (int i = 0; i < BENCH_COMPOSE_INPUTS && exact; i++) {
+      compose(pixels, rows[i], upper[i], BENCH_COMPOSE_TILES, imagePalette[i]);
+      exact = !memcmp(pixels, expected[i], sizeof(pixels));
+    }
+    printf(",\n    \"%s\": { \"ns_per_line\": %.1f, \"speedup\": %.2f, \"bit_exact\": %s }",
+           composeNames[kind], time, time ? referenceTime / time : 0, exact ? "true" : "false");
+  }
+  printf("\n  },\n");
+}
+
+
+/**
+ * Prints the convert microbenchmark: a random frame converted to every
+ * pixel format by every convert function the host supports. Each
+ * function's output is checked against a pixel at a time lookup of
+ * the colour tables.
+ */
+static void printConvertReport(void) {
+  static uint8_t frame[SCREEN_WIDTH * SCREEN_HEIGHT], emphasis[SCREEN_HEIGHT];
+  static uint8_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT * 4], expected[SCREEN_WIDTH * SCREEN_HEIGHT * 4];
+  static const char * const formatNames[PIXEL_FORMATS] = { "argb8888", "rgb565", "rgb24" };
+
+  // A random frame, seeded as in printComposeReport().
+  uint64_t seed = 0x9E3779B97F4A7C15ull;
+#define RANDOM() (seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17)
+  for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) frame[i] = RANDOM() % 64;
+  // Emphasis changes every 16 scanlines, as a game might split the screen.
+  for (int y = 0; y < SCREEN_HEIGHT; y++) emphasis[y] = y % 16 ? emphasis[y - 1] : RANDOM() % 8;
+#undef RANDOM
+
+  printf("  \"convert\": {\n");
+  printf("    \"frame_bytes\": %zu,\n", sizeof(frame) + sizeof(emphasis));
+  printf("    \"argb_bytes\": %zu", sizeof(uint32_t) * SCREEN_WIDTH * SCREEN_HEIGHT);
+  ConvertFunction selected = convertPixels;
+  for (int format = 0; format < PIXEL_FORMATS; format++) {
+    size_t rowBytes = SCREEN_WIDTH * pixelBytes[format];
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+      for (int x = 0; x < SCREEN_WIDTH; x++) {
+        uint32_t argb = emphasisColors[emphasis[y]][frame[SCREEN_WIDTH * y + x]];
+        uint8_t * out = expected + rowBytes * y + pixelBytes[format] * x;
+        if (format == PIXEL_ARGB8888) {
+          memcpy(out, &argb, sizeof(argb));
+        } else if (format == PIXEL_RGB565) {
+          uint16_t rgb = ((argb >> 19 & 0x1F) << 11) | ((argb >> 10 & 0x3F) << 5) | (argb >> 3 & 0x1F);
+          memcpy(out, &rgb, sizeof(rgb));
+        } else {
+          out[0] = argb >> 16;
+          out[1] = argb >> 8;
+          out[2] = argb;
+        }
+      }
+    }
+
+    printf(",\n    \"%s\": {", formatNames[format]);
+    const char * separator = " ";
+    for (int kind = COMPOSE_SCALAR; kind < COMPOSE_KINDS; kind++) {
+      convertPixels = convertFunction(kind);
+      if (!convertPixels) continue;
+      uint64_t start = benchClock();
+      for (int i = 0; i < BENCH_CONVERT_FRAMES; i++) {
+        convertFrame(pixels, rowBytes, frame, emphasis, format);
+      }
+      double time = (double) (benchClock() - start) / BENCH_CONVERT_FRAMES;
+      uint8_t exact = !memcmp(pixels, expected, rowBytes * SCREEN_HEIGHT);
+      printf("%s\"%s\": { \"us_per_frame\": %.2f, \"bit_exact\": %s }",
+             separator, composeNames[kind], time / 1e3, exact ? "true" : "false");
+      separator = ", ";
+    }
+    printf(" }");
+  }
+  convertPixels = selected;
+  printf("\n  },\n");
+}
+
+
+/**
+ * Runs the loaded ROM for a number of frames with presentation
+ * disabled and prints the results to standard output.
+ *
+ * @param rom: Name of the ROM file, for the report.
+ * @param backend: Name of the CPU backend, for the report.
+ * @param frames: Number of frames to run.
+ * @param runAhead: Frames to run ahead of each one (see runFrameAhead()).
+ */
+void runBenchmark(const char * rom, const char * backend, uint64_t frames, uint32_t runAhead) {
+  uint64_t cycles = 0, instructions = 0, wallTime = 0, captureTime = 0;
+  uint64_t profiledTime = 0, profiledFrames = 0;
+
+  // A KIL opcode ends the run early; only the frames run are reported.
+  uint64_t run;
+  for (run = 0; run < frames && !nes->halted; run++) {
+    // Replays the input movie, if one was loaded.
+    uint8_t buttons[MOVIE_PORTS] = { 0 };
+    movieInput(buttons);
+    benchProfiling = run % BENCH_PROFILE_INTERVAL == 0;
+    FrameStats stats = runFrameAhead(runAhead);
+    cycles += stats.cycles;
+    instructions += stats.instructions;
+    wallTime += stats.wallTime;
+    if (benchProfiling) {
+      profiledTime += stats.wallTime;
+      profiledFrames++;
+    }
+    if (nes->rewindBuffer) {
+      uint64_t start = benchClock();
+      rewindCapture();
+      captureTime += benchClock() - start;
+    }
+  }
+  benchProfiling = 0;
+
+  uint64_t hash = frameHash();
+
+  // Time savestates of the final state, averaged over many round trips.
+  size_t stateBytes = stateSize();
+  uint8_t * state = malloc(stateBytes);
+  uint64_t saveTime = 0, loadTime = 0;
+  if (state) {
+    uint64_t start = benchClock();
+    for (int i = 0; i < BENCH_STATE_ROUNDS; i++) stateSave(state, stateBytes);
+    saveTime = benchClock() - start;
+    start = benchClock();
+    for (int i = 0; i < BENCH_STATE_ROUNDS; i++) stateLoad(state, stateBytes);
+    loadTime = benchClock() - start;
+    free(state);
+  }
+
+  double seconds = wallTime / 1e9;
+  uint64_t dots = 3 * cycles;
+  // Shares of the timed frames. The CPU's share is whatever was not
+  // spent catching the PPU up.
+  uint64_t cpuTime = profiledTime > benchPPUTime ? profiledTime - benchPPUTime : 0;
+  uint64_t ppuTime = benchPPUTime - benchRenderTime;
+  double total = profiledTime ? profiledTime : 1;
+
+  printf("{\n  \"rom\": ");
+  printJSONString(rom);
+  printf(",\n  \"backend\": \"%s\",\n", backend);
+  printf("  \"run_ahead\": %" PRIu32 ",\n", runAhead);
+  printf("  \"frames\": %" PRIu64 ",\n", run);
+  printf("  \"cycles\": %" PRIu64 ",\n", cycles);
+  printf("  \"instructions\": %" PRIu64 ",\n", instructions);
+  printf("  \"ppu_dots\": %" PRIu64 ",\n", dots);
+  printf("  \"frame_hash\": \"%016" PRIx64 "\",\n", hash);
+  printf("  \"seconds\": %.6f,\n", seconds);
+  printf("  \"fps\": %.2f,\n", seconds ? run / seconds : 0);
+  printf("  \"mips\": %.3f,\n", seconds ? instructions / seconds / 1e6 : 0);
+  printf("  \"ppu_dots_per_second\": %.0f,\n", seconds ? dots / seconds : 0);
+  // Host time per frame shown, speculative frames included, and its
+  // share of the time a real console takes to show one.
+  printf("  \"frame_us\": %.3f,\n", run ? wallTime / 1e3 / run : 0);
+  printf("  \"frame_budget\": %.4f,\n", run ? wallTime / 1e9 / run * NTSC_FRAME_RATE : 0);
+  printf("  \"state_bytes\": %zu,\n", stateBytes);
+  printf("  \"state_save_us\": %.3f,\n", saveTime / 1e3 / BENCH_STATE_ROUNDS);
+  printf("  \"state_load_us\": %.3f,\n", loadTime / 1e3 / BENCH_STATE_ROUNDS);
+  printComposeReport();
+  printConvertReport();
+  if (nes->rewindBuffer) printRewindReport(run, captureTime, wallTime);
+  printf("  \"time_share\": {\n");
+  printf("    \"frames\": %" PRIu64 ",\n", profiledFrames);
+  printf("    \"step\": %.4f,\n", cpuTime / total);
+  printf("    \"ppuStep\": %.4f,\n", ppuTime / total);
+  printf("    \"renderScanline\": %.4f\n", benchRenderTime / total);
+  printf("  }\n}\n");
+}
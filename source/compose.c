@@ -0,0 +1,394 @@
+/**
+ * Scanline pixel composition, and conversion of finished frames to
+ * the pixel formats they are presented and exported in.
+ *
+ * Background pixels are palette indices from 0 to 15 looked up in the
+ * NES colours of the 16 background palette entries, which fits a byte
+ * shuffle: each shuffle composes 16 (SSSE3) or 32 (AVX2) pixels.
+ * Frames hold NES colours from 0 to 63, converted through a table of
+ * 64 per byte of the pixel format: four shuffles, one per quarter of
+ * the table, look up each byte of 16 or 32 pixels.
+ *
+ * The SIMD functions are compiled for their instruction set with
+ * target attributes, so the rest of the program needs no extra flags,
+ * and composeInit() picks the fastest the host CPU supports.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMPOSE_X86
+#endif
+
+#include "compose.h"
+#include "display.h"
+
+// Copies a byte into each byte of a tile row.
+#define SPREAD(b) ((TileRow) (b) * 0x0101010101010101ull)
+
+ComposeFunction composeTiles;
+ConvertFunction convertPixels;
+enum ComposeKind composeKind;
+
+const char * const composeNames[COMPOSE_KINDS] = { "scalar", "ssse3", "avx2" };
+
+const uint8_t pixelBytes[PIXEL_FORMATS] = { 4, 2, 3 };
+
+
+/**
+ * Composes tiles a pixel at a time. Runs on any host.
+ */
+static void composeScalar(uint8_t * out, const TileRow * rows, const uint8_t * upper,
+                          int count, const uint8_t * colors) {
+  for (int tile = 0; tile < count; tile++) {
+    TileRow indices = rows[tile] | SPREAD(upper[tile]);
+    for (int x = 0; x < 8; x++) out[8*tile + x] = colors[(indices >> (8 * x)) & 0x0F];
+  }
+}
+
+
+/**
+ * Converts pixels a byte at a time.
+ */
+static inline void convertBytes(uint8_t * out, const uint8_t * colors, int count,
+                                const uint8_t (*planes)[64], int bytes) {
+  for (int i = 0; i < count; i++, out += bytes) {
+    uint8_t color = colors[i];
+    out[0] = planes[0][color];
+    out[1] = planes[1][color];
+    if (bytes > 2) out[2] = planes[2][color];
+    if (bytes > 3) out[3] = planes[3][color];
+  }
+}
+
+
+/**
+ * Converts pixels a byte at a time. Runs on any host.
+ */
+static void convertScalar(uint8_t * out, const uint8_t * colors, int count,
+                          const uint8_t (*planes)[64], int bytes) {
+  // A constant pixel size drops the checks from the loop.
+  switch (bytes) {
+    case 2:
+      convertBytes(out, colors, count, planes, 2);
+      break;
+    case 3:
+      convertBytes(out, colors, count, planes, 3);
+      break;
+    default:
+      convertBytes(out, colors, count, planes, 4);
+  }
+}
+
+
+#ifdef COMPOSE_X86
+
+/**
+ * Composes tiles two at a time with SSSE3 byte shuffles.
+ */
+__attribute__((target("ssse3")))
+static void composeSSSE3(uint8_t * out, const TileRow * rows, const uint8_t * upper,
+                         int count, const uint8_t * colors) {
+  __m128i table = _mm_loadu_si128((const __m128i *) colors);
+  int tile = 0;
+  for (; tile + 2 <= count; tile += 2) {
+    __m128i indices = _mm_set_epi64x(rows[tile + 1] | SPREAD(upper[tile + 1]),
+                                     rows[tile] | SPREAD(upper[tile]));
+    _mm_storeu_si128((__m128i *) (out + 8*tile), _mm_shuffle_epi8(table, indices));
+  }
+  composeScalar(out + 8*tile, rows + tile, upper + tile, count - tile, colors);
+}
+
+
+/**
+ * Composes tiles four at a time with AVX2 byte shuffles.
+ */
+__attribute__((target("avx2")))
+static void composeAVX2(uint8_t * out, const TileRow * rows, const uint8_t * upper,
+                        int count, const uint8_t * colors) {
+  __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) colors));
+  int tile = 0;
+  for (; tile + 4 <= count; tile += 4) {
+    __m256i indices = _mm256_set_epi64x(rows[tile + 3] | SPREAD(upper[tile + 3]),
+                                        rows[tile + 2] | SPREAD(upper[tile + 2]),
+                                        rows[tile + 1] | SPREAD(upper[tile + 1]),
+                                        rows[tile] | SPREAD(upper[tile]));
+    _mm256_storeu_si256((__m256i *) (out + 8*tile), _mm256_shuffle_epi8(table, indices));
+  }
+  // The SSE code that follows would stall on the dirty upper halves.
+  _mm256_zeroupper();
+  composeSSSE3(out + 8*tile, rows + tile, upper + tile, count - tile, colors);
+}
+
+
+/**
+ * Gives the shuffle indices of 16 NES colours into each quarter of a
+ * table of 64 bytes. Colours of the other quarters get bit 7 set,
+ * which shuffles in zero.
+ */
+__attribute__((target("ssse3")))
+static inline void quarterIndices(__m128i colors, __m128i * local) {
+  for (int q = 0; q < 4; q++) {
+    local[q] = _mm_adds_epu8(_mm_sub_epi8(colors, _mm_set1_epi8(16 * q)), _mm_set1_epi8(0x70));
+  }
+}
+
+
+/**
+ * Looks up 16 NES colours in a table of 64 bytes, held a quarter per
+ * register, given their quarterIndices().
+ */
+__attribute__((target("ssse3")))
+static inline __m128i lookup64(const __m128i * quarters, const __m128i * local) {
+  return _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(quarters[0], local[0]),
+                                   _mm_shuffle_epi8(quarters[1], local[1])),
+                      _mm_or_si128(_mm_shuffle_epi8(quarters[2], local[2]),
+                                   _mm_shuffle_epi8(quarters[3], local[3])));
+}
+
+
+/**
+ * Converts pixels 16 at a time with SSSE3 byte shuffles. Pixels of
+ * three bytes are built as four with a zero byte, then packed.
+ */
+__attribute__((target("ssse3")))
+static void convertSSSE3(uint8_t * out, const uint8_t * colors, int count,
+                         const uint8_t (*planes)[64], int bytes) {
+  __m128i quarters[4][4];
+  for (int b = 0; b < bytes; b++) {
+    for (int q = 0; q < 4; q++) quarters[b][q] = _mm_loadu_si128((const __m128i *) (planes[b] + 16*q));
+  }
+  const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i local[4];
+    quarterIndices(_mm_loadu_si128((const __m128i *) (colors + i)), local);
+    __m128i p0 = lookup64(quarters[0], local);
+    __m128i p1 = lookup64(quarters[1], local);
+    __m128i * pixels = (__m128i *) (out + bytes * i);
+    if (bytes == 2) {
+      _mm_storeu_si128(pixels, _mm_unpacklo_epi8(p0, p1));
+      _mm_storeu_si128(pixels + 1, _mm_unpackhi_epi8(p0, p1));
+      continue;
+    }
+    __m128i p2 = lookup64(quarters[2], local);
+    __m128i p3 = bytes == 4 ? lookup64(quarters[3], local) : _mm_setzero_si128();
+    __m128i low01 = _mm_unpacklo_epi8(p0, p1), high01 = _mm_unpackhi_epi8(p0, p1);
+    __m128i low23 = _mm_unpacklo_epi8(p2, p3), high23 = _mm_unpackhi_epi8(p2, p3);
+    __m128i quads[4] = {
+      _mm_unpacklo_epi16(low01, low23), _mm_unpackhi_epi16(low01, low23),
+      _mm_unpacklo_epi16(high01, high23), _mm_unpackhi_epi16(high01, high23)
+    };
+    for (int q = 0; q < 4; q++) {
+      if (bytes == 4) {
+        _mm_storeu_si128(pixels + q, quads[q]);
+      } else {
+        // 12 bytes of each 4 pixels: 8, then 4.
+        __m128i packed = _mm_shuffle_epi8(quads[q], pack);
+        uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+        _mm_storel_epi64((__m128i *) (out + 3 * (i + 4*q)), packed);
+        memcpy(out + 3 * (i + 4*q) + 8, &last, sizeof(last));
+      }
+    }
+  }
+  convertScalar(out + bytes * i, colors + i, count - i, planes, bytes);
+}
+
+
+/**
+ * Gives the shuffle indices of 32 NES colours, as quarterIndices().
+ */
+__attribute__((target("avx2")))
+static inline void quarterIndicesx2(__m256i colors, __m256i * local) {
+  for (int q = 0; q < 4; q++) {
+    local[q] = _mm256_adds_epu8(_mm256_sub_epi8(colors, _mm256_set1_epi8(16 * q)),
+                                _mm256_set1_epi8(0x70));
+  }
+}
+
+
+/**
+ * Looks up 32 NES colours in a table of 64 bytes, as lookup64().
+ */
+__attribute__((target("avx2")))
+static inline __m256i lookup64x2(const __m256i * quarters, const __m256i * local) {
+  return _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(quarters[0], local[0]),
+                                         _mm256_shuffle_epi8(quarters[1], local[1])),
+                         _mm256_or_si256(_mm256_shuffle_epi8(quarters[2], local[2]),
+                                         _mm256_shuffle_epi8(quarters[3], local[3])));
+}
+
+
+/**
+ * Converts pixels 32 at a time with AVX2 byte shuffles. Unpacks work
+ * within 128-bit lanes, so the upper lane holds pixels 16-31 until
+ * the halves are put back in order for the stores. Pixels of three
+ * bytes are left to the SSSE3 function.
+ */
+__attribute__((target("avx2")))
+static void convertAVX2(uint8_t * out, const uint8_t * colors, int count,
+                        const uint8_t (*planes)[64], int bytes) {
+  if (bytes == 3) {
+    convertSSSE3(out, colors, count, planes, bytes);
+    return;
+  }
+  __m256i quarters[4][4];
+  for (int b = 0; b < bytes; b++) {
+    for (int q = 0; q < 4; q++) {
+      quarters[b][q] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (planes[b] + 16*q)));
+    }
+  }
+
+  int i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i local[4];
+    quarterIndicesx2(_mm256_loadu_si256((const __m256i *) (colors + i)), local);
+    __m256i p0 = lookup64x2(quarters[0], local);
+    __m256i p1 = lookup64x2(quarters[1], local);
+    __m256i low01 = _mm256_unpacklo_epi8(p0, p1), high01 = _mm256_unpackhi_epi8(p0, p1);
+    __m256i * pixels = (__m256i *) (out + bytes * i);
+    if (bytes == 2) {
+      // Pixels 0-7 and 16-23, 8-15 and 24-31.
+      _mm256_storeu_si256(pixels, _mm256_permute2x128_si256(low01, high01, 0x20));
+      _mm256_storeu_si256(pixels + 1, _mm256_permute2x128_si256(low01, high01, 0x31));
+      continue;
+    }
+    __m256i p2 = lookup64x2(quarters[2], local);
+    __m256i p3 = lookup64x2(quarters[3], local);
+    __m256i low23 = _mm256_unpacklo_epi8(p2, p3), high23 = _mm256_unpackhi_epi8(p2, p3);
+    // Pixels 0-3 and 16-19, 4-7 and 20-23, 8-11 and 24-27, 12-15 and 28-31.
+    __m256i q0 = _mm256_unpacklo_epi16(low01, low23);
+    __m256i q1 = _mm256_unpackhi_epi16(low01, low23);
+    __m256i q2 = _mm256_unpacklo_epi16(high01, high23);
+    __m256i q3 = _mm256_unpackhi_epi16(high01, high23);
+    _mm256_storeu_si256(pixels, _mm256_permute2x128_si256(q0, q1, 0x20));
+    _mm256_storeu_si256(pixels + 1, _mm256_permute2x128_si256(q2, q3, 0x20));
+    _mm256_storeu_si256(pixels + 2, _mm256_permute2x128_si256(q0, q1, 0x31));
+    _mm256_storeu_si256(pixels + 3, _mm256_permute2x128_si256(q2, q3, 0x31));
+  }
+  // As in composeAVX2(), before handing over to SSE code.
+  _mm256_zeroupper();
+  convertSSSE3(out + bytes * i, colors + i, count - i, planes, bytes);
+}
+
+#endif
+
+
+/**
+ * Gives a composing function, if the host CPU can run it.
+ *
+ * @param kind: The function wanted.
+ *
+ * @returns: The function, or NULL if the host lacks its instructions.
+ */
+ComposeFunction composeFunction(enum ComposeKind kind) {
+  switch (kind) {
+    case COMPOSE_SCALAR:
+      return composeScalar;
+#ifdef COMPOSE_X86
+    case COMPOSE_SSSE3:
+      return __builtin_cpu_supports("ssse3") ? composeSSSE3 : NULL;
+    case COMPOSE_AVX2:
+      return __builtin_cpu_supports("avx2") ? composeAVX2 : NULL;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+
+/**
+ * Gives a converting function, if the host CPU can run it.
+ *
+ * @param kind: The function wanted.
+ *
+ * @returns: The function, or NULL if the host lacks its instructions.
+ */
+ConvertFunction convertFunction(enum ComposeKind kind) {
+  switch (kind) {
+    case COMPOSE_SCALAR:
+      return convertScalar;
+#ifdef COMPOSE_X86
+    case COMPOSE_SSSE3:
+      return __builtin_cpu_supports("ssse3") ? convertSSSE3 : NULL;
+    case COMPOSE_AVX2:
+      return __builtin_cpu_supports("avx2") ? convertAVX2 : NULL;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+
+/**
+ * Selects the fastest composing and converting functions the host
+ * CPU supports. Called once, before any console renders.
+ */
+void composeInit(void) {
+#ifdef COMPOSE_X86
+  __builtin_cpu_init();
+#endif
+  for (int kind = COMPOSE_SCALAR; kind < COMPOSE_KINDS; kind++) {
+    ComposeFunction compose = composeFunction(kind);
+    if (compose) {
+      composeTiles = compose;
+      convertPixels = convertFunction(kind);
+      composeKind = kind;
+    }
+  }
+}
+
+
+/**
+ * Splits the colours of an emphasis into one table per byte of a
+ * pixel format, in the order the bytes are stored.
+ *
+ * @param planes: Where to write the tables.
+ * @param emphasis: Emphasis bits, 0-7.
+ * @param format: The pixel format.
+ */
+static void buildPlanes(uint8_t planes[4][64], uint8_t emphasis, enum PixelFormat format) {
+  for (int i = 0; i < 64; i++) {
+    uint32_t argb = emphasisColors[emphasis][i];
+    uint8_t bytes[4];
+    if (format == PIXEL_ARGB8888) {
+      memcpy(bytes, &argb, sizeof(argb));
+    } else if (format == PIXEL_RGB565) {
+      uint16_t rgb = ((argb >> 8) & 0xF800) | ((argb >> 5) & 0x07E0) | ((argb >> 3) & 0x001F);
+      memcpy(bytes, &rgb, sizeof(rgb));
+    } else {
+      bytes[0] = argb >> 16;
+      bytes[1] = argb >> 8;
+      bytes[2] = argb;
+    }
+    for (int b = 0; b < pixelBytes[format]; b++) planes[b][i] = bytes[b];
+  }
+}
+
+
+/**
+ * Converts a frame into a pixel format, each scanline through the
+ * colours of the emphasis it was drawn with. composeInit() and
+ * initColorTables() must have been called.
+ *
+ * @param out: Where to write the pixels.
+ * @param pitch: Bytes from one row of out to the next.
+ * @param frame: NES colour of every dot.
+ * @param emphasis: Emphasis bits of every scanline.
+ * @param format: The pixel format to write.
+ */
+void convertFrame(uint8_t * out, size_t pitch, const uint8_t * frame,
+                  const uint8_t * emphasis, enum PixelFormat format) {
+  uint8_t planes[4][64];
+  int built = -1;
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    // Emphasis rarely changes within a frame, so neither do the tables.
+    if (emphasis[y] != built) {
+      buildPlanes(planes, emphasis[y], format);
+      built = emphasis[y];
+    }
+    convertPixels(out + pitch * y, frame + SCREEN_WIDTH * y, SCREEN_WIDTH, planes, pixelBytes[format]);
+  }
+}
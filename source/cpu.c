@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
 
 #include "ppu.h"//delete this
 #include "cpu.h"
@@ -8,20 +10,20 @@
 #include "memoryMappedIO.h"
 #include "registers.h"
 #include "main.h"
+#include "jit.h"
+#include "scheduler.h"
+#include "nes.h"
 
 #define KB 1024
 
-extern NameTable nTable0;
+// Labels-as-values are a GNU extension; fall back to a switch elsewhere.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO
+#endif
 
-extern struct registers regs;
-extern uint8_t prg_rom_lower[0x4000];
-extern uint8_t prg_rom_upper[0x4000];
-
-uint32_t cycle = 7;
-
-void nan(void);
-
-uint8_t interrupted = 0;
+// Instruction trace logger (-l).
+uint8_t logger = 0;
+FILE *logFile;
 
 /**
  * OPCODES WITH ADDITIONAL CYCLE FOR PAGE BOUNDARY CROSSING
@@ -64,30 +66,34 @@ const uint8_t cycles[256] = {
  */
 
 void setFlagCarry(uint8_t bit)  {
-  regs.p = bit ? regs.p | 0b00000001 : regs.p & 0b11111110;
+  nes->lazyCarry = bit != 0;
+  nes->lazyFlags |= FLAG_CARRY;
 }
 void setFlagZero(uint8_t bit) { 
-  regs.p = bit ? regs.p | 0b00000010 : regs.p & 0b11111101; 
+  nes->lazyFlags &= ~FLAG_ZERO;
+  nes->regs.p = bit ? nes->regs.p | 0b00000010 : nes->regs.p & 0b11111101; 
 }
 
 void setFlagInterrupt(uint8_t bit) {
-  regs.p = bit ? regs.p | 0b00000100 : regs.p & 0b11111011; 
+  nes->regs.p = bit ? nes->regs.p | 0b00000100 : nes->regs.p & 0b11111011; 
 }
 
 void setFlagDecimal(uint8_t bit) {
-  regs.p = bit ? regs.p | 0b00001000 : regs.p & 0b11110111; 
+  nes->regs.p = bit ? nes->regs.p | 0b00001000 : nes->regs.p & 0b11110111; 
 }
 
 void setFlagBreak(uint8_t bit) { 
-  regs.p = bit ? regs.p | 0b00010000 : regs.p & 0b11101111;
+  nes->regs.p = bit ? nes->regs.p | 0b00010000 : nes->regs.p & 0b11101111;
 }
 
 void setFlagOverflow(uint8_t bit) { 
-  regs.p = bit ? regs.p | 0b01000000 : regs.p & 0b10111111;
+  nes->lazyFlags &= ~FLAG_OVERFLOW;
+  nes->regs.p = bit ? nes->regs.p | 0b01000000 : nes->regs.p & 0b10111111;
 }
 
 void setFlagNegative(uint8_t bit) {
-  regs.p = bit ? regs.p | 0b10000000 : regs.p & 0b01111111;
+  nes->lazyFlags &= ~FLAG_NEGATIVE;
+  nes->regs.p = bit ? nes->regs.p | 0b10000000 : nes->regs.p & 0b01111111;
 }
 
 
@@ -112,37 +118,123 @@ uint8_t getBit(uint8_t byte, uint8_t bit) {
  * @returns: Flag value. Returns 1 for set or 0 for clear.
  */
 
-uint8_t getFlagCarry(void) { return getBit(regs.p, 0); }
+uint8_t getFlagCarry(void) {
+  return nes->lazyFlags & FLAG_CARRY ? nes->lazyCarry : nes->regs.p & 1;
+}
+
+uint8_t getFlagZero(void) {
+  return nes->lazyFlags & FLAG_ZERO ? nes->lazyResult == 0 : (nes->regs.p >> 1) & 1;
+}
 
-uint8_t getFlagZero(void) { return getBit(regs.p, 1); }
+uint8_t getFlagInterrupt(void) { return getBit(nes->regs.p, 2); }
 
-uint8_t getFlagInterrupt(void) { return getBit(regs.p, 2); }
+uint8_t getFlagDecimal(void) { return getBit(nes->regs.p, 3); }
 
-uint8_t getFlagDecimal(void) { return getBit(regs.p, 3); }
+uint8_t getFlagBreak(void) { return getBit(nes->regs.p, 4); }
+
+uint8_t getFlagOverflow(void) {
+  if (nes->lazyFlags & FLAG_OVERFLOW) {
+    // Operands of equal sign producing a result of the other sign.
+    return (~(nes->lazyOverflowA ^ nes->lazyOverflowB) & (nes->lazyOverflowA ^ nes->lazyOverflowResult)) >> 7;
+  }
+  return (nes->regs.p >> 6) & 1;
+}
+
+uint8_t getFlagNegative(void) {
+  return nes->lazyFlags & FLAG_NEGATIVE ? nes->lazyResult >> 7 : nes->regs.p >> 7;
+}
 
-uint8_t getFlagBreak(void) { return getBit(regs.p, 4); }
 
-uint8_t getFlagOverflow(void) { return getBit(regs.p, 6); }
+/**
+ * Folds all lazily evaluated flags into regs.p.
+ *
+ * @returns: The up to date status register.
+ */
+uint8_t statusRegister(void) {
+  if (nes->lazyFlags) {
+    nes->regs.p = peekStatusRegister();
+    nes->lazyFlags = 0;
+  }
+  return nes->regs.p;
+}
+
+
+/**
+ * Computes the status register with every lazy flag folded in, like
+ * statusRegister(), but leaves the lazy flags and regs.p untouched.
+ *
+ * @returns: Value of the status register.
+ */
+uint8_t peekStatusRegister(void) {
+  uint8_t p = nes->regs.p & ~nes->lazyFlags;
+  if (nes->lazyFlags & FLAG_CARRY) p |= getFlagCarry();
+  if (nes->lazyFlags & FLAG_ZERO) p |= getFlagZero() << 1;
+  if (nes->lazyFlags & FLAG_OVERFLOW) p |= getFlagOverflow() << 6;
+  if (nes->lazyFlags & FLAG_NEGATIVE) p |= getFlagNegative() << 7;
+  return p;
+}
+
 
-uint8_t getFlagNegative(void) { return getBit(regs.p, 7); }
+/**
+ * Replaces the whole status register, discarding lazy flags.
+ *
+ * @param p: New value of the status register.
+ */
+void setStatusRegister(uint8_t p) {
+  nes->regs.p = p;
+  nes->lazyFlags = 0;
+}
 
 void NMInterruptHandler() {
+  nes->interruptCount++;
   setFlagBreak(0);
-  pushStack(regs.pc >> 8);
-  pushStack(regs.pc);
-  pushStack(regs.p);
+  pushStack(nes->regs.pc >> 8);
+  pushStack(nes->regs.pc);
+  pushStack(statusRegister());
   setFlagInterrupt(1);
-  regs.pc = (readByte(0xFFFB) << 8) + readByte(0xFFFA);
+  nes->regs.pc = (readByte(0xFFFB) << 8) + readByte(0xFFFA);
 }
 
 void IRQHandler() {
+  nes->interruptCount++;
   setFlagBreak(0);
-  pushStack(regs.pc >> 8);
-  pushStack(regs.pc);
-  pushStack(regs.p);
+  pushStack(nes->regs.pc >> 8);
+  pushStack(nes->regs.pc);
+  pushStack(statusRegister());
   setFlagInterrupt(1);
-  regs.pc = (readByte(0xFFFF) << 8) + readByte(0xFFFE);
-  interrupted = 0;
+  nes->regs.pc = (readByte(0xFFFF) << 8) + readByte(0xFFFE);
+}
+
+/**
+ * Requests an NMI, serviced once the current instruction completes.
+ * Called on the rising edge of vertical blank with NMIs enabled, or
+ * when NMIs are enabled during vertical blank.
+ */
+void raiseNMI(void) {
+  scheduleEvent(EVENT_NMI, nes->cycle);
+}
+
+/**
+ * Services the IRQ line once the interrupt disable flag allows it.
+ * Called whenever the line is asserted or the flag is cleared.
+ */
+void checkIRQ(void) {
+  if (nes->irqLine && !getFlagInterrupt()) scheduleEvent(EVENT_IRQ, nes->cycle);
+}
+
+/**
+ * Asserts the IRQ line on behalf of a source (IRQ_SOURCE_*).
+ */
+void assertIRQ(uint8_t source) {
+  nes->irqLine |= source;
+  checkIRQ();
+}
+
+/**
+ * Releases the IRQ line on behalf of a source (IRQ_SOURCE_*).
+ */
+void releaseIRQ(uint8_t source) {
+  nes->irqLine &= ~source;
 }
 
 /**
@@ -160,37 +252,29 @@ void flagCompare(uint8_t a, uint8_t b) {
 
 /**
  * Determines if the overflag should be set after an instruction.
+ * The flag is evaluated lazily from the saved operands.
  *
  * @param a: First argument to the instruction.
  * @param b: Second argument to the instruction. 
  * @param c: Resolution to the instruction.
  */
 void VFlag(uint8_t a, uint8_t b, uint8_t c) {
-  if ((!getBit(a, 7) && !getBit(b, 7) && getBit(c, 7)) ||
-      (getBit(a, 7) && getBit(b, 7) && !getBit(c, 7))) {
-    setFlagOverflow(1);
-  } else setFlagOverflow(0);
+  nes->lazyOverflowA = a;
+  nes->lazyOverflowB = b;
+  nes->lazyOverflowResult = c;
+  nes->lazyFlags |= FLAG_OVERFLOW;
 }
 
 /**
  * Determines if the Zero and Negative flags should be
- * set after an instruction.
+ * set after an instruction. Both flags are evaluated
+ * lazily from the saved result.
  *
  * @param val: Resolution to an instruction.
  */
 void SZFlags(uint8_t val) {
-  if (val == 0) {
-    setFlagZero(1);
-    setFlagNegative(0);
-  }
-  else if (getBit(val, 7)) {
-    setFlagZero(0);
-    setFlagNegative(1);
-  }
-  else {
-    setFlagZero(0);
-    setFlagNegative(0);
-  }
+  nes->lazyResult = val;
+  nes->lazyFlags |= FLAG_ZERO | FLAG_NEGATIVE;
 }
 
 /**
@@ -203,14 +287,14 @@ void SZFlags(uint8_t val) {
  *             program counter backwards.
  */
 void branchJump(uint8_t val) {
-  cycle++;
+  nes->cycle++;
   if (!getBit(val, 7)) {
     //if ( ( (regs.pc + val) ^ regs.pc ) & 0xFF00) cycle++;
-    regs.pc += val;
+    nes->regs.pc += val;
   } else {
     val = ~val + 1;
     //if ( ( (regs.pc - val) ^ regs.pc ) & 0xFF00) cycle++;
-    regs.pc -= val;
+    nes->regs.pc -= val;
   }
 }
 
@@ -224,22 +308,22 @@ uint8_t fetchArgument(AddressMode mode, uint8_t arg1, uint8_t arg2) {
       val = readZeroPage(arg1);
       break;
     case ZERO_PAGE_X:
-      val = readZeroPage(arg1 + regs.x);
+      val = readZeroPage(arg1 + nes->regs.x);
       break;
     case ZERO_PAGE_Y:
-      val = readZeroPage(arg1 + regs.y);
+      val = readZeroPage(arg1 + nes->regs.y);
       break;
     case INDIRECT_X:
       {
-      uint16_t addr = readZeroPage(arg1 + regs.x) + (readZeroPage(arg1 + regs.x + 1) << 8);
+      uint16_t addr = readZeroPage(arg1 + nes->regs.x) + (readZeroPage(arg1 + nes->regs.x + 1) << 8);
       val = readByte(addr);
       break;
       }
     case INDIRECT_Y:
       {
       uint16_t addr = readZeroPage(arg1) + (readZeroPage(arg1 + 1) << 8);
-      if ( (addr & 0xFF) + (uint16_t)regs.y > 0x00FF) cycle++;
-      addr += regs.y;
+      if ( (addr & 0xFF) + (uint16_t)nes->regs.y > 0x00FF) nes->cycle++;
+      addr += nes->regs.y;
       val = readByte(addr);
       break;
       }
@@ -252,16 +336,16 @@ uint8_t fetchArgument(AddressMode mode, uint8_t arg1, uint8_t arg2) {
     case ABSOLUTE_X:
       {
       uint16_t addr = (arg2 << 8) + arg1;
-      if ( (addr & 0xFF) + (uint16_t)regs.x  > 0x00FF) cycle++;
-      addr += regs.x;
+      if ( (addr & 0xFF) + (uint16_t)nes->regs.x  > 0x00FF) nes->cycle++;
+      addr += nes->regs.x;
       val = readByte(addr);
       break;
       }
     case ABSOLUTE_Y:
       {
       uint16_t addr = (arg2 << 8) + arg1;
-      if ( (addr & 0xFF) + (uint16_t)regs.y  > 0x00FF) cycle++;
-      addr += regs.y;
+      if ( (addr & 0xFF) + (uint16_t)nes->regs.y  > 0x00FF) nes->cycle++;
+      addr += nes->regs.y;
       val = readByte(addr);
       break;
       }
@@ -279,21 +363,21 @@ void dataWriteBack(uint8_t val, uint8_t mode, uint8_t arg1, uint8_t arg2) {
       writeZeroPage(arg1, val);
       break;
     case ZERO_PAGE_X:
-      writeZeroPage(arg1 + regs.x, val);
+      writeZeroPage(arg1 + nes->regs.x, val);
       break;
     case ZERO_PAGE_Y:
-      writeZeroPage(arg1 + regs.y, val);
+      writeZeroPage(arg1 + nes->regs.y, val);
       break;
     case INDIRECT_X:
       {
-      uint16_t addr = readZeroPage(arg1 + regs.x) + (readZeroPage(arg1 + regs.x + 1) << 8);
+      uint16_t addr = readZeroPage(arg1 + nes->regs.x) + (readZeroPage(arg1 + nes->regs.x + 1) << 8);
       writeByte(addr, val);
       break;
       }
     case INDIRECT_Y:
       {
       uint16_t addr = readZeroPage(arg1) + (readZeroPage(arg1 + 1) << 8);
-      addr += regs.y;
+      addr += nes->regs.y;
       writeByte(addr, val);
       break;
       }
@@ -305,13 +389,13 @@ void dataWriteBack(uint8_t val, uint8_t mode, uint8_t arg1, uint8_t arg2) {
       }
     case ABSOLUTE_X:
       {
-      uint16_t addr = arg1 + (arg2 << 8) + regs.x;
+      uint16_t addr = arg1 + (arg2 << 8) + nes->regs.x;
       writeByte(addr, val);
       break;
       }
     case ABSOLUTE_Y:
       {
-      uint16_t addr = arg1 + (arg2 << 8) + regs.y;
+      uint16_t addr = arg1 + (arg2 << 8) + nes->regs.y;
       writeByte(addr, val);
       break;
       }
@@ -322,18 +406,12 @@ void dataWriteBack(uint8_t val, uint8_t mode, uint8_t arg1, uint8_t arg2) {
 /* START OF OFFICIAL OPCODE FUNCTIONS*/
 /*************************************/
 
-void nan(void) {
-  printf("Error: Invalid opcode!.\n");
-  exit(1);
-}
-
 void brk(void) {
   setFlagBreak(1);
-  pushStack(regs.pc >> 8);
-  pushStack(regs.pc);
-  pushStack(regs.p);
-  regs.pc = (readByte(0xFFFF) << 8) + readByte(0xFFFE);
-  interrupted = 0;
+  pushStack(nes->regs.pc >> 8);
+  pushStack(nes->regs.pc);
+  pushStack(statusRegister());
+  nes->regs.pc = (readByte(0xFFFF) << 8) + readByte(0xFFFE);
 }
 
 /**
@@ -348,11 +426,11 @@ void brk(void) {
 void adc(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   uint8_t val, res;
   val = fetchArgument(mode, arg1, arg2);
-  res = val + regs.a + getFlagCarry();
-  VFlag(val, regs.a, res);
-  res < regs.a ? setFlagCarry(1) : setFlagCarry(0);
-  regs.a = res;
-  SZFlags(regs.a);
+  res = val + nes->regs.a + getFlagCarry();
+  VFlag(val, nes->regs.a, res);
+  res < nes->regs.a ? setFlagCarry(1) : setFlagCarry(0);
+  nes->regs.a = res;
+  SZFlags(nes->regs.a);
 }
 
 
@@ -365,11 +443,11 @@ void adc(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void and(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  uint8_t val, res;
+  uint8_t val;
   val = fetchArgument(mode, arg1, arg2);
-  val &= regs.a;
+  val &= nes->regs.a;
   SZFlags(val);
-  regs.a = val;
+  nes->regs.a = val;
 }
 
 
@@ -383,11 +461,11 @@ void and(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void asl(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  uint8_t val, res;
+  uint8_t val;
   if (mode == ACCUMULATOR) {
-    setFlagCarry(getBit(regs.a, 7));
-    regs.a <<= 1;
-    val = regs.a;
+    setFlagCarry(getBit(nes->regs.a, 7));
+    nes->regs.a <<= 1;
+    val = nes->regs.a;
   } else {
     val = fetchArgument(mode, arg1, arg2);
     setFlagCarry(getBit(val, 7));
@@ -411,52 +489,60 @@ void bit(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   val = fetchArgument(mode, arg1, arg2);
   setFlagNegative(getBit(val, 7));
   setFlagOverflow(getBit(val, 6));
-  setFlagZero((val & regs.a) != 0 ? 0 : 1);
+  setFlagZero((val & nes->regs.a) != 0 ? 0 : 1);
 }
 
 void bpl(AddressMode unused, uint8_t val) {  
+  (void) unused;
   if (!getFlagNegative()) {
     branchJump(val);
   }
 }
 
 void bmi(AddressMode unused, uint8_t val) {  
+  (void) unused;
   if (getFlagNegative()) {
     branchJump(val);
   }
 }
 
 void bvc(AddressMode unused, uint8_t val) {  
+  (void) unused;
   if (!getFlagOverflow()) {
     branchJump(val);
   }
 }
 
 void bvs(AddressMode unused, uint8_t val) {  
+  (void) unused;
   if (getFlagOverflow()) {
     branchJump(val);
   }
 }
 
 void bcc(AddressMode unused, uint8_t val) {  
+  (void) unused;
   if (!getFlagCarry()) {
     branchJump(val);
   }
 }
 
 void bcs(AddressMode unused, uint8_t val) {  
+  (void) unused;
   if (getFlagCarry()) {
     branchJump(val);
   }
 }
 
 void bne(AddressMode unused, uint8_t val) {  
+  (void) unused;
   if (!getFlagZero()) {
     branchJump(val);
   }
 }
 
 void beq(AddressMode unused, uint8_t val) {  
+  (void) unused;
   if (getFlagZero()) {
     branchJump(val);
   }
@@ -472,9 +558,9 @@ void beq(AddressMode unused, uint8_t val) {
  * @param mode: addressing mode of instruction
  */
 void cmp(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  uint8_t val, res;
+  uint8_t val;
   val = fetchArgument(mode, arg1, arg2);
-  flagCompare(regs.a, val);
+  flagCompare(nes->regs.a, val);
 }
 
 
@@ -487,9 +573,9 @@ void cmp(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void cpx(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  uint8_t val, res;
+  uint8_t val;
   val = fetchArgument(mode, arg1, arg2);
-  flagCompare(regs.x, val);
+  flagCompare(nes->regs.x, val);
 }
 
 
@@ -502,9 +588,9 @@ void cpx(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void cpy(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  uint8_t val, res;
+  uint8_t val;
   val = fetchArgument(mode, arg1, arg2);
-  flagCompare(regs.y, val);
+  flagCompare(nes->regs.y, val);
 }
 
 
@@ -517,7 +603,7 @@ void cpy(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void dec(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  uint8_t val, res;
+  uint8_t val;
   val = fetchArgument(mode, arg1, arg2) - 1;
   dataWriteBack(val, mode, arg1, arg2);
   SZFlags(val);
@@ -532,10 +618,10 @@ void dec(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void eor(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  uint8_t val, res;
+  uint8_t val;
   val = fetchArgument(mode, arg1, arg2);
-  regs.a = regs.a ^ val;
-  SZFlags(regs.a);
+  nes->regs.a = nes->regs.a ^ val;
+  SZFlags(nes->regs.a);
 }
 
 /**
@@ -567,7 +653,7 @@ void jmp(AddressMode mode, uint8_t arg1, uint8_t arg2) {
     addr = readByte(addr) + (readByte(addr + 
       (addr % 0x100 == 0xFF ? -0xFF : 1)) << 8);
   }
-  regs.pc = addr;
+  nes->regs.pc = addr;
 }
 
 
@@ -580,8 +666,8 @@ void jmp(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void ldx(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  regs.x = fetchArgument(mode, arg1, arg2);
-  SZFlags(regs.x);
+  nes->regs.x = fetchArgument(mode, arg1, arg2);
+  SZFlags(nes->regs.x);
 }
 
 /**
@@ -593,8 +679,8 @@ void ldx(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void ldy(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  regs.y = fetchArgument(mode, arg1, arg2);
-  SZFlags(regs.y);
+  nes->regs.y = fetchArgument(mode, arg1, arg2);
+  SZFlags(nes->regs.y);
 }
 
 /**
@@ -606,8 +692,8 @@ void ldy(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void lda(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  regs.a = fetchArgument(mode, arg1, arg2);
-  SZFlags(regs.a);
+  nes->regs.a = fetchArgument(mode, arg1, arg2);
+  SZFlags(nes->regs.a);
 
 }
 
@@ -622,9 +708,9 @@ void lda(AddressMode mode, uint8_t arg1, uint8_t arg2) {
 void lsr(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   uint8_t val;
   if (mode == ACCUMULATOR) {
-    setFlagCarry(getBit(regs.a, 0));
-    regs.a >>= 1;
-    val = regs.a;
+    setFlagCarry(getBit(nes->regs.a, 0));
+    nes->regs.a >>= 1;
+    val = nes->regs.a;
   } else {
     val = fetchArgument(mode, arg1, arg2);
     setFlagCarry(getBit(val, 0));
@@ -647,9 +733,9 @@ void nop(void) { return; }
 void ora(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   uint8_t val;
   val = fetchArgument(mode, arg1, arg2);
-  val |= regs.a;
+  val |= nes->regs.a;
   SZFlags(val);
-  regs.a = val;
+  nes->regs.a = val;
 }
 
 /**
@@ -664,9 +750,9 @@ void rol(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   uint8_t val, res;
   uint8_t lsb = getFlagCarry();
   if (mode == ACCUMULATOR) {
-    setFlagCarry(regs.a >> 7);
-    res = (regs.a << 1) | lsb;
-    regs.a = res;
+    setFlagCarry(nes->regs.a >> 7);
+    res = (nes->regs.a << 1) | lsb;
+    nes->regs.a = res;
   } else {
     val = fetchArgument(mode, arg1, arg2);
     setFlagCarry(val >> 7);
@@ -688,9 +774,9 @@ void ror(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   uint8_t val, res;
   uint8_t msb = getFlagCarry() << 7;
   if (mode == ACCUMULATOR) {
-    setFlagCarry(regs.a << 7);
-    res = msb | (regs.a >> 1);
-    regs.a = res;
+    setFlagCarry(nes->regs.a << 7);
+    res = msb | (nes->regs.a >> 1);
+    nes->regs.a = res;
   } else  {
     val = fetchArgument(mode, arg1, arg2);
     setFlagCarry(val << 7);
@@ -712,11 +798,11 @@ void sbc(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   uint8_t val, res;
   val = fetchArgument(mode, arg1, arg2);
   val = ~val + 1 - (getFlagCarry() ? 0 : 1);
-  res = val + regs.a;
-  VFlag(val, regs.a, res);
-  regs.a = res;
-  SZFlags(regs.a);
-  (res >= 0 && res < 0x80) ? setFlagCarry(1) : setFlagCarry(0);
+  res = val + nes->regs.a;
+  VFlag(val, nes->regs.a, res);
+  nes->regs.a = res;
+  SZFlags(nes->regs.a);
+  (res < 0x80) ? setFlagCarry(1) : setFlagCarry(0);
 }
 
 
@@ -729,7 +815,7 @@ void sbc(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void sta(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  dataWriteBack(regs.a, mode, arg1, arg2);
+  dataWriteBack(nes->regs.a, mode, arg1, arg2);
 }
 
 
@@ -742,7 +828,7 @@ void sta(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void stx(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  dataWriteBack(regs.x, mode, arg1, arg2);
+  dataWriteBack(nes->regs.x, mode, arg1, arg2);
 }
 
 
@@ -755,7 +841,7 @@ void stx(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void sty(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  dataWriteBack(regs.y, mode, arg1, arg2);
+  dataWriteBack(nes->regs.y, mode, arg1, arg2);
 }
 
 
@@ -763,7 +849,10 @@ void clc(void) { setFlagCarry(0); }
 
 void sec(void) { setFlagCarry(1); }
 
-void cli(void) { setFlagInterrupt(0); }
+void cli(void) {
+  setFlagInterrupt(0);
+  checkIRQ();
+}
 
 void sei(void) { setFlagInterrupt(1); }
 
@@ -774,86 +863,88 @@ void cld(void) { setFlagDecimal(0); }
 void sed(void) { setFlagDecimal(1); }
 
 void jsr(AddressMode unused, uint8_t lower, uint8_t upper) {
-  uint16_t val = regs.pc + 3 - 1;
+  (void) unused;
+  uint16_t val = nes->regs.pc + 3 - 1;
   pushStack(val >> 8);
   pushStack(val & 0x00FF);
   val = (upper << 8) + lower;
-  regs.pc = val;
+  nes->regs.pc = val;
 }
 
 void tax(void) {
-  regs.x = regs.a;
-  SZFlags(regs.x);  
+  nes->regs.x = nes->regs.a;
+  SZFlags(nes->regs.x);  
 }
 
 void txa(void) {
-  regs.a = regs.x;
-  SZFlags(regs.a);
+  nes->regs.a = nes->regs.x;
+  SZFlags(nes->regs.a);
 }
 
 void dex(void) {
-  regs.x--;
-  SZFlags(regs.x);
+  nes->regs.x--;
+  SZFlags(nes->regs.x);
 }
 
 void inx(void) {
-  regs.x++;
-  SZFlags(regs.x);
+  nes->regs.x++;
+  SZFlags(nes->regs.x);
 }
 
 void tay(void) {
-  regs.y = regs.a;
-  SZFlags(regs.y);
+  nes->regs.y = nes->regs.a;
+  SZFlags(nes->regs.y);
 }
 
 void tya(void) { 
-  regs.a = regs.y;
-  SZFlags(regs.a);
+  nes->regs.a = nes->regs.y;
+  SZFlags(nes->regs.a);
 }
 
 void dey(void) { 
-  regs.y--;
-  SZFlags(regs.y);
+  nes->regs.y--;
+  SZFlags(nes->regs.y);
 }
 
 void iny(void) { 
-  regs.y++;
-  SZFlags(regs.y);
+  nes->regs.y++;
+  SZFlags(nes->regs.y);
 }
 
 void rti(void) {
-  regs.p = (popStack() & 0xEF) | 0x20;
-  regs.pc = popStack();
-  regs.pc |= (popStack() << 8);
-  interrupted = 0;
+  setStatusRegister((popStack() & 0xEF) | 0x20);
+  nes->regs.pc = popStack();
+  nes->regs.pc |= (popStack() << 8);
+  checkIRQ();
 }
 
 void rts(void) {
   uint16_t addr = popStack();
   addr += (uint16_t) (popStack() << 8);
-  regs.pc = addr;
+  nes->regs.pc = addr;
 }
 
 void txs(void) { 
-  regs.sp = regs.x;
+  nes->regs.sp = nes->regs.x;
 }
 
 void tsx(void) {
-  regs.x = regs.sp;
-  SZFlags(regs.x);
+  nes->regs.x = nes->regs.sp;
+  SZFlags(nes->regs.x);
 }
 
-void pha(void) { pushStack(regs.a); }
+void pha(void) { pushStack(nes->regs.a); }
 
 void pla(void) { 
-  regs.a = popStack();
-  SZFlags(regs.a);
+  nes->regs.a = popStack();
+  SZFlags(nes->regs.a);
 }
 
-void php(void) { pushStack(regs.p | 0x10); }
+void php(void) { pushStack(statusRegister() | 0x10); }
 
 void plp(void) { 
-  regs.p = (popStack() & 0xEF) | 0x20;
+  setStatusRegister((popStack() & 0xEF) | 0x20);
+  checkIRQ();
 }
 
 /*************************************/
@@ -871,15 +962,15 @@ void plp(void) {
  */
 void lax(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   uint8_t val = fetchArgument(mode, arg1, arg2);
-  regs.a = val;
-  regs.x = val;
+  nes->regs.a = val;
+  nes->regs.x = val;
   SZFlags(val);
 }
 
 
 void sax(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   uint8_t val = fetchArgument(mode, arg1, arg2);
-  val = (regs.a & regs.x);// - val;
+  val = (nes->regs.a & nes->regs.x);// - val;
   dataWriteBack(val, mode, arg1, arg2);
 }
 
@@ -893,7 +984,7 @@ void sax(AddressMode mode, uint8_t arg1, uint8_t arg2) {
  * @param mode: addressing mode of instruction
  */
 void axs(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  dataWriteBack(regs.a & regs.x, mode, arg1, arg2);
+  dataWriteBack(nes->regs.a & nes->regs.x, mode, arg1, arg2);
 }
 
 
@@ -910,7 +1001,7 @@ void dcm(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   uint8_t val = fetchArgument(mode, arg1, arg2) - 1;
   dataWriteBack(val, mode, arg1, arg2);
   SZFlags(val);
-  flagCompare(regs.a, val);
+  flagCompare(nes->regs.a, val);
 }
 
 /**
@@ -926,10 +1017,10 @@ void isb(AddressMode mode, uint8_t arg1, uint8_t arg2) {
   val = fetchArgument(mode, arg1, arg2) + 1;
   dataWriteBack(val, mode, arg1, arg2);
   val = ~val + 1 - (getFlagCarry() ? 0 : 1);
-  res = val + regs.a;
-  VFlag(val, regs.a, res);
-  regs.a = res;
-  SZFlags(regs.a);
+  res = val + nes->regs.a;
+  VFlag(val, nes->regs.a, res);
+  nes->regs.a = res;
+  SZFlags(nes->regs.a);
 }
 
 
@@ -947,14 +1038,20 @@ void slo(AddressMode mode, uint8_t arg1, uint8_t arg2) {
 }
 
 
+/**
+ * Jams the CPU: the program counter stays on the KIL opcode and
+ * runFrame() returns without completing the frame. The caller
+ * decides whether to report the halt and stop.
+ */
 void kil(AddressMode unused) {
-  printf("KILL OPCODE EXECUTED.\n");
-  exit(0);
+  (void) unused;
+  nes->halted = 1;
 } 
 
 void anc(AddressMode unused, uint8_t val) {
-  regs.a &= val;
-  setFlagCarry(getBit(regs.a, 7));
+  (void) unused;
+  nes->regs.a &= val;
+  setFlagCarry(getBit(nes->regs.a, 7));
 }
 
 void rla(AddressMode mode, uint8_t arg1, uint8_t arg2) {
@@ -973,46 +1070,52 @@ void rra(AddressMode mode, uint8_t arg1, uint8_t arg2) {
 }
 
 void arr(AddressMode unused, uint8_t arg1, uint8_t arg2) {
+  (void) unused;
   and(IMMEDIATE, arg1, arg2);
   ror(ACCUMULATOR, arg1, arg2);
 }
 
 void xaa(AddressMode unused, uint8_t arg1, uint8_t arg2) {
+  (void) unused;
   txa();
   and(IMMEDIATE, arg1, arg2);
 }
 
 void ahx(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  uint8_t val = regs.a & regs.x;
+  uint8_t val = nes->regs.a & nes->regs.x;
   if (mode == ABSOLUTE) {
     val &= arg2;  
   } else {
-    val &= (uint8_t)(readZeroPage(arg1 + 1) + regs.y);
+    val &= (uint8_t)(readZeroPage(arg1 + 1) + nes->regs.y);
   }
   dataWriteBack(val, mode, arg1, arg2);
 }
 
 void tas(AddressMode unused, uint8_t arg1, uint8_t arg2) {
-  uint8_t val = regs.a & regs.x;
+  (void) unused;
+  uint8_t val = nes->regs.a & nes->regs.x;
   pushStack(val);
   val &= arg2;
   dataWriteBack(val, ABSOLUTE, arg1, arg2);
 }
 
 void shy(AddressMode unused, uint8_t arg1, uint8_t arg2) {
-  dataWriteBack(regs.a & regs.y & arg2, ABSOLUTE, arg1, arg2);
+  (void) unused;
+  dataWriteBack(nes->regs.a & nes->regs.y & arg2, ABSOLUTE, arg1, arg2);
 }
 
 void shx(AddressMode mode, uint8_t arg1, uint8_t arg2) {
-  dataWriteBack(regs.a & regs.x & arg2, ABSOLUTE, arg1, arg2);
+  (void) mode;
+  dataWriteBack(nes->regs.a & nes->regs.x & arg2, ABSOLUTE, arg1, arg2);
 }
 
 void las(AddressMode unused, uint8_t arg1, uint8_t arg2) {
+  (void) unused;
   uint8_t val = fetchArgument(ABSOLUTE, arg1, arg2);
-  val &= regs.sp;
-  regs.a = val;
-  regs.x = val;
-  regs.sp = val;
+  val &= nes->regs.sp;
+  nes->regs.a = val;
+  nes->regs.x = val;
+  nes->regs.sp = val;
   SZFlags(val);
 }
 
@@ -1285,41 +1388,81 @@ const struct opcode opcodes[256] = {
 };
 
 
+// The handlers take different arguments; the table holds them all
+// as FunctionEx_0Arg, and descriptors say how many to pass.
+#define HANDLER(fn) {{ (void (*)(void)) fn }}
+
 FunctionExecute functions[0x100] = {
-  brk, ora, kil, slo, nop, ora, asl, slo,
-  php, ora, asl, anc, nop, ora, asl, slo,  // 0x0F
-  bpl, ora, kil, slo, nop, ora, asl, slo,
-  clc, ora, nop, slo, nop, ora, asl, slo,  // 0x1F
-  jsr, and, kil, rla, bit, and, rol, rla,
-  plp, and, rol, anc, bit, and, rol, rla,  // 0x2F
-  bmi, and, kil, rla, nop, and, rol, rla,
-  sec, and, nop, rla, nop, and, rol, rla,  // 0x3F
-  rti, eor, kil, sre, nop, eor, lsr, sre,
-  pha, eor, lsr, sre, jmp, eor, lsr, sre,  // 0x4F
-  bvc, eor, kil, sre, nop, eor, lsr, sre,
-  cli, eor, nop, sre, nop, eor, lsr, sre,  // 0x5F
-  rts, adc, kil, rra, nop, adc, ror, rra,
-  pla, adc, ror, arr, jmp, adc, ror, rra,  // 0x6F
-  bvs, adc, kil, rra, nop, adc, ror, rra, 
-  sei, adc, nop, rra, nop, adc, ror, rra,  // 0x7F
-  nop, sta, nop, sax, sty, sta, stx, sax,
-  dey, nop, txa, xaa, sty, sta, stx, sax,  // 0x8F
-  bcc, sta, kil, ahx, sty, sta, stx, sax,
-  tya, sta, txs, tas, shy, sta, shx, ahx,  // 0x9F
-  ldy, lda, ldx, lax, ldy, lda, ldx, lax,
-  tay, lda, tax, lax, ldy, lda, ldx, lax,  // 0xAF
-  bcs, lda, kil, lax, ldy, lda, ldx, lax,
-  clv, lda, tsx, las, ldy, lda, ldx, lax,  // 0xBF
-  cpy, cmp, nop, dcm, cpy, cmp, dec, dcm,
-  iny, cmp, dex, sax, cpy, cmp, dec, dcm,  // 0xCF
-  bne, cmp, kil, dcm, nop, cmp, dec, dcm, 
-  cld, cmp, nop, dcm, nop, cmp, dec, dcm,  // 0xDF
-  cpx, sbc, nop, isb, cpx, sbc, inc, isb, 
-  inx, sbc, nop, sbc, cpx, sbc, inc, isb,  // 0xEF
-  beq, sbc, kil, isb, nop, sbc, inc, isb, 
-  sed, sbc, nop, isb, nop, sbc, inc, isb   // 0xFF
+  HANDLER(brk), HANDLER(ora), HANDLER(kil), HANDLER(slo), HANDLER(nop), HANDLER(ora), HANDLER(asl), HANDLER(slo),
+  HANDLER(php), HANDLER(ora), HANDLER(asl), HANDLER(anc), HANDLER(nop), HANDLER(ora), HANDLER(asl), HANDLER(slo),  // 0x0F
+  HANDLER(bpl), HANDLER(ora), HANDLER(kil), HANDLER(slo), HANDLER(nop), HANDLER(ora), HANDLER(asl), HANDLER(slo),
+  HANDLER(clc), HANDLER(ora), HANDLER(nop), HANDLER(slo), HANDLER(nop), HANDLER(ora), HANDLER(asl), HANDLER(slo),  // 0x1F
+  HANDLER(jsr), HANDLER(and), HANDLER(kil), HANDLER(rla), HANDLER(bit), HANDLER(and), HANDLER(rol), HANDLER(rla),
+  HANDLER(plp), HANDLER(and), HANDLER(rol), HANDLER(anc), HANDLER(bit), HANDLER(and), HANDLER(rol), HANDLER(rla),  // 0x2F
+  HANDLER(bmi), HANDLER(and), HANDLER(kil), HANDLER(rla), HANDLER(nop), HANDLER(and), HANDLER(rol), HANDLER(rla),
+  HANDLER(sec), HANDLER(and), HANDLER(nop), HANDLER(rla), HANDLER(nop), HANDLER(and), HANDLER(rol), HANDLER(rla),  // 0x3F
+  HANDLER(rti), HANDLER(eor), HANDLER(kil), HANDLER(sre), HANDLER(nop), HANDLER(eor), HANDLER(lsr), HANDLER(sre),
+  HANDLER(pha), HANDLER(eor), HANDLER(lsr), HANDLER(sre), HANDLER(jmp), HANDLER(eor), HANDLER(lsr), HANDLER(sre),  // 0x4F
+  HANDLER(bvc), HANDLER(eor), HANDLER(kil), HANDLER(sre), HANDLER(nop), HANDLER(eor), HANDLER(lsr), HANDLER(sre),
+  HANDLER(cli), HANDLER(eor), HANDLER(nop), HANDLER(sre), HANDLER(nop), HANDLER(eor), HANDLER(lsr), HANDLER(sre),  // 0x5F
+  HANDLER(rts), HANDLER(adc), HANDLER(kil), HANDLER(rra), HANDLER(nop), HANDLER(adc), HANDLER(ror), HANDLER(rra),
+  HANDLER(pla), HANDLER(adc), HANDLER(ror), HANDLER(arr), HANDLER(jmp), HANDLER(adc), HANDLER(ror), HANDLER(rra),  // 0x6F
+  HANDLER(bvs), HANDLER(adc), HANDLER(kil), HANDLER(rra), HANDLER(nop), HANDLER(adc), HANDLER(ror), HANDLER(rra), 
+  HANDLER(sei), HANDLER(adc), HANDLER(nop), HANDLER(rra), HANDLER(nop), HANDLER(adc), HANDLER(ror), HANDLER(rra),  // 0x7F
+  HANDLER(nop), HANDLER(sta), HANDLER(nop), HANDLER(sax), HANDLER(sty), HANDLER(sta), HANDLER(stx), HANDLER(sax),
+  HANDLER(dey), HANDLER(nop), HANDLER(txa), HANDLER(xaa), HANDLER(sty), HANDLER(sta), HANDLER(stx), HANDLER(sax),  // 0x8F
+  HANDLER(bcc), HANDLER(sta), HANDLER(kil), HANDLER(ahx), HANDLER(sty), HANDLER(sta), HANDLER(stx), HANDLER(sax),
+  HANDLER(tya), HANDLER(sta), HANDLER(txs), HANDLER(tas), HANDLER(shy), HANDLER(sta), HANDLER(shx), HANDLER(ahx),  // 0x9F
+  HANDLER(ldy), HANDLER(lda), HANDLER(ldx), HANDLER(lax), HANDLER(ldy), HANDLER(lda), HANDLER(ldx), HANDLER(lax),
+  HANDLER(tay), HANDLER(lda), HANDLER(tax), HANDLER(lax), HANDLER(ldy), HANDLER(lda), HANDLER(ldx), HANDLER(lax),  // 0xAF
+  HANDLER(bcs), HANDLER(lda), HANDLER(kil), HANDLER(lax), HANDLER(ldy), HANDLER(lda), HANDLER(ldx), HANDLER(lax),
+  HANDLER(clv), HANDLER(lda), HANDLER(tsx), HANDLER(las), HANDLER(ldy), HANDLER(lda), HANDLER(ldx), HANDLER(lax),  // 0xBF
+  HANDLER(cpy), HANDLER(cmp), HANDLER(nop), HANDLER(dcm), HANDLER(cpy), HANDLER(cmp), HANDLER(dec), HANDLER(dcm),
+  HANDLER(iny), HANDLER(cmp), HANDLER(dex), HANDLER(sax), HANDLER(cpy), HANDLER(cmp), HANDLER(dec), HANDLER(dcm),  // 0xCF
+  HANDLER(bne), HANDLER(cmp), HANDLER(kil), HANDLER(dcm), HANDLER(nop), HANDLER(cmp), HANDLER(dec), HANDLER(dcm), 
+  HANDLER(cld), HANDLER(cmp), HANDLER(nop), HANDLER(dcm), HANDLER(nop), HANDLER(cmp), HANDLER(dec), HANDLER(dcm),  // 0xDF
+  HANDLER(cpx), HANDLER(sbc), HANDLER(nop), HANDLER(isb), HANDLER(cpx), HANDLER(sbc), HANDLER(inc), HANDLER(isb), 
+  HANDLER(inx), HANDLER(sbc), HANDLER(nop), HANDLER(sbc), HANDLER(cpx), HANDLER(sbc), HANDLER(inc), HANDLER(isb),  // 0xEF
+  HANDLER(beq), HANDLER(sbc), HANDLER(kil), HANDLER(isb), HANDLER(nop), HANDLER(sbc), HANDLER(inc), HANDLER(isb), 
+  HANDLER(sed), HANDLER(sbc), HANDLER(nop), HANDLER(isb), HANDLER(nop), HANDLER(sbc), HANDLER(inc), HANDLER(isb)   // 0xFF
 };
 
+#undef HANDLER
+
+
+// Packed decode table built from the three tables above.
+OpcodeDescriptor descriptors[0x100];
+
+// Longest loop body considered by the idle loop detector.
+#define IDLE_MAX_INSTRUCTIONS 8
+
+// Flags of each opcode, OR-ed from:
+//   OPCODE_IDLE_SAFE: may appear in an idle loop. The instruction
+//   neither writes memory nor touches the stack or the interrupt
+//   disable flag: loads, compares, register and flag operations,
+//   branches and JMP.
+//   OPCODE_WRITES: writes its operand address in memory: stores and
+//   read-modify-write instructions other than on the accumulator.
+const uint8_t opcodeFlags[256] = {
+  0, 1, 0, 2, 1, 1, 2, 2, 0, 1, 0, 0, 1, 1, 2, 2,  // 0x0F
+  1, 1, 0, 2, 1, 1, 2, 2, 1, 1, 1, 2, 1, 1, 2, 2,  // 0x1F
+  0, 1, 0, 2, 1, 1, 2, 2, 0, 1, 0, 0, 1, 1, 2, 2,  // 0x2F
+  1, 1, 0, 2, 1, 1, 2, 2, 1, 1, 1, 2, 1, 1, 2, 2,  // 0x3F
+  0, 1, 0, 2, 1, 1, 2, 2, 0, 1, 0, 0, 1, 1, 2, 2,  // 0x4F
+  1, 1, 0, 2, 1, 1, 2, 2, 0, 1, 1, 2, 1, 1, 2, 2,  // 0x5F
+  0, 1, 0, 2, 1, 1, 2, 2, 0, 1, 0, 0, 1, 1, 2, 2,  // 0x6F
+  1, 1, 0, 2, 1, 1, 2, 2, 0, 1, 1, 2, 1, 1, 2, 2,  // 0x7F
+  1, 2, 1, 2, 2, 2, 2, 2, 1, 1, 1, 0, 2, 2, 2, 2,  // 0x8F
+  1, 2, 0, 2, 2, 2, 2, 2, 1, 2, 0, 2, 2, 2, 2, 2,  // 0x9F
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0xAF
+  1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1,  // 0xBF
+  1, 1, 1, 2, 1, 1, 2, 2, 1, 1, 1, 0, 1, 1, 2, 2,  // 0xCF
+  1, 1, 0, 2, 1, 1, 2, 2, 1, 1, 1, 2, 1, 1, 2, 2,  // 0xDF
+  1, 1, 1, 2, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 2, 2,  // 0xEF
+  1, 1, 0, 2, 1, 1, 2, 2, 1, 1, 1, 2, 1, 1, 2, 2   // 0xFF
+};
+
+
 
 /**
  * Updates the cycle counter of the CPU.
@@ -1328,8 +1471,8 @@ FunctionExecute functions[0x100] = {
  * @param opcode: byte instruction that was last executed.
  */
 void updateCycle(uint16_t addr, uint8_t offset) {
-  if (addr & 0x00FF < offset) {
-    cycle++;
+  if ((addr & 0x00FF) + offset > 0x00FF) {
+    nes->cycle++;
   }
     //switch (opcode) {
       //case 0x7D:  // ADC
@@ -1362,49 +1505,652 @@ void updateCycle(uint16_t addr, uint8_t offset) {
 
 
 /**
- * Reads the next instruction from the PRG-ROM
- * and executes it. Increments the stack pointer to
- * the next opcode instruction.
+ * Builds the per-opcode descriptor table from the cycle, opcode and
+ * function and flag tables above. Must be called once before the first
+ * step().
+ */
+void initDispatchTable(void) {
+  for (int i = 0; i < 0x100; i++) {
+    // Mnemonics are exactly three characters, with no terminator.
+    const uint8_t * name = opcodes[i].code;
+    descriptors[i].execute = functions[i];
+    descriptors[i].cycles = cycles[i];
+    descriptors[i].operands = opcodes[i].operands;
+    descriptors[i].addrMode = opcodes[i].addrMode;
+    descriptors[i].pcIncrement = (memcmp(name, "JSR", 3) != 0 &&
+                                  memcmp(name, "JMP", 3) != 0 &&
+                                  memcmp(name, "RTI", 3) != 0 &&
+                                  memcmp(name, "KIL", 3) != 0) ? opcodes[i].operands : 0;
+    descriptors[i].flags = opcodeFlags[i];
+  }
+}
+
+
+/**
+ * Flushes all decoded instructions of an 8 KB PRG ROM window.
+ * Called whenever the window is remapped to another bank.
+ *
+ * @param window: 0-3 for $8000, $A000, $C000 and $E000.
+ */
+void invalidateProgramBank(uint8_t window) {
+  uint16_t start = window * 0x2000;
+  memset(nes->decodedROM + start, 0, 0x2000 * sizeof(DecodedInstruction));
+  if (window) {
+    // Instructions at the end of the previous window may
+    // have operands in this one.
+    nes->decodedROM[start - 2].valid = 0;
+    nes->decodedROM[start - 1].valid = 0;
+  }
+  jitInvalidateBank(window);
+}
+
+
+/**
+ * Flushes every decoded RAM instruction that could contain
+ * the given byte, i.e. those starting up to two bytes before it.
+ *
+ * @param addr: Address of the written byte in CPU RAM ($0000-$07FF).
+ */
+void invalidateRAMInstruction(uint16_t addr) {
+  nes->decodedRAM[addr].valid = 0;
+  nes->decodedRAM[(addr - 1) & 0x07FF].valid = 0;
+  nes->decodedRAM[(addr - 2) & 0x07FF].valid = 0;
+}
+
+
+/**
+ * Looks up the decoded instruction at an address,
+ * decoding it through readByte() on a cache miss.
+ *
+ * @param pc: Address of the instruction's opcode.
+ *
+ * @returns: Pointer to the decoded instruction.
  */
-uint32_t step(void) {
-  uint8_t opcode = readByte(regs.pc);
-  uint8_t time = cycles[opcode];
-  uint8_t len = opcodes[opcode].operands;
-  unsigned char * opname = opcodes[opcode].code;
-  AddressMode mode = opcodes[opcode].addrMode;
-  uint8_t arg1, arg2;
-  arg1 = readByte(regs.pc + 1);
-  arg2 = readByte(regs.pc + 2);
+const DecodedInstruction * fetchInstruction(uint16_t pc) {
+  DecodedInstruction * entry;
+  if (pc >= 0x8000) {
+    entry = &nes->decodedROM[pc - 0x8000];
+  } else if (pc < 0x2000) {
+    entry = &nes->decodedRAM[pc % 0x0800];
+  } else {
+    entry = &nes->decodedUncached;
+    entry->valid = 0;
+  }
+  if (!entry->valid) {
+    uint8_t operands;
+    entry->opcode = readByte(pc);
+    operands = descriptors[entry->opcode].operands;
+    entry->arg1 = operands >= 2 ? readByte(pc + 1) : 0;
+    entry->arg2 = operands == 3 ? readByte(pc + 2) : 0;
+    // Operands that wrap around to $0000 are not covered by bank flushes.
+    entry->valid = (entry != &nes->decodedUncached && pc < 0xFFFE);
+  }
+  return entry;
+}
+
+
+/**
+ * Starts an instruction: looks it up, stamps the cycle its bus
+ * accesses happen at, and logs it when tracing.
+ *
+ * @param pc: Address of the instruction's opcode.
+ *
+ * @returns: The decoded instruction.
+ */
+static inline const DecodedInstruction * beginInstruction(uint16_t pc) {
+  const DecodedInstruction * inst = fetchInstruction(pc);
+  nes->instructionCycle = nes->cycle;
   if (logger) {
-    fprintf(logFile, "%x, %x %x %x %s  A:%x X:%x Y:%x P:%x SP:%x CYCLE:%d\n",
-      regs.pc, opcode, arg1, arg2, opname, regs.a, regs.x, regs.y, regs.p, regs.sp, cycle); 
+    fprintf(logFile, "%x, %x %x %x %s  A:%x X:%x Y:%x P:%x SP:%x CYCLE:%" PRIu64 "\n",
+      pc, inst->opcode, readByte(pc + 1), readByte(pc + 2),
+      opcodes[inst->opcode].code, nes->regs.a, nes->regs.x, nes->regs.y, statusRegister(), nes->regs.sp, nes->cycle); 
+  }
+  return inst;
+}
+
+
+// Threaded dispatch: every opcode has its own block, which calls its
+// handler directly with the addressing mode as a constant and then
+// dispatches the next instruction itself. With labels-as-values each
+// block ends in its own indirect jump, so the host predicts the next
+// opcode from the current one; otherwise the blocks are switch cases.
+#ifdef USE_COMPUTED_GOTO
+#define OPCODE(n, call) op_##n: call; RETIRE(n)
+#define DISPATCH() \
+  pc = nes->regs.pc; \
+  inst = beginInstruction(pc); \
+  goto *labels[inst->opcode]
+#else
+#define OPCODE(n, call) case n: call; RETIRE(n)
+#define DISPATCH() continue
+#endif
+
+// Charges an instruction's cycles, steps past it, and goes on to the
+// next one unless the run has to return to the caller.
+#define RETIRE(n) \
+  nes->cycle += descriptors[n].cycles; \
+  nes->regs.pc += descriptors[n].pcIncrement; \
+  nes->instructionCount++; \
+  if (++executed == limit || nes->regs.pc <= pc || nes->cycle >= nes->eventHorizon || \
+      nes->frameCount != frame || nes->halted) { \
+    return executed; \
+  } \
+  DISPATCH()
+
+
+/**
+ * Executes instructions from the program counter through threaded
+ * dispatch. Does not poll for interrupts or dispatch events, and
+ * returns to the caller once
+ *  - the limit is reached,
+ *  - an event has come due,
+ *  - the program counter did not move forward (a jump back, which
+ *    may close an idle loop), or
+ *  - the PPU finished a frame or the CPU halted.
+ *
+ * @param limit: Most instructions to execute.
+ *
+ * @returns: Number of instructions executed.
+ */
+static uint32_t runInstructions(uint32_t limit) {
+#ifdef USE_COMPUTED_GOTO
+  static void * const labels[0x100] = {
+    &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+    &&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B, &&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,
+    &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+    &&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B, &&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,
+    &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+    &&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B, &&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,
+    &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+    &&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B, &&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,
+    &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+    &&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B, &&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,
+    &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+    &&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B, &&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,
+    &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+    &&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B, &&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,
+    &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+    &&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B, &&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,
+    &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+    &&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B, &&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,
+    &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+    &&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B, &&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,
+    &&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3, &&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7,
+    &&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB, &&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,
+    &&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3, &&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7,
+    &&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB, &&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,
+    &&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3, &&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7,
+    &&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB, &&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,
+    &&op_0xD0, &&op_0xD1, &&op_0xD2, &&op_0xD3, &&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7,
+    &&op_0xD8, &&op_0xD9, &&op_0xDA, &&op_0xDB, &&op_0xDC, &&op_0xDD, &&op_0xDE, &&op_0xDF,
+    &&op_0xE0, &&op_0xE1, &&op_0xE2, &&op_0xE3, &&op_0xE4, &&op_0xE5, &&op_0xE6, &&op_0xE7,
+    &&op_0xE8, &&op_0xE9, &&op_0xEA, &&op_0xEB, &&op_0xEC, &&op_0xED, &&op_0xEE, &&op_0xEF,
+    &&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3, &&op_0xF4, &&op_0xF5, &&op_0xF6, &&op_0xF7,
+    &&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB, &&op_0xFC, &&op_0xFD, &&op_0xFE, &&op_0xFF
+  };
+#endif
+  uint64_t frame = nes->frameCount;
+  uint32_t executed = 0;
+  const DecodedInstruction * inst;
+  uint16_t pc;
+
+#ifdef USE_COMPUTED_GOTO
+  DISPATCH();
+#else
+  for (;;) {
+    pc = nes->regs.pc;
+    inst = beginInstruction(pc);
+    switch (inst->opcode) {
+#endif
+    // Handlers and addressing modes as in functions[] and opcodes[].
+    OPCODE(0x00, brk());
+    OPCODE(0x01, ora(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x02, kil(IMPLIED));
+    OPCODE(0x03, slo(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x04, nop());
+    OPCODE(0x05, ora(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x06, asl(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x07, slo(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x08, php());
+    OPCODE(0x09, ora(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0x0A, asl(ACCUMULATOR, inst->arg1, inst->arg2));
+    OPCODE(0x0B, anc(IMMEDIATE, inst->arg1));
+    OPCODE(0x0C, nop());
+    OPCODE(0x0D, ora(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x0E, asl(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x0F, slo(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x10, bpl(RELATIVE, inst->arg1));
+    OPCODE(0x11, ora(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x12, kil(IMPLIED));
+    OPCODE(0x13, slo(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x14, nop());
+    OPCODE(0x15, ora(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x16, asl(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x17, slo(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x18, clc());
+    OPCODE(0x19, ora(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x1A, nop());
+    OPCODE(0x1B, slo(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x1C, nop());
+    OPCODE(0x1D, ora(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x1E, asl(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x1F, slo(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x20, jsr(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x21, and(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x22, kil(IMPLIED));
+    OPCODE(0x23, rla(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x24, bit(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x25, and(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x26, rol(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x27, rla(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x28, plp());
+    OPCODE(0x29, and(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0x2A, rol(ACCUMULATOR, inst->arg1, inst->arg2));
+    OPCODE(0x2B, anc(IMMEDIATE, inst->arg1));
+    OPCODE(0x2C, bit(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x2D, and(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x2E, rol(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x2F, rla(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x30, bmi(RELATIVE, inst->arg1));
+    OPCODE(0x31, and(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x32, kil(IMPLIED));
+    OPCODE(0x33, rla(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x34, nop());
+    OPCODE(0x35, and(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x36, rol(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x37, rla(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x38, sec());
+    OPCODE(0x39, and(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x3A, nop());
+    OPCODE(0x3B, rla(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x3C, nop());
+    OPCODE(0x3D, and(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x3E, rol(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x3F, rla(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x40, rti());
+    OPCODE(0x41, eor(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x42, kil(IMPLIED));
+    OPCODE(0x43, sre(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x44, nop());
+    OPCODE(0x45, eor(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x46, lsr(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x47, sre(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x48, pha());
+    OPCODE(0x49, eor(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0x4A, lsr(ACCUMULATOR, inst->arg1, inst->arg2));
+    OPCODE(0x4B, sre(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0x4C, jmp(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x4D, eor(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x4E, lsr(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x4F, sre(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x50, bvc(RELATIVE, inst->arg1));
+    OPCODE(0x51, eor(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x52, kil(IMPLIED));
+    OPCODE(0x53, sre(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x54, nop());
+    OPCODE(0x55, eor(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x56, lsr(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x57, sre(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x58, cli());
+    OPCODE(0x59, eor(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x5A, nop());
+    OPCODE(0x5B, sre(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x5C, nop());
+    OPCODE(0x5D, eor(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x5E, lsr(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x5F, sre(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x60, rts());
+    OPCODE(0x61, adc(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x62, kil(IMPLIED));
+    OPCODE(0x63, rra(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x64, nop());
+    OPCODE(0x65, adc(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x66, ror(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x67, rra(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x68, pla());
+    OPCODE(0x69, adc(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0x6A, ror(ACCUMULATOR, inst->arg1, inst->arg2));
+    OPCODE(0x6B, arr(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0x6C, jmp(INDIRECT, inst->arg1, inst->arg2));
+    OPCODE(0x6D, adc(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x6E, ror(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x6F, rra(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x70, bvs(RELATIVE, inst->arg1));
+    OPCODE(0x71, adc(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x72, kil(IMPLIED));
+    OPCODE(0x73, rra(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x74, nop());
+    OPCODE(0x75, adc(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x76, ror(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x77, rra(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x78, sei());
+    OPCODE(0x79, adc(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x7A, nop());
+    OPCODE(0x7B, rra(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x7C, nop());
+    OPCODE(0x7D, adc(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x7E, ror(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x7F, rra(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x80, nop());
+    OPCODE(0x81, sta(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x82, nop());
+    OPCODE(0x83, sax(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0x84, sty(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x85, sta(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x86, stx(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x87, sax(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0x88, dey());
+    OPCODE(0x89, nop());
+    OPCODE(0x8A, txa());
+    OPCODE(0x8B, xaa(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0x8C, sty(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x8D, sta(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x8E, stx(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x8F, sax(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0x90, bcc(RELATIVE, inst->arg1));
+    OPCODE(0x91, sta(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x92, kil(IMPLIED));
+    OPCODE(0x93, ahx(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0x94, sty(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x95, sta(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0x96, stx(ZERO_PAGE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x97, sax(ZERO_PAGE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x98, tya());
+    OPCODE(0x99, sta(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x9A, txs());
+    OPCODE(0x9B, tas(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x9C, shy(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x9D, sta(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0x9E, shx(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0x9F, ahx(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xA0, ldy(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xA1, lda(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0xA2, ldx(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xA3, lax(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0xA4, ldy(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xA5, lda(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xA6, ldx(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xA7, lax(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xA8, tay());
+    OPCODE(0xA9, lda(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xAA, tax());
+    OPCODE(0xAB, lax(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xAC, ldy(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xAD, lda(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xAE, ldx(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xAF, lax(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xB0, bcs(RELATIVE, inst->arg1));
+    OPCODE(0xB1, lda(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0xB2, kil(IMPLIED));
+    OPCODE(0xB3, lax(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0xB4, ldy(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0xB5, lda(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0xB6, ldx(ZERO_PAGE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xB7, lax(ZERO_PAGE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xB8, clv());
+    OPCODE(0xB9, lda(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xBA, tsx());
+    OPCODE(0xBB, las(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xBC, ldy(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0xBD, lda(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0xBE, ldx(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xBF, lax(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xC0, cpy(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xC1, cmp(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0xC2, nop());
+    OPCODE(0xC3, dcm(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0xC4, cpy(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xC5, cmp(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xC6, dec(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xC7, dcm(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xC8, iny());
+    OPCODE(0xC9, cmp(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xCA, dex());
+    OPCODE(0xCB, sax(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xCC, cpy(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xCD, cmp(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xCE, dec(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xCF, dcm(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xD0, bne(RELATIVE, inst->arg1));
+    OPCODE(0xD1, cmp(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0xD2, kil(IMPLIED));
+    OPCODE(0xD3, dcm(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0xD4, nop());
+    OPCODE(0xD5, cmp(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0xD6, dec(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0xD7, dcm(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0xD8, cld());
+    OPCODE(0xD9, cmp(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xDA, nop());
+    OPCODE(0xDB, dcm(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xDC, nop());
+    OPCODE(0xDD, cmp(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0xDE, dec(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0xDF, dcm(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0xE0, cpx(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xE1, sbc(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0xE2, nop());
+    OPCODE(0xE3, isb(INDIRECT_X, inst->arg1, inst->arg2));
+    OPCODE(0xE4, cpx(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xE5, sbc(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xE6, inc(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xE7, isb(ZERO_PAGE, inst->arg1, inst->arg2));
+    OPCODE(0xE8, inx());
+    OPCODE(0xE9, sbc(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xEA, nop());
+    OPCODE(0xEB, sbc(IMMEDIATE, inst->arg1, inst->arg2));
+    OPCODE(0xEC, cpx(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xED, sbc(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xEE, inc(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xEF, isb(ABSOLUTE, inst->arg1, inst->arg2));
+    OPCODE(0xF0, beq(RELATIVE, inst->arg1));
+    OPCODE(0xF1, sbc(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0xF2, kil(IMPLIED));
+    OPCODE(0xF3, isb(INDIRECT_Y, inst->arg1, inst->arg2));
+    OPCODE(0xF4, nop());
+    OPCODE(0xF5, sbc(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0xF6, inc(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0xF7, isb(ZERO_PAGE_X, inst->arg1, inst->arg2));
+    OPCODE(0xF8, sed());
+    OPCODE(0xF9, sbc(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xFA, nop());
+    OPCODE(0xFB, isb(ABSOLUTE_Y, inst->arg1, inst->arg2));
+    OPCODE(0xFC, nop());
+    OPCODE(0xFD, sbc(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0xFE, inc(ABSOLUTE_X, inst->arg1, inst->arg2));
+    OPCODE(0xFF, isb(ABSOLUTE_X, inst->arg1, inst->arg2));
+#ifndef USE_COMPUTED_GOTO
+    }
   }
-  if (len == 1) {
-    functions[opcode].FunctionEx_1Arg(mode);
-  } else if (len == 2) {
-    functions[opcode].FunctionEx_2Arg(mode, arg1);
-  } else if (len == 3) {
-    functions[opcode].FunctionEx_3Arg(mode, arg1, arg2);
-  } else { 
-    functions[opcode].FunctionEx_0Arg();
+#endif
+}
+
+#undef OPCODE
+#undef DISPATCH
+#undef RETIRE
+
+
+/**
+ * Decodes and executes the instruction at the program counter,
+ * then advances the program counter past it. Does not poll
+ * for interrupts.
+ */
+void executeInstruction(void) {
+  runInstructions(1);
+}
+
+
+/**
+ * Event handlers for the interrupt sources.
+ */
+static void nmiEvent(uint64_t time) {
+  (void) time;
+  NMInterruptHandler();
+}
+
+static void irqEvent(uint64_t time) {
+  (void) time;
+  if (nes->irqLine && !getFlagInterrupt()) IRQHandler();
+}
+
+static void frameIRQEvent(uint64_t time) {
+  (void) time;
+  assertIRQ(IRQ_SOURCE_FRAME);
+}
+
+static void mapperIRQEvent(uint64_t time) {
+  (void) time;
+  assertIRQ(IRQ_SOURCE_MAPPER);
+}
+
+
+/**
+ * Registers the CPU's interrupt handling with the event scheduler.
+ * The APU and mappers request IRQs by scheduling EVENT_FRAME_IRQ
+ * and EVENT_MAPPER_IRQ, and acknowledge them with releaseIRQ().
+ */
+void initInterrupts(void) {
+  registerEventHandler(EVENT_NMI, nmiEvent);
+  registerEventHandler(EVENT_IRQ, irqEvent);
+  registerEventHandler(EVENT_FRAME_IRQ, frameIRQEvent);
+  registerEventHandler(EVENT_MAPPER_IRQ, mapperIRQEvent);
+}
+
+
+/**
+ * Dispatches the events that have come due. Called once after every
+ * instruction (or translated block) has executed.
+ */
+void dispatchEvents(void) {
+  if (nes->cycle >= nes->eventHorizon) runEvents(nes->cycle);
+}
+
+
+/**
+ * Determines whether an absolute address can be read by an idle
+ * loop: CPU RAM, SRAM, PRG ROM, and PPUSTATUS, whose read is
+ * repeatable while the vertical blank flag is clear.
+ */
+uint8_t idleReadable(uint16_t addr) {
+  return addr < 0x2000 || addr >= 0x6000 || (addr < 0x4000 && (addr & 0x07) == 0x02);
+}
+
+
+/**
+ * Statically checks the code at a loop head for a short polling
+ * loop: only reads, register and flag operations, exit branches,
+ * and a branch or JMP back to the head.
+ *
+ * @param head: Address the CPU just jumped back to.
+ *
+ * @returns: Number of instructions in the loop, or 0 if the
+ *           code is not a side-effect-free loop.
+ */
+uint8_t idleLoopLength(uint16_t head) {
+  uint32_t pc = head;
+  for (uint8_t i = 1; i <= IDLE_MAX_INSTRUCTIONS; i++) {
+    if ((pc >= 0x2000 && pc < 0x8000) || pc > 0xFFFD) return 0;
+    const DecodedInstruction * inst = fetchInstruction(pc);
+    const OpcodeDescriptor * op = &descriptors[inst->opcode];
+    uint16_t addr = inst->arg1 | (inst->arg2 << 8);
+    if (!(op->flags & OPCODE_IDLE_SAFE)) return 0;
+    switch (op->addrMode) {
+      case RELATIVE:
+        if ((uint16_t)(pc + 2 + (int8_t) inst->arg1) == head) return i;
+        break;
+      case ABSOLUTE:
+        if (op->pcIncrement == 0) return addr == head ? i : 0;
+        if (!idleReadable(addr)) return 0;
+        break;
+      case ABSOLUTE_X:
+      case ABSOLUTE_Y:
+        if (addr < 0x6000 && addr + 0xFF >= 0x2000) return 0;
+        break;
+      case INDIRECT:
+      case INDIRECT_X:
+      case INDIRECT_Y:
+        return 0;
+      default:
+        break;
+    }
+    pc += op->operands;
   }
-  cycle += time;
-  regs.pc += (strcmp(opname, "JSR") != 0 &&
-              strcmp(opname, "JMP") != 0 &&
-              strcmp(opname, "RTI") != 0) ? len : 0;
-  if (getVerticalBlankStart()) {
-    if (getNMIGeneration() && !interrupted) {
-      setNMIGeneration(0);
-      interrupted = 1;
-      NMInterruptHandler();
+  return 0;
+}
+
+
+/**
+ * Called when execution jumps backwards (or a translated block loops
+ * onto itself). Detects a side-effect-free polling loop whose last
+ * iteration left the CPU exactly as it found it. Repeating such an
+ * iteration cannot change anything but the cycle count until the PPU
+ * status changes or an interrupt arrives, so the caller may skip
+ * whole iterations up to the next scheduled event.
+ *
+ * @param steps: Number of instructions retired so far.
+ * @param iterCycles: Set to the cycles taken by one iteration.
+ * @param iterSteps: Set to the instructions retired by one iteration.
+ *
+ * @returns: 1 if iterations can be skipped, 0 otherwise.
+ */
+uint8_t idleLoopIteration(uint32_t steps, uint32_t * iterCycles, uint32_t * iterSteps) {
+  if (nes->regs.pc != nes->idle.head || !nes->idle.length) {
+    if (nes->regs.pc != nes->idle.head) {
+      nes->idle.head = nes->regs.pc;
+      nes->idle.length = idleLoopLength(nes->regs.pc);
+      nes->idle.armed = 0;
     }
+    if (!nes->idle.length) return 0;
   }
-  else if (!getFlagInterrupt()) {
-    if (interrupted == 1) {
-      IRQHandler();
-    } else if (interrupted == 0) {
-      interrupted = 7;
-    } else interrupted--;
+  // Compared with the flags folded in, but left lazy: folding them
+  // here would leave regs.p different from a run without the check.
+  struct registers regs = nes->regs;
+  regs.p = peekStatusRegister();
+  if (nes->idle.armed && registersEqual(&nes->idle.regs, &regs) &&
+      nes->idle.latch == nes->ppuRegisters.PPUWriteLatch &&
+      nes->idle.interrupts == nes->interruptCount &&
+      steps - nes->idle.steps <= nes->idle.length &&
+      !getVerticalBlankStart()) {
+    *iterCycles = nes->cycle - nes->idle.cycle;
+    *iterSteps = steps - nes->idle.steps;
+    nes->idle.cycle = nes->cycle;
+    nes->idle.steps = steps;
+    return 1;
   }
-  return cycle;
+  nes->idle.regs = regs;
+  nes->idle.latch = nes->ppuRegisters.PPUWriteLatch;
+  nes->idle.cycle = nes->cycle;
+  nes->idle.steps = steps;
+  nes->idle.interrupts = nes->interruptCount;
+  nes->idle.armed = 1;
+  return 0;
+}
+
+
+/**
+ * Advances the CPU clock without executing instructions, then
+ * dispatches the events that the skipped instructions would have.
+ *
+ * @param n: Number of cycles to skip.
+ *
+ * @returns: The CPU cycle count after skipping.
+ */
+uint64_t skipCycles(uint32_t n) {
+  nes->cycle += n;
+  dispatchEvents();
+  return nes->cycle;
+}
+
+
+/**
+ * Executes instructions until the next due event, jump back or end
+ * of frame (see runInstructions()), then dispatches the events that
+ * have come due.
+ *
+ * @returns: The CPU cycle count after execution.
+ */
+uint64_t step(void) {
+  runInstructions(UINT32_MAX);
+  dispatchEvents();
+  return nes->cycle;
 }
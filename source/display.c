@@ -1,11 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include "compose.h"
+#include "display.h"
+#include "memory.h"
+
+#ifndef HEADLESS_ONLY
 #include "SDL2/SDL.h"
 #include "ppu.h"
 #include "cpu.h"
-#define SCREEN_WIDTH 256
-#define SCREEN_HEIGHT 240
 #define TILE_ROW 32
 #define TILE_COL 30
 #define TILE_LEN 8
@@ -17,27 +20,14 @@
 typedef struct {
   SDL_Renderer *renderer;
   SDL_Window *window;
-  SDL_Texture *scanlineTexture;
+  SDL_Texture *frameTexture;
 } EmuDisplay; 
 
 // Define an instance of the EmuDisplay
 // struct to hold display data.
 EmuDisplay display;
 
-extern uint8_t pTable0[0x1000];
-extern uint8_t pTable1[0x1000];
-extern NameTable nTable0;
-extern NameTable nTable1;
-extern NameTable nTable2;
-extern NameTable nTable3;
-extern uint8_t imagePalette[0x10];
-extern uint8_t spritePalette[0x10];
-extern const struct color palette[48];
-extern struct Header head;
-
-// pixels from end of each scanline to be
-// placed at the beginning of the next scanline
-uint32_t preRenderPixels[0x10];
+
 
 /**
  * Performs SDL and memory management
@@ -46,16 +36,18 @@ uint32_t preRenderPixels[0x10];
  */
 void cleanup(void) {
   
+  SDL_DestroyTexture(display.frameTexture);
 	SDL_DestroyRenderer(display.renderer); 
   SDL_DestroyWindow(display.window); 
-  SDL_DestroyTexture(display.scanlineTexture);
   SDL_Quit();
 }
 
 
 /**
- * Checks and handles any SDL event that occurs
- * during runtime of the program.
+ * Checks and handles every SDL event that has
+ * queued up during runtime of the program.
+ *
+ * @returns: 0 if the window was closed, 1 otherwise.
  */
 uint8_t handleEvent(void) {
   SDL_Event event;
@@ -69,45 +61,88 @@ uint8_t handleEvent(void) {
 	return 0;
 
       default:
-        return 1;
+        break;
     }
   }
   return 1;
 }
 
 /**
- * Calls functions to initialize, render, and
- * display the window for the emulator.
- * Also checks for user events that occur
- * such as closing the display window.
+ * Converts a finished frame straight into the display
+ * texture and presents it. With vsync enabled this waits
+ * for the display's next refresh.
  *
- * @return status
+ * @param frame: NES colour of every dot of the frame.
+ * @param emphasis: Emphasis bits of every scanline.
  */
-uint8_t presentScene(void)
+static void presentFrame(const uint8_t * frame, const uint8_t * emphasis)
 {
-  SDL_RenderPresent(display.renderer);
-  if (!handleEvent()) {
-    return -1;
+  void * pixels;
+  int pitch;
+  if (SDL_LockTexture(display.frameTexture, NULL, &pixels, &pitch)) {
+    printf("Failed to lock texture: %s\n", SDL_GetError());
+    exit(1);
   }
-  //SDL_Delay(1);
-  return 0;
+  convertFrame(pixels, pitch, frame, emphasis, PIXEL_ARGB8888);
+  SDL_UnlockTexture(display.frameTexture);
+  SDL_RenderClear(display.renderer);
+  SDL_RenderCopy(display.renderer, display.frameTexture, NULL, NULL);
+  SDL_RenderPresent(display.renderer);
 }
 
 
-void getDisplayStatus() {
+/**
+ * Polls window and input events. Called once per frame.
+ *
+ * @returns: 0 if the emulator should quit, 1 otherwise.
+ */
+uint8_t getDisplayStatus(void) {
   return handleEvent();
 }
 
 
+/**
+ * Checks whether the rewind key (backspace) is held down.
+ *
+ * @returns: 1 while the key is held, 0 otherwise.
+ */
+uint8_t displayRewindHeld(void) {
+  return SDL_GetKeyboardState(NULL)[SDL_SCANCODE_BACKSPACE];
+}
+
+
+/**
+ * Reads the keyboard as the controller on port 1: the arrow keys,
+ * X for A, Z for B, right shift for select and return for start.
+ * Nothing is plugged into port 2.
+ *
+ * @param buttons: Set to the buttons held on each port.
+ */
+void displayReadButtons(uint8_t * buttons) {
+  const Uint8 * keys = SDL_GetKeyboardState(NULL);
+  buttons[0] = (keys[SDL_SCANCODE_X] ? BUTTON_A : 0) |
+               (keys[SDL_SCANCODE_Z] ? BUTTON_B : 0) |
+               (keys[SDL_SCANCODE_RSHIFT] ? BUTTON_SELECT : 0) |
+               (keys[SDL_SCANCODE_RETURN] ? BUTTON_START : 0) |
+               (keys[SDL_SCANCODE_UP] ? BUTTON_UP : 0) |
+               (keys[SDL_SCANCODE_DOWN] ? BUTTON_DOWN : 0) |
+               (keys[SDL_SCANCODE_LEFT] ? BUTTON_LEFT : 0) |
+               (keys[SDL_SCANCODE_RIGHT] ? BUTTON_RIGHT : 0);
+  buttons[1] = 0;
+}
+
+
 /**
  * Called once upon the display startup to properly initialize
  * the display and set up key components of the NES graphics.
+ *
+ * @param vsync: Lock presentation to the display's refresh rate.
  */
-void displayInit(void) {
+void displayInit(uint8_t vsync) {
   
   // Define flags for SDL_Window and SDL_Renderer.
   int rendererFlags, windowFlags;
-  rendererFlags = SDL_RENDERER_ACCELERATED;
+  rendererFlags = SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
   windowFlags = 0;
 
   // SDL initialization fails.
@@ -128,86 +163,54 @@ void displayInit(void) {
   // Sets linear scaling quality.
   SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
   
-  // Define the display renderer.
+  // Define the display renderer. Hosts without a GPU
+  // fall back to the software renderer.
   display.renderer = SDL_CreateRenderer(display.window, -1, rendererFlags);
+  if (!display.renderer) {
+    rendererFlags = SDL_RENDERER_SOFTWARE | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+    display.renderer = SDL_CreateRenderer(display.window, -1, rendererFlags);
+  }
   
   // Error creating the renderer.
   if (!display.renderer) {
 		printf("Failed to create renderer: %s\n", SDL_GetError());
     exit(1);
   }
+
+  // The texture the frame buffer is uploaded to.
+  display.frameTexture = SDL_CreateTexture(display.renderer,
+    SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+    SCREEN_WIDTH, SCREEN_HEIGHT);
+  if (!display.frameTexture) {
+    printf("Failed to create texture: %s\n", SDL_GetError());
+    exit(1);
+  }
+  setFrameSink(presentFrame);
   atexit(cleanup);
 }
 
+#else
 
 /**
- * Converts color struct to a Uint32 value.
- *
- * @param c: struct color instance that contains an RGB value.
- *
- * @returns: Uint32 value that is a convert struct color instance.
+ * Stand-ins used when the emulator is built without SDL
+ * (HEADLESS_ONLY); only the headless backend is available.
  */
-Uint32 color2int(struct color c) {
-  Uint32 val = 0xFF000000 | (c.rgb[0] << 16) | (c.rgb[1] << 8) | (c.rgb[2]);
-  return val;
+void displayInit(uint8_t vsync) {
+  (void) vsync;
+  printf("Error: Built without SDL; run with --headless.\n");
+  exit(1);
 }
 
+uint8_t getDisplayStatus(void) {
+  return 1;
+}
 
-/**
- * Renders a scanline of pixel data onto the display.
- *
- * @param buffer: pointer to the scanline of pixel data.
- * @param scanline: current scanline (row) that is being displayed.
- */
-uint8_t renderScanline(uint8_t *buffer, uint8_t scanline) {
-  uint8_t tileIdx = 0, fullPaletteIdx = 0, upperPaletteIdx = 0;
-  uint8_t fetchCycle = 0;
-  uint32_t * pixels;
-  int pitch;
-  SDL_Texture * text = SDL_CreateTexture(display.renderer,
-    SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 
-    256, 1);
-  if (text == NULL) {
-    SDL_Log("SDL_CreateTexture() failed: %s", SDL_GetError());
-    exit(1);
-  }
-  SDL_LockTexture(text, NULL, (void **)&pixels, &pitch); 
-  Uint32 * scanlinePixels = (Uint32*) pixels;
-  memcpy(scanlinePixels, preRenderPixels, (size_t) 0x10*sizeof(uint32_t));
-  for (int tile = 0; tile < 32; tile++) {
-    tileIdx = *(buffer + tile); // gets the AT byte for each tile
-    uint8_t lowerByte = *(buffer + tile + 32);
-    uint8_t upperByte = *(buffer + tile + 64);
-    if (scanline % 32 < 16) {
-      if (tile % 4 < 2) {
-				upperPaletteIdx = (tileIdx & 0b00000011) << 2;
-      } else {
-        upperPaletteIdx = tileIdx & 0b00001100;
-      }
-    } else if (tile % 4 < 2) {
-      upperPaletteIdx = (tileIdx & 0b00110000) >> 2;
-    } else {
-      upperPaletteIdx = (tileIdx & 0b11000000) >> 4;
-    }
-    for (int cycleCount = 0; cycleCount < 8; cycleCount++) {
-	fullPaletteIdx = upperPaletteIdx | 
-		( ( ( upperByte & ( (1 << (7-cycleCount) ) ) ) >> (7-cycleCount) ) << 1 ) | 
-		    ( lowerByte & ( (1 << (7-cycleCount) ) ) ) >> (7-cycleCount);
-	//Uint32 colorValue = color2int(palette[imagePalette[(8*tile + cycleCount)%64]]);
-	Uint32 colorValue = color2int(palette[imagePalette[fullPaletteIdx]]);
-	if (tile < 30) {
-	  scanlinePixels[8*tile + cycleCount + 16] = colorValue;
-	} else {
-	  preRenderPixels[8*(tile-30) + cycleCount] = colorValue;
-	}
-    }
-  }
-  SDL_UnlockTexture(text);
-  display.scanlineTexture = text;
-  SDL_Rect line = (SDL_Rect) { 0, scanline, 256, 1};
-  SDL_RenderCopy(display.renderer, display.scanlineTexture, NULL, &line);
-  SDL_DestroyTexture(display.scanlineTexture);
-  if (presentScene() == -1) exit(1);
+uint8_t displayRewindHeld(void) {
+  return 0;
 }
 
+void displayReadButtons(uint8_t * buttons) {
+  buttons[0] = buttons[1] = 0;
+}
 
+#endif
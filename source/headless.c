@@ -0,0 +1,118 @@
+/**
+ * Headless video backend. Needs no window or SDL; completed frames
+ * are left in frameBuffer and can be dumped to a file or pipe as a
+ * stream of PPM images or raw ARGB or RGB565 pixels.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compose.h"
+#include "display.h"
+
+// Bytes of the largest converted frame.
+#define FRAME_BYTES (SCREEN_WIDTH * SCREEN_HEIGHT * 4)
+
+// Stream frames are dumped to, if any.
+static FILE * dumpFile = NULL;
+static enum DumpFormat dumpFormat;
+
+// Frames are converted here before they are dumped.
+static uint8_t dumpPixels[FRAME_BYTES];
+
+
+/**
+ * Writes a frame to a stream as a binary PPM (P6) image.
+ * Safe to call from several threads at once.
+ *
+ * @param file: Stream to write to.
+ * @param frame: NES colour of every dot of the frame.
+ * @param emphasis: Emphasis bits of every scanline.
+ * @param rgb: Room for the frame's RGB24 pixels.
+ *
+ * @returns: 1 on success, 0 on a write error.
+ */
+static uint8_t writePPM(FILE * file, const uint8_t * frame, const uint8_t * emphasis, uint8_t * rgb) {
+  convertFrame(rgb, SCREEN_WIDTH * 3, frame, emphasis, PIXEL_RGB24);
+  fprintf(file, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+  return fwrite(rgb, SCREEN_WIDTH * SCREEN_HEIGHT * 3, 1, file) == 1;
+}
+
+
+/**
+ * Writes a completed frame to the dump stream.
+ *
+ * @param frame: NES colour of every dot of the frame.
+ * @param emphasis: Emphasis bits of every scanline.
+ */
+static void dumpFrame(const uint8_t * frame, const uint8_t * emphasis) {
+  size_t written;
+  if (dumpFormat == DUMP_PPM) {
+    written = writePPM(dumpFile, frame, emphasis, dumpPixels);
+  } else {
+    enum PixelFormat format = dumpFormat == DUMP_RAW ? PIXEL_ARGB8888 : PIXEL_RGB565;
+    size_t rowBytes = SCREEN_WIDTH * pixelBytes[format];
+    convertFrame(dumpPixels, rowBytes, frame, emphasis, format);
+    written = fwrite(dumpPixels, rowBytes * SCREEN_HEIGHT, 1, dumpFile);
+  }
+  if (written != 1) {
+    fprintf(stderr, "Error: Unable to write frame dump.\n");
+    exit(1);
+  }
+}
+
+
+/**
+ * Flushes and closes the dump stream before the program terminates.
+ */
+static void closeDump(void) {
+  if (dumpFile && dumpFile != stdout) fclose(dumpFile);
+  else if (dumpFile) fflush(dumpFile);
+  dumpFile = NULL;
+}
+
+
+/**
+ * Saves a single frame as a PPM image file.
+ *
+ * @param path: File to write.
+ * @param frame: NES colour of every dot of the frame.
+ * @param emphasis: Emphasis bits of every scanline.
+ *
+ * @returns: 1 on success, 0 if the file could not be written.
+ */
+uint8_t savePPM(const char * path, const uint8_t * frame, const uint8_t * emphasis) {
+  uint8_t * rgb = malloc(SCREEN_WIDTH * SCREEN_HEIGHT * 3);
+  FILE * file = rgb ? fopen(path, "wb") : NULL;
+  if (!file) {
+    free(rgb);
+    return 0;
+  }
+  uint8_t ok = writePPM(file, frame, emphasis, rgb);
+  free(rgb);
+  return fclose(file) == 0 && ok;
+}
+
+
+/**
+ * Selects the headless backend in place of the display window.
+ *
+ * @param path: File to dump every frame to, "-" for standard
+ *              output, or NULL to keep frames in memory only.
+ * @param format: Pixel format of the dump.
+ */
+void headlessInit(const char * path, enum DumpFormat format) {
+  if (!path) {
+    setFrameSink(NULL);
+    return;
+  }
+  dumpFile = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+  if (!dumpFile) {
+    fprintf(stderr, "Error: Unable to open \"%s\" for the frame dump.\n", path);
+    exit(1);
+  }
+  dumpFormat = format;
+  setFrameSink(dumpFrame);
+  atexit(closeDump);
+}
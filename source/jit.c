@@ -0,0 +1,686 @@
+/**
+ * Optional dynamic recompiler for hot 6502 basic blocks in PRG ROM.
+ *
+ * A block runs from its entry point up to and including the first
+ * instruction that can change the program counter (branch, jump,
+ * JSR/RTS/RTI, BRK, KIL) or write to a mapper register, or
+ * JIT_MAX_BLOCK instructions. It is translated
+ * into x86-64 code that calls the interpreter's own opcode handlers with
+ * the addressing mode and operands baked in as immediates, so the
+ * translation cannot drift from the interpreter's semantics. Loads,
+ * stores and transfers that only touch registers, flags and zero page,
+ * which cannot reach I/O, are emitted inline instead (see emitInline()).
+ * Decode, dispatch and the per-instruction PC bookkeeping disappear. Cycles
+ * are still counted instruction by instruction, and a block returns to
+ * the main loop as soon as an event comes due, so events are
+ * dispatched after the same instruction as in the interpreter and the
+ * two backends run cycle for cycle.
+ *
+ * In differential mode every block is first run by the interpreter,
+ * then rolled back and run translated, and the CPU registers, cycle
+ * counts, RAM and SRAM of both runs are compared. Accesses to memory
+ * mapped I/O are recorded during the interpreter pass and replayed to
+ * the translated pass, which must make the same accesses in the same
+ * order, instead of reaching the hardware a second time.
+ */
+// MAP_ANONYMOUS is not part of strict C99.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "jit.h"
+#include "registers.h"
+#include "nes.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#include <unistd.h>
+#define JIT_SUPPORTED
+#endif
+
+#define KB 1024
+
+// Executions of a PRG ROM address before it is translated.
+#define JIT_THRESHOLD 16
+
+// Longest block that is translated, in instructions.
+#define JIT_MAX_BLOCK 64
+
+// Size of the executable code buffer. Flushed entirely when full.
+#define JIT_CODE_SIZE (4*KB*KB)
+
+// Largest emitted sequence for one instruction, plus the block epilogue.
+#define JIT_MAX_INST_BYTES 160
+
+extern OpcodeDescriptor descriptors[0x100];
+
+// Longest sequence of I/O accesses differential mode can replay.
+#define JIT_MAX_BUS_ACCESSES 256
+
+/**
+ * State compared by differential mode.
+ */
+struct CpuSnapshot {
+  struct registers regs;
+  uint64_t cycle;
+  uint64_t instructionCycle;
+  uint64_t eventHorizon;
+  uint8_t ram[0x0800];
+  uint8_t sram[0x2000];
+};
+
+/**
+ * An access to memory mapped I/O made by the interpreter pass of
+ * differential mode, with the event horizon the handler left behind.
+ */
+struct BusAccess {
+  uint16_t addr;
+  uint8_t value;
+  uint8_t write;
+  uint64_t eventHorizon;
+};
+
+/**
+ * A console's translation cache, allocated by jitInit().
+ * Translated code refers to the console's own registers and
+ * memory, so every console translates its own blocks.
+ */
+struct JitState {
+  enum CpuBackend backend;
+
+  // Translated blocks and hit counters keyed by PC - $8000.
+  JitBlock blocks[0x8000];
+  uint8_t hits[0x8000];
+
+  uint8_t * codeBuffer;
+  uint32_t codeUsed;
+
+  // Counters printed by jitReport().
+  struct {
+    uint64_t translated;
+    uint64_t flushes;
+    uint64_t verified;
+    uint64_t unverified;
+  } jitStats;
+
+  // Snapshots taken by differential mode.
+  struct CpuSnapshot before, reference;
+
+  // I/O accesses of the block being verified, and how far the
+  // translated pass has replayed them.
+  struct BusAccess bus[JIT_MAX_BUS_ACCESSES];
+  uint32_t busCount, busNext;
+  uint8_t busOverflow, busMismatch;
+};
+
+
+/**
+ * Selects the CPU backend of the bound console and allocates its
+ * translation cache and executable code buffer.
+ *
+ * @param mode: Backend requested on the command line.
+ *
+ * @returns: 1 if the backend is usable, 0 if the host cannot run
+ *           translated code (the interpreter is then used instead).
+ */
+uint8_t jitInit(enum CpuBackend mode) {
+  if (mode == CPU_INTERP) return 1;
+#ifdef JIT_SUPPORTED
+  struct JitState * jit = calloc(1, sizeof(struct JitState));
+  if (!jit) return 0;
+  // Never writable and executable at once; see protectCode().
+  jit->codeBuffer = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->codeBuffer == MAP_FAILED) {
+    free(jit);
+    return 0;
+  }
+  jit->backend = mode;
+  nes->jit = jit;
+  nes->cpuStep = jitStep;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+
+/**
+ * Frees the translation cache of the bound console, if it has one.
+ */
+void jitRelease(void) {
+  if (!nes->jit) return;
+#ifdef JIT_SUPPORTED
+  munmap(nes->jit->codeBuffer, JIT_CODE_SIZE);
+#endif
+  free(nes->jit);
+  nes->jit = NULL;
+  nes->cpuStep = step;
+}
+
+
+/**
+ * Drops every translated block and reclaims the code buffer.
+ */
+void jitFlush(void) {
+  memset(nes->jit->blocks, 0, sizeof(nes->jit->blocks));
+  nes->jit->codeUsed = 0;
+  nes->jit->jitStats.flushes++;
+}
+
+
+/**
+ * Drops the translated blocks that contain any byte of an 8 KB
+ * PRG ROM window. Called with the decoded instruction flush whenever
+ * the window is remapped.
+ *
+ * @param window: 0-3 for $8000, $A000, $C000 and $E000.
+ */
+void jitInvalidateBank(uint8_t window) {
+  if (!nes->jit) return;
+  uint16_t first = 0x8000 + window * 0x2000;
+  uint16_t last = first + 0x1FFF;
+  for (uint32_t pc = 0x8000; pc <= 0xFFFF; pc++) {
+    JitBlock * block = &nes->jit->blocks[pc - 0x8000];
+    if (block->code && pc <= last && block->last >= first) {
+      block->code = NULL;
+    }
+  }
+  memset(nes->jit->hits + (first - 0x8000), 0, 0x2000);
+}
+
+
+#ifdef JIT_SUPPORTED
+/**
+ * Small emitters for the handful of x86-64 instructions used.
+ * rax holds addresses and rcx (or cl) values; handler arguments
+ * follow the System V calling convention (edi, esi, edx).
+ */
+static void emit8(uint8_t ** p, uint8_t b) { *(*p)++ = b; }
+
+static void emit16(uint8_t ** p, uint16_t v) { memcpy(*p, &v, 2); *p += 2; }
+
+static void emit32(uint8_t ** p, uint32_t v) { memcpy(*p, &v, 4); *p += 4; }
+
+static void emitMovRax(uint8_t ** p, const void * ptr) {
+  uint64_t v = (uint64_t)(uintptr_t) ptr;
+  emit8(p, 0x48); emit8(p, 0xB8);   // mov rax, imm64
+  memcpy(*p, &v, 8); *p += 8;
+}
+
+static void emitStorePC(uint8_t ** p, uint16_t pc) {
+  emitMovRax(p, &nes->regs.pc);
+  emit8(p, 0x66); emit8(p, 0xC7); emit8(p, 0x00);   // mov word [rax], imm16
+  emit16(p, pc);
+}
+
+static void emitLoadRcx(uint8_t ** p, const void * ptr) {
+  emitMovRax(p, ptr);
+  emit8(p, 0x48); emit8(p, 0x8B); emit8(p, 0x08);   // mov rcx, [rax]
+}
+
+static void emitReturn(uint8_t ** p, uint32_t count) {
+  emit8(p, 0xB8); emit32(p, count);   // mov eax, imm32
+  emit8(p, 0x48); emit8(p, 0x83); emit8(p, 0xC4); emit8(p, 0x08);   // add rsp, 8
+  emit8(p, 0xC3);   // ret
+}
+
+static void emitLoadCl(uint8_t ** p, const uint8_t * ptr) {
+  emitMovRax(p, ptr);
+  emit8(p, 0x8A); emit8(p, 0x08);   // mov cl, [rax]
+}
+
+static void emitStoreCl(uint8_t ** p, uint8_t * ptr) {
+  emitMovRax(p, ptr);
+  emit8(p, 0x88); emit8(p, 0x08);   // mov [rax], cl
+}
+
+static void emitStoreByte(uint8_t ** p, uint8_t * ptr, uint8_t val) {
+  emitMovRax(p, ptr);
+  emit8(p, 0xC6); emit8(p, 0x00); emit8(p, val);   // mov byte [rax], imm8
+}
+
+// Sets N and Z from cl, as SZFlags() does.
+static void emitSZFlags(uint8_t ** p) {
+  emitStoreCl(p, &nes->lazyResult);
+  emitMovRax(p, &nes->lazyFlags);
+  emit8(p, 0x80); emit8(p, 0x08); emit8(p, FLAG_ZERO | FLAG_NEGATIVE);   // or byte [rax], imm8
+}
+
+static void emitCall(uint8_t ** p, const OpcodeDescriptor * op, const DecodedInstruction * inst) {
+  if (op->operands >= 1) { emit8(p, 0xBF); emit32(p, op->addrMode); }   // mov edi, imm32
+  if (op->operands >= 2) { emit8(p, 0xBE); emit32(p, inst->arg1); }     // mov esi, imm32
+  if (op->operands >= 3) { emit8(p, 0xBA); emit32(p, inst->arg2); }     // mov edx, imm32
+  emitMovRax(p, (const void *) op->execute.FunctionEx_0Arg);
+  emit8(p, 0xFF); emit8(p, 0xD0);   // call rax
+}
+#endif
+
+
+/**
+ * Determines whether an instruction ends a basic block,
+ * i.e. whether it can set the program counter itself.
+ */
+uint8_t endsBlock(uint8_t opcode) {
+  const OpcodeDescriptor * op = &descriptors[opcode];
+  return op->pcIncrement == 0 || op->addrMode == RELATIVE ||
+         opcode == 0x60 || opcode == 0x00 || op->operands == 0;
+}
+
+
+/**
+ * Determines whether an instruction can write to the mapper
+ * registers at $8000-$FFFF. Such a write may switch the bank the
+ * rest of its block was translated from, so it ends the block too.
+ */
+uint8_t writesMapper(const OpcodeDescriptor * op, const DecodedInstruction * inst) {
+  uint16_t addr = inst->arg1 | (inst->arg2 << 8);
+  if (!(op->flags & OPCODE_WRITES)) return 0;
+  switch (op->addrMode) {
+    case ABSOLUTE:
+      return addr >= 0x8000;
+    case ABSOLUTE_X:
+    case ABSOLUTE_Y:
+      return addr + 0xFF >= 0x8000;
+    case INDIRECT:
+    case INDIRECT_X:
+    case INDIRECT_Y:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+
+#ifdef JIT_SUPPORTED
+/**
+ * Emits the common instructions that cannot touch I/O inline rather
+ * than as a handler call: register loads and transfers, increments,
+ * carry and decimal flag changes, NOP, and loads and stores of a
+ * fixed zero page address. Each has the same effect on the registers,
+ * lazy flags and RAM as its handler.
+ *
+ * @param p: Emit position.
+ * @param inst: Instruction to translate.
+ *
+ * @returns: 1 if the instruction was emitted, 0 if it needs a call.
+ */
+static uint8_t emitInline(uint8_t ** p, const DecodedInstruction * inst) {
+  struct registers * regs = &nes->regs;
+  uint8_t * reg = NULL;
+  switch (inst->opcode) {
+    case 0xA9: reg = &regs->a; break;   // LDA #imm
+    case 0xA2: reg = &regs->x; break;   // LDX #imm
+    case 0xA0: reg = &regs->y; break;   // LDY #imm
+    case 0xA5: case 0xA6: case 0xA4:    // LDA, LDX, LDY zp
+      reg = inst->opcode == 0xA5 ? &regs->a : inst->opcode == 0xA6 ? &regs->x : &regs->y;
+      emitLoadCl(p, &nes->ram[inst->arg1]);
+      emitStoreCl(p, reg);
+      emitSZFlags(p);
+      return 1;
+    case 0x85: case 0x86: case 0x84:    // STA, STX, STY zp
+      reg = inst->opcode == 0x85 ? &regs->a : inst->opcode == 0x86 ? &regs->x : &regs->y;
+      emitLoadCl(p, reg);
+      emitStoreCl(p, &nes->ram[inst->arg1]);
+      // As invalidateRAMInstruction().
+      for (uint8_t back = 0; back < 3; back++) {
+        emitStoreByte(p, &nes->decodedRAM[(inst->arg1 - back) & 0x07FF].valid, 0);
+      }
+      return 1;
+    case 0xAA: emitLoadCl(p, &regs->a); emitStoreCl(p, &regs->x); emitSZFlags(p); return 1;    // TAX
+    case 0xA8: emitLoadCl(p, &regs->a); emitStoreCl(p, &regs->y); emitSZFlags(p); return 1;    // TAY
+    case 0x8A: emitLoadCl(p, &regs->x); emitStoreCl(p, &regs->a); emitSZFlags(p); return 1;    // TXA
+    case 0x98: emitLoadCl(p, &regs->y); emitStoreCl(p, &regs->a); emitSZFlags(p); return 1;    // TYA
+    case 0xBA: emitLoadCl(p, &regs->sp); emitStoreCl(p, &regs->x); emitSZFlags(p); return 1;   // TSX
+    case 0x9A: emitLoadCl(p, &regs->x); emitStoreCl(p, &regs->sp); return 1;                   // TXS
+    case 0xE8: case 0xC8: case 0xCA: case 0x88:   // INX, INY, DEX, DEY
+      reg = inst->opcode == 0xE8 || inst->opcode == 0xCA ? &regs->x : &regs->y;
+      emitLoadCl(p, reg);
+      emit8(p, 0xFE); emit8(p, inst->opcode == 0xE8 || inst->opcode == 0xC8 ? 0xC1 : 0xC9);   // inc cl / dec cl
+      emitStoreCl(p, reg);
+      emitSZFlags(p);
+      return 1;
+    case 0x18: case 0x38:   // CLC, SEC
+      emitStoreByte(p, &nes->lazyCarry, inst->opcode == 0x38);
+      emitMovRax(p, &nes->lazyFlags);
+      emit8(p, 0x80); emit8(p, 0x08); emit8(p, FLAG_CARRY);   // or byte [rax], imm8
+      return 1;
+    case 0xD8: case 0xF8:   // CLD, SED
+      emitMovRax(p, &regs->p);
+      if (inst->opcode == 0xD8) { emit8(p, 0x80); emit8(p, 0x20); emit8(p, 0xF7); }   // and byte [rax], imm8
+      else { emit8(p, 0x80); emit8(p, 0x08); emit8(p, 0x08); }                        // or byte [rax], imm8
+      return 1;
+    case 0xEA:   // NOP
+      return 1;
+    default:
+      return 0;
+  }
+  // Immediate loads.
+  emit8(p, 0xB1); emit8(p, inst->arg1);   // mov cl, imm8
+  emitStoreCl(p, reg);
+  emitSZFlags(p);
+  return 1;
+}
+
+
+/**
+ * Stores the start cycle of the block's last instruction, which inline
+ * instructions skip, while rcx holds the cycle count after it.
+ */
+static void emitInstructionCycle(uint8_t ** p, uint32_t cycles) {
+  emit8(p, 0x48); emit8(p, 0x81); emit8(p, 0xE9); emit32(p, cycles);   // sub rcx, imm32
+  emitMovRax(p, &nes->instructionCycle);
+  emit8(p, 0x48); emit8(p, 0x89); emit8(p, 0x08);   // mov [rax], rcx
+}
+
+
+/**
+ * Makes the pages of the code buffer that hold a range either
+ * writable, while a block is emitted into it, or executable, so that
+ * no page is ever both.
+ *
+ * @param start: Start of the range.
+ * @param size: Size of the range in bytes.
+ * @param prot: PROT_READ | PROT_WRITE or PROT_READ | PROT_EXEC.
+ *
+ * @returns: 1 on success, 0 if the protection could not be changed.
+ */
+static uint8_t protectCode(uint8_t * start, size_t size, int prot) {
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t first = (uintptr_t) start & ~(page - 1);
+  uintptr_t end = ((uintptr_t) start + size + page - 1) & ~(page - 1);
+  return mprotect((void *) first, end - first, prot) == 0;
+}
+#endif
+
+
+/**
+ * Translates the basic block starting at a PRG ROM address.
+ *
+ * @param pc: Entry point of the block ($8000-$FFFF).
+ *
+ * @returns: Pointer to the new block, or NULL if nothing was translated.
+ */
+JitBlock * translateBlock(uint16_t pc) {
+#ifdef JIT_SUPPORTED
+  if (nes->jit->codeUsed + JIT_MAX_BLOCK * JIT_MAX_INST_BYTES > JIT_CODE_SIZE) jitFlush();
+  uint8_t * start = nes->jit->codeBuffer + nes->jit->codeUsed;
+  uint8_t * p = start;
+  size_t room = JIT_MAX_BLOCK * JIT_MAX_INST_BYTES;
+  if (!protectCode(start, room, PROT_READ | PROT_WRITE)) return NULL;
+  uint32_t addr = pc;
+  uint16_t count = 0;
+  uint8_t control = 0, inlined = 0;
+
+  emit8(&p, 0x48); emit8(&p, 0x83); emit8(&p, 0xEC); emit8(&p, 0x08);   // sub rsp, 8
+  while (count < JIT_MAX_BLOCK && addr <= 0xFFFD) {
+    const DecodedInstruction * inst = fetchInstruction(addr);
+    const OpcodeDescriptor * op = &descriptors[inst->opcode];
+    control = endsBlock(inst->opcode);
+    inlined = !control && emitInline(&p, inst);
+    if (!inlined) {
+      // I/O handlers catch the PPU up to the start of the instruction.
+      emitLoadRcx(&p, &nes->cycle);
+      emitMovRax(&p, &nes->instructionCycle);
+      emit8(&p, 0x48); emit8(&p, 0x89); emit8(&p, 0x08);   // mov [rax], rcx
+      // Branches, jumps and BRK compute their target from regs.pc.
+      if (control) emitStorePC(&p, addr);
+      emitCall(&p, op, inst);
+    }
+    emitMovRax(&p, &nes->cycle);
+    emit8(&p, 0x48); emit8(&p, 0x81); emit8(&p, 0x00); emit32(&p, op->cycles);   // add qword [rax], imm32
+    count++;
+    if (control) {
+      if (op->pcIncrement) {
+        emitMovRax(&p, &nes->regs.pc);
+        emit8(&p, 0x66); emit8(&p, 0x81); emit8(&p, 0x00);   // add word [rax], imm16
+        emit16(&p, op->pcIncrement);
+      }
+      addr += op->operands ? op->operands : 1;
+      break;
+    }
+    addr += op->pcIncrement;
+    if (writesMapper(op, inst) || count == JIT_MAX_BLOCK || addr > 0xFFFD) {
+      emitStorePC(&p, addr);
+      if (inlined) {
+        emitLoadRcx(&p, &nes->cycle);
+        emitInstructionCycle(&p, op->cycles);
+      }
+      break;
+    }
+    // Return to the main loop if an event came due, as step() would.
+    emit8(&p, 0x48); emit8(&p, 0x8B); emit8(&p, 0x08);   // mov rcx, [rax]
+    emitMovRax(&p, &nes->eventHorizon);
+    emit8(&p, 0x48); emit8(&p, 0x3B); emit8(&p, 0x08);   // cmp rcx, [rax]
+    emit8(&p, 0x72);   // jb past the exit
+    uint8_t * jump = p++;
+    emitStorePC(&p, addr);
+    if (inlined) emitInstructionCycle(&p, op->cycles);
+    emitReturn(&p, count);
+    *jump = p - jump - 1;
+  }
+  if (!count) {
+    protectCode(start, room, PROT_READ | PROT_EXEC);
+    return NULL;
+  }
+  emitReturn(&p, count);
+  if (!protectCode(start, room, PROT_READ | PROT_EXEC)) {
+    // Blocks sharing these pages can no longer run.
+    jitFlush();
+    return NULL;
+  }
+
+  nes->jit->codeUsed += p - start;
+  JitBlock * block = &nes->jit->blocks[pc - 0x8000];
+  block->code = (uint32_t (*)(void)) start;
+  block->last = addr - 1;
+  block->instructions = count;
+  nes->jit->jitStats.translated++;
+  return block;
+#else
+  return NULL;
+#endif
+}
+
+
+static void takeSnapshot(struct CpuSnapshot * snap) {
+  statusRegister();
+  snap->regs = nes->regs;
+  snap->cycle = nes->cycle;
+  snap->instructionCycle = nes->instructionCycle;
+  snap->eventHorizon = nes->eventHorizon;
+  memcpy(snap->ram, nes->ram, sizeof(nes->ram));
+  memcpy(snap->sram, nes->sram, sizeof(nes->sram));
+}
+
+static void restoreSnapshot(const struct CpuSnapshot * snap) {
+  nes->regs = snap->regs;
+  setStatusRegister(snap->regs.p);
+  nes->cycle = snap->cycle;
+  nes->instructionCycle = snap->instructionCycle;
+  nes->eventHorizon = snap->eventHorizon;
+  memcpy(nes->ram, snap->ram, sizeof(nes->ram));
+  memcpy(nes->sram, snap->sram, sizeof(nes->sram));
+}
+
+static uint8_t sameSnapshot(const struct CpuSnapshot * a, const struct CpuSnapshot * b) {
+  return registersEqual(&a->regs, &b->regs) && a->cycle == b->cycle &&
+         a->instructionCycle == b->instructionCycle &&
+         a->eventHorizon == b->eventHorizon &&
+         !memcmp(a->ram, b->ram, sizeof(a->ram)) &&
+         !memcmp(a->sram, b->sram, sizeof(a->sram));
+}
+
+
+/**
+ * Takes the next recorded I/O access for the translated pass, and
+ * restores the event horizon its handler left. Flags a mismatch if
+ * the pass strays from the recorded accesses.
+ *
+ * @returns: The recorded access, or NULL on a mismatch.
+ */
+static const struct BusAccess * replayAccess(uint16_t addr, uint8_t write) {
+  struct JitState * jit = nes->jit;
+  const struct BusAccess * access = &jit->bus[jit->busNext];
+  if (jit->busNext == jit->busCount || access->addr != addr || access->write != write) {
+    jit->busMismatch = 1;
+    return NULL;
+  }
+  jit->busNext++;
+  nes->eventHorizon = access->eventHorizon;
+  return access;
+}
+
+
+static void recordAccess(uint16_t addr, uint8_t value, uint8_t write) {
+  struct JitState * jit = nes->jit;
+  if (jit->busCount == JIT_MAX_BUS_ACCESSES) {
+    jit->busOverflow = 1;
+    return;
+  }
+  jit->bus[jit->busCount++] = (struct BusAccess) {
+    .addr = addr, .value = value, .write = write, .eventHorizon = nes->eventHorizon
+  };
+}
+
+
+/**
+ * Reads memory mapped I/O while differential mode traces the bus.
+ * The interpreter pass reads through the handler and records the
+ * value, which the translated pass then reads back.
+ *
+ * @param addr: Address in CPU memory.
+ * @param handler: The page's read handler.
+ *
+ * @returns: Value read.
+ */
+uint8_t jitBusRead(uint16_t addr, ReadHandler handler) {
+  if (nes->busTrace == BUS_RECORD) {
+    uint8_t val = handler(addr);
+    recordAccess(addr, val, 0);
+    return val;
+  }
+  const struct BusAccess * access = replayAccess(addr, 0);
+  return access ? access->value : 0;
+}
+
+
+/**
+ * Writes memory mapped I/O while differential mode traces the bus.
+ * Only the interpreter pass reaches the handler; the translated pass
+ * must write the same value.
+ *
+ * @param addr: Address in CPU memory.
+ * @param val: Value to write.
+ * @param handler: The page's write handler.
+ */
+void jitBusWrite(uint16_t addr, uint8_t val, WriteHandler handler) {
+  if (nes->busTrace == BUS_RECORD) {
+    handler(addr, val);
+    recordAccess(addr, val, 1);
+    return;
+  }
+  const struct BusAccess * access = replayAccess(addr, 1);
+  if (access && access->value != val) nes->jit->busMismatch = 1;
+}
+
+
+/**
+ * Runs a block through the interpreter and the translation and
+ * terminates the emulator if the two disagree. Like the translation,
+ * the interpreter pass stops early once an event comes due.
+ */
+void runVerified(JitBlock * block, uint16_t pc) {
+  struct JitState * jit = nes->jit;
+  // A mapper write in the block can drop it from the cache.
+  uint32_t (*code)(void) = block->code;
+  uint32_t executed = 0;
+  takeSnapshot(&jit->before);
+  jit->busCount = 0;
+  jit->busOverflow = 0;
+  nes->busTrace = BUS_RECORD;
+  do {
+    executeInstruction();
+    executed++;
+  } while (executed < block->instructions && nes->cycle < nes->eventHorizon);
+  nes->busTrace = BUS_DIRECT;
+  if (jit->busOverflow) {
+    jit->jitStats.unverified++;
+    return;
+  }
+  takeSnapshot(&jit->reference);
+  restoreSnapshot(&jit->before);
+  jit->busNext = 0;
+  jit->busMismatch = 0;
+  nes->busTrace = BUS_REPLAY;
+  uint32_t translated = code();
+  nes->busTrace = BUS_DIRECT;
+  struct CpuSnapshot * result = &jit->before;
+  takeSnapshot(result);
+  if (translated != executed || jit->busMismatch || jit->busNext != jit->busCount ||
+      !sameSnapshot(&jit->reference, result)) {
+    printf("Error: JIT block at %X diverged from the interpreter.\n", pc);
+    printf("  interp: PC:%X A:%X X:%X Y:%X P:%X SP:%X CYCLE:%" PRIu64 " I/O:%u\n", jit->reference.regs.pc,
+      jit->reference.regs.a, jit->reference.regs.x, jit->reference.regs.y, jit->reference.regs.p,
+      jit->reference.regs.sp, jit->reference.cycle, jit->busCount);
+    printf("  jit:    PC:%X A:%X X:%X Y:%X P:%X SP:%X CYCLE:%" PRIu64 " I/O:%u%s\n", nes->regs.pc,
+      nes->regs.a, nes->regs.x, nes->regs.y, nes->regs.p, nes->regs.sp, nes->cycle, jit->busNext,
+      jit->busMismatch ? " (mismatched)" : "");
+    exit(1);
+  }
+  jit->jitStats.verified++;
+}
+
+
+/**
+ * Replacement for step() when the JIT backend is active.
+ * Runs a translated block if one exists at the program counter,
+ * up to its end or the first due event, otherwise interprets a
+ * single instruction and counts the address towards translation.
+ *
+ * @returns: The CPU cycle count after execution.
+ */
+uint64_t jitStep(void) {
+  uint16_t pc = nes->regs.pc;
+  if (pc >= 0x8000) {
+    JitBlock * block = &nes->jit->blocks[pc - 0x8000];
+    if (!block->code && ++nes->jit->hits[pc - 0x8000] >= JIT_THRESHOLD) {
+      nes->jit->hits[pc - 0x8000] = 0;
+      block = translateBlock(pc);
+    }
+    if (block && block->code) {
+      // In differential mode the interpreter pass counts the instructions.
+      if (nes->jit->backend == CPU_JIT_DIFF) {
+        runVerified(block, pc);
+      } else {
+        nes->instructionCount += block->code();
+      }
+      dispatchEvents();
+      return nes->cycle;
+    }
+  }
+  executeInstruction();
+  dispatchEvents();
+  return nes->cycle;
+}
+
+
+/**
+ * Prints translation statistics when the JIT backend was used. They
+ * go to standard error, as standard output may carry a frame dump.
+ */
+void jitReport(void) {
+  if (!nes || !nes->jit) return;
+  fprintf(stderr, "JIT: %" PRIu64 " blocks translated, %" PRIu64 " flushes",
+    nes->jit->jitStats.translated, nes->jit->jitStats.flushes);
+  if (nes->jit->backend == CPU_JIT_DIFF) {
+    fprintf(stderr, ", %" PRIu64 " blocks verified, %" PRIu64 " skipped (I/O trace full)",
+      nes->jit->jitStats.verified, nes->jit->jitStats.unverified);
+  }
+  fprintf(stderr, ".\n");
+}
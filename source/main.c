@@ -1,103 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
 
+#include "bench.h"
+#include "compose.h"
+#include "cpu.h"
+#include "display.h"
 #include "mappers.h"
+#include "jit.h"
 #include "main.h"
+#include "memory.h"
+#include "movie.h"
+#include "nes.h"
+#include "ppu.h"
 #include "registers.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "scheduler.h"
 #include "visualTest.h"
 
-#define KB 1024
-
-// Declare structs which can be found in the header files
-struct registers regs;
-struct Header head;
-struct MMC1 mmc1;
-
-// Declare pointers to cartridge data.
-uint8_t * programData;
-uint8_t * graphicData;
-
 /**
- * Called once from the main function to
- * load data from the .nes file into the header struct.
- * The header of the .nes file is critical as it
- * dictates how exactly the emulator will operate, 
- * especially with respect to the graphics.
+ * Frees the console and unmaps the cartridge before the program
+ * terminates, which may be from within the CPU.
  */
-signed char loadHeader(FILE *file, struct Header* head) {
-  // Declaring variables that will contain data from
-  // the .nes file, which can then be fed into the 
-  // attributes of the struct Header instance.
-  uint8_t inspectByte;
-
-	// Three characters + null terminator
-  uint8_t format[4];
-	format[3] = 0;
-  
-  // Copies data from file into previously declared variable.
-  fread(format, sizeof(uint8_t), 3, file);
-
-  // All .nes formats must begin with "NES".
-  if (strcmp(format, "NES") != 0) return -1;
-  
-  // Loads byte from file into inspection byte, checking for file legitimacy.
-  fread(&inspectByte, sizeof(uint8_t), 1, file);
-  if (inspectByte != 0x1A) return -1;
-
-  // Loads the number of 16 KB PRG banks and 8 KB CHR banks
-  // from the header into the respective variables.
-  fread(&(head->n_prg_banks), sizeof(uint8_t), 1, file);
-  fread(&(head->n_chr_banks), sizeof(uint8_t), 1, file);
-  
-  // Loads byte from file into inspection byte.
-  // Bits of inspection byte are then looked at
-  fread(&inspectByte, sizeof(uint8_t), 1, file);
-  head->mirror = (inspectByte & 1);                 // first bit
-  head->batteryRamBit = (inspectByte & (1 << 1) );  // second bit
-  head->trainerBit = (inspectByte & (1 << 2) );     // third bit
-  head->fourScreenBit = (inspectByte & (1 << 3) );  // fourth bit
-  head->mapperNumber = inspectByte >> 4;            // four most significant bits
-  
-  fread(&inspectByte, sizeof(uint8_t), 1, file);
-  head->mapperNumber += (inspectByte & 0xF0); // four most significant bits
-
-  // Load the number of 8 KB PRG RAM  (0 indicates 8 KB).
-  fread(&(head->n_ram_banks), sizeof(uint8_t), 1, file);
-  
-  // Move file pointer to the end of the header.
-  // The remainder of the header contains no information.
-  fseek(file, 7, SEEK_CUR);
-  return 0;
-}
-
-
-/**
- * Selects the memory mapper that the .nes file is using.
- * Will call the proper function to setup the memory mapper.
- */
-void mapperSetup(void) {
-  uint8_t success;
-  switch(head.mapperNumber) {
-    case 0:
-      success = NROMSetup();
-      break;
-    case 1:
-      success = MMC1Setup();
-      break;
-    case 2:
-      success = MMC2Setup();
-      break;
-    case 3:
-      success = MMC3Setup();
-      break;
-    default:
-      printf("Error: Mapper type not supported!.\n");
-      exit(1);
-  }
-  if (!success) {
-    printf("Error: Couldn't setup mapper number %u.\n", head.mapperNumber);
-  }
+static void releaseConsole(void) {
+  nesDestroy(nes);
 }
 
 
@@ -111,82 +40,222 @@ void mapperSetup(void) {
 int main(int argc, char **argv) {
  
   // Declaring the string that represents the name of the .nes file.
-  // Declaring the pointer to read from the .nes file.
   char *fileName;
-  FILE *file;
 
-  // This program is expected to be ran with the .nes filename as an argument.
-  // Running this program with no arguments, or more than one will result in an error.
+  enum CpuBackend backend = CPU_INTERP;
+  uint8_t vsync = 1;
+  uint8_t bench = 0;
+  uint64_t frameLimit = 0;
+  const char * dumpPath = NULL;
+  const char * loadStatePath = NULL;
+  const char * saveStatePath = NULL;
+  uint64_t rewindMB = 0;
+  uint32_t runAhead = 0;
+  const char * recordPath = NULL;
+  const char * playPath = NULL;
+  enum DumpFormat dumpFormat = DUMP_PPM;
+#ifdef HEADLESS_ONLY
+  uint8_t headless = 1;
+#else
+  uint8_t headless = 0;
+#endif
+
+  // This program is expected to be ran with the .nes filename as an argument,
+  // optionally followed by:
+  //   -l                       log every executed instruction to cpu.log
+  //   --cpu=interp|jit|diff    CPU backend; diff checks the JIT against
+  //                            the interpreter block by block
+  //   --no-vsync               present frames as soon as they are complete
+  //   --headless               run without a window (needs no video device)
+  //   --frames N               exit cleanly after N frames
+  //   --dump FILE              headless: write every frame to FILE as PPM
+  //   --dump-raw FILE          headless: write every frame to FILE as ARGB
+  //   --dump-rgb565 FILE       headless: write every frame to FILE as RGB565
+  //                            (FILE may be "-" for standard output)
+  //   --bench                  run headless for --frames frames (default
+  //                            600) and print performance figures as JSON
+  //   --load-state FILE        start from a savestate instead of power-up
+  //   --save-state FILE        write a savestate when the emulator stops
+  //   --rewind MB              keep MB megabytes of rewind history;
+  //                            hold backspace to rewind
+  //   --run-ahead N            present frames N frames ahead of the
+  //                            real one to hide input latency
+  //   --record FILE            record the controller input as a movie
+  //   --play FILE              replay a movie, from the state it was
+  //                            recorded from; runs to its end unless
+  //                            --frames is given
   if (argc < 2) {
     printf("Error: Expected at least 2 arguments; %d were given.\n", argc);
     exit(1);
-  } else if (argc >= 3) {
-    if (!strcmp(argv[2], "-l")) {
+  }
+  for (int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "-l")) {
       logger = 1;
       logFile = fopen("cpu.log", "w");
       freopen(NULL, "w+", logFile);
-    } else logger = 0;
+    } else if (!strcmp(argv[i], "--cpu=interp")) {
+      backend = CPU_INTERP;
+    } else if (!strcmp(argv[i], "--cpu=jit")) {
+      backend = CPU_JIT;
+    } else if (!strcmp(argv[i], "--cpu=diff")) {
+      backend = CPU_JIT_DIFF;
+    } else if (!strcmp(argv[i], "--no-vsync")) {
+      vsync = 0;
+    } else if (!strcmp(argv[i], "--bench")) {
+      bench = 1;
+    } else if (!strcmp(argv[i], "--headless")) {
+      headless = 1;
+    } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+      frameLimit = strtoull(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--dump") && i + 1 < argc) {
+      dumpPath = argv[++i];
+      dumpFormat = DUMP_PPM;
+    } else if (!strcmp(argv[i], "--dump-raw") && i + 1 < argc) {
+      dumpPath = argv[++i];
+      dumpFormat = DUMP_RAW;
+    } else if (!strcmp(argv[i], "--dump-rgb565") && i + 1 < argc) {
+      dumpPath = argv[++i];
+      dumpFormat = DUMP_RGB565;
+    } else if (!strcmp(argv[i], "--load-state") && i + 1 < argc) {
+      loadStatePath = argv[++i];
+    } else if (!strcmp(argv[i], "--save-state") && i + 1 < argc) {
+      saveStatePath = argv[++i];
+    } else if (!strcmp(argv[i], "--rewind") && i + 1 < argc) {
+      rewindMB = strtoull(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--run-ahead") && i + 1 < argc) {
+      runAhead = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+      recordPath = argv[++i];
+    } else if (!strcmp(argv[i], "--play") && i + 1 < argc) {
+      playPath = argv[++i];
+    } else {
+      printf("Error: Unknown option \"%s\".\n", argv[i]);
+      exit(1);
+    }
   }
-  
-  // Initializing file pointer based on program argument.
-  fileName = argv[1]; 
-  file = fopen(fileName, "rb");
-  
-  // If the pointer to the file is null, the program will end.
-  // This is likely because the given filename is not in the working directory.
-  if (!file) {
-    printf("Error: File unable to be opened. Is it in the working directory?\n");
+  if (playPath && (recordPath || loadStatePath)) {
+    printf("Error: --play can't be combined with --record or --load-state.\n");
     exit(1);
   }
   
-  // A return of -1 from loadHeader means that the file contents 
-  // could not be understood or clearly recognized as a .nes file.
-  if (loadHeader(file, &head) < 0) {
-    printf("Wrong file type or corrupted file. Please use a .nes file.\n");
+  // Create the console and map the .nes file into it.
+  fileName = argv[1]; 
+  nesBind(nesCreate());
+  if (!nes) {
+    printf("Error: Out of memory.\n");
     exit(1);
   }
-  // Declare the ROM data that will be copied from the .nes file.
-  programData = malloc(16*KB*head.n_prg_banks);
-  graphicData = malloc(8*KB*head.n_chr_banks);
-  uint8_t * trainer;
-  
-  // If the trainer exists in the file, load it into the array.
-  if (head.trainerBit) {
-    trainer = malloc(512);
-    fread(trainer, sizeof(uint8_t), 512, file); 
+  atexit(releaseConsole);
+  switch (nesLoadROM(fileName)) {
+    // This is likely because the given filename is not in the working directory.
+    case -1:
+      printf("Error: File unable to be opened. Is it in the working directory?\n");
+      exit(1);
+    // The file contents could not be understood or clearly recognized as a .nes file.
+    case -2:
+      printf("Wrong file type or corrupted file. Please use a .nes file.\n");
+      exit(1);
   }
   
-  // Load the program and graphic data into the respective arrays.
-  fread(programData, sizeof(uint8_t), 16*KB*head.n_prg_banks, file);
-  fread(graphicData, sizeof(uint8_t), 8*KB*head.n_chr_banks, file);
-  
-  // Terminate the file pointer.
-  fclose(file);
-  
   // Load the on-power status of the memory mapper and the cpu registers.
-  
-  mapperSetup();
-  setMirroring(head.fourScreenBit ? 3 : head.mirror);
-  cpuRegisterPowerup(&regs);
-  ppuRegisterPowerup();
-  // Initialize the picture display.
-  displayInit();
-  // Run the emulator display and perform CPU step.
-  uint32_t cyclesPast = 0, currCycle;
-  while (1) {
-    currCycle = step();
-    while (cyclesPast++ < currCycle) {
-      ppuStep();
-      ppuStep();
-      ppuStep();
+  initDispatchTable();
+  composeInit();
+  initColorTables();
+  switch (nesPowerUp()) {
+    case -1:
+      printf("Error: Mapper %u is not supported.\n", nes->head.mapperNumber);
+      exit(1);
+    case -2:
+      printf("Error: Couldn't setup mapper number %u.\n", nes->head.mapperNumber);
+      exit(1);
+  }
+  if (loadStatePath) {
+    switch (stateLoadFile(loadStatePath)) {
+      case -1:
+        printf("Error: \"%s\" is not a readable savestate.\n", loadStatePath);
+        exit(1);
+      case -2:
+        printf("Error: \"%s\" was saved from another cartridge.\n", loadStatePath);
+        exit(1);
     }
-    if (!getDisplayStatus()) break;
   }
-  // Free dynamically allocated memory.
-  free(programData);
-  free(graphicData);
-  if (head.trainerBit) free(trainer);
-
+  // A recorded movie starts from the state above; a replayed one
+  // restores the state it was recorded from.
+  if (playPath) {
+    switch (movieLoad(playPath)) {
+      case -1:
+        printf("Error: \"%s\" is not a readable movie.\n", playPath);
+        exit(1);
+      case -2:
+        printf("Error: \"%s\" was recorded on another cartridge.\n", playPath);
+        exit(1);
+    }
+    if (!frameLimit) frameLimit = movieLength();
+  }
+  if (recordPath && !movieRecord()) {
+    printf("Error: Out of memory.\n");
+    exit(1);
+  }
+  // Initialize the picture display, or the headless frame output.
+  if (bench) {
+    headless = 1;
+    dumpPath = NULL;
+    if (!frameLimit) frameLimit = 600;
+  }
+  if (dumpPath && !headless) {
+    printf("Error: Frame dumps require --headless.\n");
+    exit(1);
+  }
+  // From here on standard output may carry the frame dump, so
+  // diagnostics go to standard error.
+  if (headless) headlessInit(dumpPath, dumpFormat);
+  else displayInit(vsync);
+  // Select the CPU backend. The trace logger needs every
+  // instruction to go through the interpreter.
+  if (logger && backend != CPU_INTERP) {
+    fprintf(stderr, "Warning: Logging requires the interpreter; ignoring --cpu.\n");
+    backend = CPU_INTERP;
+  }
+  if (!jitInit(backend)) {
+    fprintf(stderr, "Warning: JIT not supported on this host; using the interpreter.\n");
+    backend = CPU_INTERP;
+  }
+  if (!bench) atexit(jitReport);
+  if (rewindMB && !rewindInit(rewindMB << 20)) {
+    fprintf(stderr, "Error: Unable to allocate %" PRIu64 " MB of rewind history.\n", rewindMB);
+    exit(1);
+  }
+  if (bench) {
+    const char * names[] = { "interp", "jit", "diff" };
+    runBenchmark(fileName, names[backend], frameLimit, runAhead);
+    return 0;
+  }
+  // Run the emulator a frame at a time, polling window
+  // and input events between frames.
+  for (uint64_t frame = 0; !frameLimit || frame < frameLimit; frame++) {
+    // While the rewind key is held, step back through the history
+    // instead of recording it; the frame run afterwards redraws the
+    // picture.
+    uint8_t rewound = !headless && displayRewindHeld() && rewindBack();
+    uint8_t buttons[MOVIE_PORTS] = { 0 };
+    if (!headless) displayReadButtons(buttons);
+    movieInput(buttons);
+    runFrameAhead(runAhead);
+    if (!rewound) rewindCapture();
+    if (nes->halted) {
+      fprintf(stderr, "KILL OPCODE EXECUTED.\n");
+      break;
+    }
+    if (!headless && !getDisplayStatus()) break;
+  }
+  if (saveStatePath && stateSaveFile(saveStatePath)) {
+    fprintf(stderr, "Error: Unable to write savestate \"%s\".\n", saveStatePath);
+    exit(1);
+  }
+  if (recordPath && movieSave(recordPath)) {
+    fprintf(stderr, "Error: Unable to write movie \"%s\".\n", recordPath);
+    exit(1);
+  }
   return 0;
 }
 
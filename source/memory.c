@@ -1,81 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 
 #include "memory.h"
 #include "memoryMappedIO.h"
 #include "registers.h"
-#include "MMC1.h"
-
-extern struct registers regs;
-
-// Declaring components of CPU memory. 
-uint8_t ram[0x0800];
-extern MemoryMappedRegisters ppuRegisters;
-uint8_t apu_io_reg[0x0020];
-uint8_t exp_rom[0x1FDF];
-uint8_t sram[0x2000];
-uint8_t prg_rom_lower[0x4000];
-uint8_t prg_rom_upper[0x4000];
+#include "cpu.h"
+#include "jit.h"
+#include "ppu.h"
+#include "main.h"
+#include "nes.h"
 
 /**
- * Obtains a byte of data from the CPU memory.
+ * Reads a PPU register ($2000-$3FFF, mirrored every 8 bytes).
  *
- * @param addr: Address of data in the CPU.
+ * @param addr: Address of the register in CPU memory.
  *
- * @returns: Value at address in CPU memory.
+ * @returns: Value of the register.
  */
-uint8_t readByte(uint16_t addr) {
-  // Mirroring occurs from $2000-$2007 to $2008-$4000.
-  if (addr >= 0x2008 && addr < 0x4000) {
-    addr = 0x2000 + (addr % 0x0008);
+static uint8_t ppuRegisterRead(uint16_t addr) {
+  ppuCatchUp(nes->instructionCycle);
+  switch (0x2000 + (addr & 0x0007)) {
+    case 0x2002:
+      nes->ppuRegisters.PPUWriteLatch = 0;
+      uint8_t val = nes->ppuRegisters.PPUStatus;
+      setVerticalBlankStart(0);
+      return val;
+    case 0x2004:
+      return nes->ppuRegisters.OAMData;
+    case 0x2007:
+      {
+      uint8_t val = nes->ppuRegisters.PPUData;
+      nes->ppuRegisters.PPUWriteLatch += getVRAMIncrement() ? 32 : 1;
+      return val;
+      }
+    default:
+      // The write-only registers read back the PPU's open bus,
+      // which isn't modelled.
+      return 0;
   }
+}
 
-  // Mirroring occurs from $0000-$07FF to $0800-$1FFF.
-  if (addr < 0x2000) {
-    addr = addr % 0x800;
-   // Addressing the RAM of CPU memory.
-    return ram[addr];
-  }
-  // Addressing the PPU registers in CPU memory.
-  else if (addr < 0x2008) {
-    switch (addr) {
-      case 0x2002:
-        ppuRegisters.PPUWriteLatch = 0;
-	uint8_t val = ppuRegisters.PPUStatus;
-	setVerticalBlankStart(0);
-        return val;
-      case 0x2004:
-        return ppuRegisters.OAMData;
-      case 0x2007:
-        {
-        uint8_t val = ppuRegisters.PPUData;
-	ppuRegisters.PPUWriteLatch += getVRAMIncrement() ? 32 : 1;
-        return val;
-        }
-      default:
-        printf("Error: Unexpected address to memory mapper I/O registers.\n");
-        exit(1);
+
+/**
+ * Writes a PPU register ($2000-$3FFF, mirrored every 8 bytes).
+ *
+ * @param addr: Address of the register in CPU memory.
+ * @param val: Value to write.
+ */
+static void ppuRegisterWrite(uint16_t addr, uint8_t val) {
+  ppuCatchUp(nes->instructionCycle);
+  switch (0x2000 + (addr & 0x0007)) {
+    case 0x2000:
+      // Enabling NMIs during vertical blank raises one right away.
+      if ((val & PPUCTRL_NMI_GEN_MASK) && !(nes->ppuRegisters.PPUControl & PPUCTRL_NMI_GEN_MASK) &&
+          (nes->ppuRegisters.PPUStatus & PPUSTATUS_VBLANK_STARTED_MASK)) {
+        raiseNMI();
+      }
+      nes->ppuRegisters.PPUControl = val;
+      break;
+    case 0x2001: {
+      // Greyscale recolours the whole palette.
+      uint8_t recolor = (val ^ nes->ppuRegisters.PPUMask) & PPUMASK_GREYSCALE_MASK;
+      nes->ppuRegisters.PPUMask = val;
+      if (recolor) updatePaletteColors();
+      break;
     }
+    case 0x2002:
+      // PPUSTATUS is read-only.
+      break;
+    case 0x2003:
+      OAMAddressWrite(val);
+      break;
+    case 0x2004:
+      OAMDataWrite(val);
+      break;
+    case 0x2005:
+      scrollWrite(val);
+      break;
+    case 0x2006:
+      addressWrite(val);
+      break;
+    case 0x2007:
+      dataWrite(val);
+      break;
   }
-  // Addressing the Audio Processing registers in CPU memory.
-  else if (addr < 0x4020) {
-    return apu_io_reg[addr - 0x4000];
+}
+
+
+/**
+ * Reads a controller port. Each read returns the next button from
+ * the port's shift register in bit 0; the upper bits are open bus,
+ * left holding the $40 of the address.
+ *
+ * @param port: 0 for $4016, 1 for $4017.
+ *
+ * @returns: Value of the register.
+ */
+static uint8_t controllerRead(uint8_t port) {
+  // While strobed the register keeps reloading, so reads see button A.
+  if (nes->controllerStrobe) return 0x40 | (nes->buttons[port] & 1);
+  uint8_t bit = nes->buttonShift[port] & 1;
+  // Official controllers shift in ones once all eight buttons are read.
+  nes->buttonShift[port] = 0x80 | nes->buttonShift[port] >> 1;
+  return 0x40 | bit;
+}
+
+
+/**
+ * Writes the controller strobe ($4016). The shift registers reload
+ * from the buttons held while bit 0 is set, and latch them when it
+ * is cleared.
+ */
+static void controllerWrite(uint8_t val) {
+  if (nes->controllerStrobe || (val & 1)) {
+    nes->buttonShift[0] = nes->buttons[0];
+    nes->buttonShift[1] = nes->buttons[1];
   }
-  // Addressing the Expansion ROM registers in CPU memory.
-  else if (addr < 0x6000) {
-    return exp_rom[addr - 0x4020];
+  nes->controllerStrobe = val & 1;
+}
+
+
+/**
+ * Reads page $40: the audio processing and I/O registers
+ * ($4000-$401F) followed by the start of the expansion ROM.
+ */
+static uint8_t ioRegisterRead(uint16_t addr) {
+  if (addr < 0x4020) {
+    if (addr == 0x4016 || addr == 0x4017) return controllerRead(addr - 0x4016);
+    return nes->apu_io_reg[addr - 0x4000];
   }
-  // Addressing the SRAM in CPU memory.
-  else if (addr < 0x8000){
-    return sram[addr - 0x6000];
+  return nes->exp_rom[addr - 0x4020];
+}
+
+
+/**
+ * Writes page $40: the audio processing and I/O registers
+ * ($4000-$401F) followed by the start of the expansion ROM.
+ */
+static void ioRegisterWrite(uint16_t addr, uint8_t val) {
+  if (addr < 0x4020) {
+    // OAM DMA copies into the PPU.
+    if (addr == 0x4014) ppuCatchUp(nes->instructionCycle);
+    if (addr == 0x4016) controllerWrite(val);
+    nes->apu_io_reg[addr - 0x4000] = val;
+  } else {
+    nes->exp_rom[addr - 0x4020] = val;
   }
-  // Addressing the lower bank of PRG ROM in CPU memory.
-  else if (addr < 0xC000) {
-    return prg_rom_lower[addr - 0x8000];
+}
+
+
+/**
+ * Writes to PRG ROM ($8000-$FFFF) go to the mapper registers. They
+ * can switch CHR banks or mirroring, so the PPU is caught up first.
+ */
+static void mapperRegisterWrite(uint16_t addr, uint8_t val) {
+  ppuCatchUp(nes->instructionCycle);
+  if (nes->mapperWrite) nes->mapperWrite(addr, val);
+}
+
+
+/**
+ * Installs the mapper's register write handler.
+ *
+ * @param handler: Called with every write to $8000-$FFFF.
+ */
+void setMapperWriteHandler(WriteHandler handler) {
+  nes->mapperWrite = handler;
+}
+
+
+/**
+ * Maps an 8 KB bank of the cartridge program data into one of the
+ * PRG ROM windows. Only pointers change; nothing is copied, and
+ * remapping the bank already in place costs nothing.
+ *
+ * @param window: 0-3 for $8000, $A000, $C000 and $E000.
+ * @param bank: Index of the 8 KB bank, wrapped to the PRG ROM size.
+ */
+void mapProgramBank(uint8_t window, uint32_t bank) {
+  uint8_t * data = nes->programData + 0x2000 * (bank % (2 * nes->head.n_prg_banks));
+  if (nes->prgBanks[window] == data) return;
+  nes->prgBanks[window] = data;
+  mapPages(0x80 + 0x20 * window, 0x20, data, NULL);
+  invalidateProgramBank(window);
+}
+
+
+/**
+ * Points a range of pages at host memory.
+ *
+ * @param page: First page (high byte of its address).
+ * @param count: Number of consecutive pages.
+ * @param read: Host memory backing the first page for reads.
+ * @param write: Host memory backing the first page for writes,
+ *               or NULL to send writes to the page's handler.
+ */
+void mapPages(uint8_t page, uint8_t count, uint8_t * read, uint8_t * write) {
+  for (uint16_t i = 0; i < count; i++) {
+    nes->pageTable[page + i].read = read + (i << 8);
+    nes->pageTable[page + i].write = write ? write + (i << 8) : NULL;
   }
-  // Addressing the upper bank of PRG ROM in CPU memory.
-  else {
-    return prg_rom_upper[addr - 0xC000];
+}
+
+
+/**
+ * Sends accesses to a range of pages to handler functions.
+ *
+ * @param page: First page (high byte of its address).
+ * @param count: Number of consecutive pages.
+ * @param read: Handler for reads, used unless the page is mapped.
+ * @param write: Handler for writes, used unless the page is mapped.
+ */
+void setPageHandlers(uint8_t page, uint8_t count, ReadHandler read, WriteHandler write) {
+  for (uint16_t i = 0; i < count; i++) {
+    nes->pageTable[page + i].read = NULL;
+    nes->pageTable[page + i].write = NULL;
+    nes->pageTable[page + i].readHandler = read;
+    nes->pageTable[page + i].writeHandler = write;
+  }
+}
+
+
+/**
+ * Builds the page table for the power-up memory map.
+ * Called once before the mapper is set up.
+ */
+void initMemoryMap(void) {
+  // $0000-$07FF RAM, mirrored up to $1FFF.
+  for (uint8_t mirror = 0; mirror < 4; mirror++) {
+    mapPages(mirror * 0x08, 0x08, nes->ram, nes->ram);
   }
+  for (uint16_t page = 0x00; page < 0x20; page++) nes->pageTable[page].decoded = 1;
+  // $2000-$2007 PPU registers, mirrored up to $3FFF.
+  setPageHandlers(0x20, 0x20, ppuRegisterRead, ppuRegisterWrite);
+  // $4000-$401F APU and I/O registers, then expansion ROM up to $5FFF.
+  setPageHandlers(0x40, 0x01, ioRegisterRead, ioRegisterWrite);
+  mapPages(0x41, 0x1F, nes->exp_rom + 0x00E0, nes->exp_rom + 0x00E0);
+  // $6000-$7FFF SRAM.
+  mapPages(0x60, 0x20, nes->sram, nes->sram);
+  // $8000-$FFFF PRG ROM, mapped by the mapper; writes go to its registers.
+  setPageHandlers(0x80, 0x80, NULL, mapperRegisterWrite);
+}
+
+
+/**
+ * Obtains a byte of data from the CPU memory.
+ *
+ * @param addr: Address of data in the CPU.
+ *
+ * @returns: Value at address in CPU memory.
+ */
+uint8_t readByte(uint16_t addr) {
+  const MemoryPage * page = &nes->pageTable[addr >> 8];
+  if (page->read) return page->read[addr & 0xFF];
+  if (nes->busTrace) return jitBusRead(addr, page->readHandler);
+  return page->readHandler(addr);
 }
 
 
@@ -87,7 +267,7 @@ uint8_t readByte(uint16_t addr) {
  * @returns: Value in CPU RAM based on given address.
  */
 uint8_t readZeroPage(uint8_t addr) {
-  return ram[addr];
+  return nes->ram[addr];
 }
 
 
@@ -98,62 +278,14 @@ uint8_t readZeroPage(uint8_t addr) {
  * @param val: Desired value to write into CPU memory.
  */
 void writeByte (uint16_t addr, uint8_t val) {
-  // Mirroring occurs from $2000-$2007 to $2008-$4000.
-  if (addr >= 0x2008 && addr < 0x4000) {
-    addr = 0x2000 + (addr % 0x0008);
-  }
-  
-  // Mirroring occurs from $0000-$07FF to $0800-$1FFF.
-  if (addr < 0x2000) {
-    addr = addr % 0x0800;
-    // Write to CPU RAM.
-    ram[addr] = val;
-  }
-  // Write to PPU registers in CPU memory.
-  else if (addr < 0x2008) {
-    switch(addr) {
-      case 0x2000:
-        ppuRegisters.PPUControl = val;
-        break;
-      case 0x2001:
-        ppuRegisters.PPUMask = val;
-        break;
-      case 0x2003:
-        OAMAddressWrite(val);
-        break;
-      case 0x2004:
-        OAMDataWrite(val);
-        break;
-      case 0x2005:
-        scrollWrite(val);
-        break;
-      case 0x2006:
-        addressWrite(val);
-        break;
-      case 0x2007:
-        dataWrite(val);
-        break;
-      default:
-        printf("Error: Unexpected address to memory mapper I/O registers.\n");
-        exit(1);
-      }
-  }
-  // Write to Audio Processing registers in CPU memory.
-  else if (addr < 0x4020) {
-    apu_io_reg[addr - 0x4000] = val;
-  }
-  // Write to Expansion ROM in CPU memory.
-  else if (addr < 0x6000) {
-    exp_rom[addr - 0x4020] = val;
-  }
-  // Write to SRAM in CPU memory.
-  else if (addr < 0x8000){
-    sram[addr - 0x6000] = val;
-  }
-  // Write to PRG ROM bank(s).
-  // This actually causes a serial write with MMC1.
-  else {
-    mmc1Write(addr, val);
+  const MemoryPage * page = &nes->pageTable[addr >> 8];
+  if (page->write) {
+    page->write[addr & 0xFF] = val;
+    if (page->decoded) invalidateRAMInstruction(addr & 0x07FF);
+  } else if (nes->busTrace) {
+    jitBusWrite(addr, val, page->writeHandler);
+  } else {
+    page->writeHandler(addr, val);
   }
 }
 
@@ -166,7 +298,8 @@ void writeByte (uint16_t addr, uint8_t val) {
  *             specified address in the CPU RAM.
  */
 void writeZeroPage(uint8_t addr, uint8_t val) {
-  ram[addr] = val;
+  nes->ram[addr] = val;
+  invalidateRAMInstruction(addr);
 }
 
 
@@ -177,7 +310,7 @@ void writeZeroPage(uint8_t addr, uint8_t val) {
  * @returns: Top element on the CPU stack.
  */
 uint8_t popStack(void) {
-  return ram[++regs.sp + 0x100];
+  return nes->ram[++nes->regs.sp + 0x100];
 }
 
 
@@ -188,6 +321,7 @@ uint8_t popStack(void) {
  * @param val: Value to place on top of the CPU stack.
  */
 void pushStack(uint8_t val) {
-  ram[regs.sp-- + 0x100] = val;
+  invalidateRAMInstruction(nes->regs.sp + 0x100);
+  nes->ram[nes->regs.sp-- + 0x100] = val;
 }
 
@@ -15,6 +15,8 @@
 #include <stdint.h>
 
 #include "memoryMappedIO.h"
+#include "ppu.h"
+#include "nes.h"
 
 /**
  * The following functions clear/set bits of the memory mapped
@@ -22,44 +24,44 @@
  */
 
 void setBaseNameTableAddr(uint8_t bits) {
-  ppuRegisters.PPUControl &= ~PPUCTRL_NAME_TBL_MASK;
-  ppuRegisters.PPUControl |= bits;
+  nes->ppuRegisters.PPUControl &= ~PPUCTRL_NAME_TBL_MASK;
+  nes->ppuRegisters.PPUControl |= bits;
 }
 
 void setVRAMIncrement(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUControl |= PPUCTRL_VRAM_INC_MASK;  
-  } else ppuRegisters.PPUControl &= ~PPUCTRL_VRAM_INC_MASK;
+    nes->ppuRegisters.PPUControl |= PPUCTRL_VRAM_INC_MASK;  
+  } else nes->ppuRegisters.PPUControl &= ~PPUCTRL_VRAM_INC_MASK;
 }
 
 void setSpritePatternAddress(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUControl |= PPUCTRL_SPRITE_ADDR_MASK;
-  } else ppuRegisters.PPUControl &= ~PPUCTRL_SPRITE_ADDR_MASK;
+    nes->ppuRegisters.PPUControl |= PPUCTRL_SPRITE_ADDR_MASK;
+  } else nes->ppuRegisters.PPUControl &= ~PPUCTRL_SPRITE_ADDR_MASK;
 }
 
 void setBackgroundPatternAddress(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUControl |= PPUCTRL_BACKGROUND_ADDR_MASK;
-  } else ppuRegisters.PPUControl &= ~PPUCTRL_BACKGROUND_ADDR_MASK;
+    nes->ppuRegisters.PPUControl |= PPUCTRL_BACKGROUND_ADDR_MASK;
+  } else nes->ppuRegisters.PPUControl &= ~PPUCTRL_BACKGROUND_ADDR_MASK;
 }
 
 void setSpriteSize(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUControl |= PPUCTRL_SPRITE_SIZE_MASK;
-  } else ppuRegisters.PPUControl &= ~PPUCTRL_SPRITE_SIZE_MASK;
+    nes->ppuRegisters.PPUControl |= PPUCTRL_SPRITE_SIZE_MASK;
+  } else nes->ppuRegisters.PPUControl &= ~PPUCTRL_SPRITE_SIZE_MASK;
 }
 
 void setPPUMasterSlave(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUControl |= PPUCTRL_PPU_MASTER_SLAVE_MASK;
-  } else ppuRegisters.PPUControl &= ~PPUCTRL_PPU_MASTER_SLAVE_MASK;
+    nes->ppuRegisters.PPUControl |= PPUCTRL_PPU_MASTER_SLAVE_MASK;
+  } else nes->ppuRegisters.PPUControl &= ~PPUCTRL_PPU_MASTER_SLAVE_MASK;
 }
 
 void setNMIGeneration(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUControl |= PPUCTRL_NMI_GEN_MASK;
-  } else ppuRegisters.PPUControl &= ~PPUCTRL_NMI_GEN_MASK;
+    nes->ppuRegisters.PPUControl |= PPUCTRL_NMI_GEN_MASK;
+  } else nes->ppuRegisters.PPUControl &= ~PPUCTRL_NMI_GEN_MASK;
 }
 
 
@@ -70,31 +72,31 @@ void setNMIGeneration(uint8_t set) {
  */
 
 uint8_t getBaseNameTableAddress(void) {
-  return ppuRegisters.PPUControl & PPUCTRL_NAME_TBL_MASK;
+  return nes->ppuRegisters.PPUControl & PPUCTRL_NAME_TBL_MASK;
 }
 
 uint8_t getVRAMIncrement(void) {
-  return ppuRegisters.PPUControl & PPUCTRL_VRAM_INC_MASK;
+  return nes->ppuRegisters.PPUControl & PPUCTRL_VRAM_INC_MASK;
 }
 
 uint8_t getSpritePatternAddress(void) {
-  return ppuRegisters.PPUControl & PPUCTRL_SPRITE_ADDR_MASK;	
+  return nes->ppuRegisters.PPUControl & PPUCTRL_SPRITE_ADDR_MASK;	
 }
 
 uint8_t getBackgroundPatternAddress(void) {
-  return ppuRegisters.PPUControl & PPUCTRL_BACKGROUND_ADDR_MASK;
+  return nes->ppuRegisters.PPUControl & PPUCTRL_BACKGROUND_ADDR_MASK;
 }
 
 uint8_t getSpriteSize(void) {
-  return ppuRegisters.PPUControl & PPUCTRL_SPRITE_SIZE_MASK;
+  return nes->ppuRegisters.PPUControl & PPUCTRL_SPRITE_SIZE_MASK;
 }
 
 uint8_t getPPUMasterSlave(void) {
-  return ppuRegisters.PPUControl & PPUCTRL_PPU_MASTER_SLAVE_MASK;
+  return nes->ppuRegisters.PPUControl & PPUCTRL_PPU_MASTER_SLAVE_MASK;
 }
 
 uint8_t getNMIGeneration(void) {
-  return ppuRegisters.PPUControl & PPUCTRL_NMI_GEN_MASK;
+  return nes->ppuRegisters.PPUControl & PPUCTRL_NMI_GEN_MASK;
 }
 
 
@@ -105,50 +107,50 @@ uint8_t getNMIGeneration(void) {
 
 void setGrayScale(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUMask |= PPUMASK_GREYSCALE_MASK;
-  } else ppuRegisters.PPUMask &= ~PPUMASK_GREYSCALE_MASK;
+    nes->ppuRegisters.PPUMask |= PPUMASK_GREYSCALE_MASK;
+  } else nes->ppuRegisters.PPUMask &= ~PPUMASK_GREYSCALE_MASK;
 }
 
 void setBackgroundLeftEightPixelsActive(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUMask |= PPUMASK_SHOW_BACKGROUND_LEFT_MASK;
-  } else ppuRegisters.PPUMask &= ~PPUMASK_SHOW_BACKGROUND_LEFT_MASK;
+    nes->ppuRegisters.PPUMask |= PPUMASK_SHOW_BACKGROUND_LEFT_MASK;
+  } else nes->ppuRegisters.PPUMask &= ~PPUMASK_SHOW_BACKGROUND_LEFT_MASK;
 }
 
 void setSpriteLeftEightPixelsActive(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUMask |= PPUMASK_SHOW_SPRITES_LEFT_MASK;
-  } else ppuRegisters.PPUMask &= ~PPUMASK_SHOW_SPRITES_LEFT_MASK;
+    nes->ppuRegisters.PPUMask |= PPUMASK_SHOW_SPRITES_LEFT_MASK;
+  } else nes->ppuRegisters.PPUMask &= ~PPUMASK_SHOW_SPRITES_LEFT_MASK;
 }
 
 void setBackground(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUMask |= PPUMASK_SHOW_BACKGROUND_MASK;
-  } else ppuRegisters.PPUMask &= ~PPUMASK_SHOW_BACKGROUND_MASK;
+    nes->ppuRegisters.PPUMask |= PPUMASK_SHOW_BACKGROUND_MASK;
+  } else nes->ppuRegisters.PPUMask &= ~PPUMASK_SHOW_BACKGROUND_MASK;
 }
 
 void setSprites(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUMask |= PPUMASK_SHOW_SPRITES_MASK;
-  } else ppuRegisters.PPUMask &= ~PPUMASK_SHOW_SPRITES_MASK;
+    nes->ppuRegisters.PPUMask |= PPUMASK_SHOW_SPRITES_MASK;
+  } else nes->ppuRegisters.PPUMask &= ~PPUMASK_SHOW_SPRITES_MASK;
 }
 
 void setEmphasizeRed(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUMask |= PPUMASK_EMPHASIZE_RED_MASK;
-  } else ppuRegisters.PPUMask &= ~PPUMASK_EMPHASIZE_RED_MASK;
+    nes->ppuRegisters.PPUMask |= PPUMASK_EMPHASIZE_RED_MASK;
+  } else nes->ppuRegisters.PPUMask &= ~PPUMASK_EMPHASIZE_RED_MASK;
 }
 
 void setEmphasizeGreen(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUMask |= PPUMASK_EMPHASIZE_GREEN_MASK;
-  } else ppuRegisters.PPUMask &= ~PPUMASK_EMPHASIZE_GREEN_MASK;
+    nes->ppuRegisters.PPUMask |= PPUMASK_EMPHASIZE_GREEN_MASK;
+  } else nes->ppuRegisters.PPUMask &= ~PPUMASK_EMPHASIZE_GREEN_MASK;
 }
 
 void setEmphasizeBlue(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUMask |= PPUMASK_EMPHASIZE_BLUE_MASK;
-  } else ppuRegisters.PPUMask &= ~PPUMASK_EMPHASIZE_BLUE_MASK;
+    nes->ppuRegisters.PPUMask |= PPUMASK_EMPHASIZE_BLUE_MASK;
+  } else nes->ppuRegisters.PPUMask &= ~PPUMASK_EMPHASIZE_BLUE_MASK;
 }
 
 
@@ -159,35 +161,35 @@ void setEmphasizeBlue(uint8_t set) {
  */
 
 uint8_t getGrayScale(void) {
-  return ppuRegisters.PPUMask & PPUMASK_GREYSCALE_MASK;
+  return nes->ppuRegisters.PPUMask & PPUMASK_GREYSCALE_MASK;
 }
 
 uint8_t getBackgroundLeftEightPixelsActive(void) {
-  return ppuRegisters.PPUMask & PPUMASK_SHOW_BACKGROUND_LEFT_MASK;
+  return nes->ppuRegisters.PPUMask & PPUMASK_SHOW_BACKGROUND_LEFT_MASK;
 }
 
 uint8_t getSpriteLeftEightPixelsActive(void) {
-  return ppuRegisters.PPUMask & PPUMASK_SHOW_SPRITES_LEFT_MASK;
+  return nes->ppuRegisters.PPUMask & PPUMASK_SHOW_SPRITES_LEFT_MASK;
 }
 
 uint8_t getBackground(void) {
-  return ppuRegisters.PPUMask & PPUMASK_SHOW_BACKGROUND_MASK;
+  return nes->ppuRegisters.PPUMask & PPUMASK_SHOW_BACKGROUND_MASK;
 }
 
 uint8_t getSprites(void) {
-  return ppuRegisters.PPUMask & PPUMASK_SHOW_SPRITES_MASK;
+  return nes->ppuRegisters.PPUMask & PPUMASK_SHOW_SPRITES_MASK;
 }
 
 uint8_t getEmphasizeRed(void) {
-  return ppuRegisters.PPUMask & PPUMASK_EMPHASIZE_RED_MASK;
+  return nes->ppuRegisters.PPUMask & PPUMASK_EMPHASIZE_RED_MASK;
 }
 
 uint8_t getEmphasizeGreen(void) {
-  return ppuRegisters.PPUMask & PPUMASK_EMPHASIZE_GREEN_MASK;
+  return nes->ppuRegisters.PPUMask & PPUMASK_EMPHASIZE_GREEN_MASK;
 }
 
 uint8_t getEmphasizeBlue(void) {
-  return ppuRegisters.PPUMask & PPUMASK_EMPHASIZE_BLUE_MASK;
+  return nes->ppuRegisters.PPUMask & PPUMASK_EMPHASIZE_BLUE_MASK;
 }
 
 
@@ -198,20 +200,20 @@ uint8_t getEmphasizeBlue(void) {
 
 void setSpriteOverflow(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUStatus |= PPUSTATUS_SPRITE_OVERFLOW_MASK;
-  } else ppuRegisters.PPUStatus &= ~PPUSTATUS_SPRITE_OVERFLOW_MASK;
+    nes->ppuRegisters.PPUStatus |= PPUSTATUS_SPRITE_OVERFLOW_MASK;
+  } else nes->ppuRegisters.PPUStatus &= ~PPUSTATUS_SPRITE_OVERFLOW_MASK;
 }
 
 void setSpriteZeroHits(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUStatus |= PPUSTATUS_SPRITE_ZERO_HIT_MASK;
-  } else ppuRegisters.PPUStatus &= ~PPUSTATUS_SPRITE_ZERO_HIT_MASK;
+    nes->ppuRegisters.PPUStatus |= PPUSTATUS_SPRITE_ZERO_HIT_MASK;
+  } else nes->ppuRegisters.PPUStatus &= ~PPUSTATUS_SPRITE_ZERO_HIT_MASK;
 }
 
 void setVerticalBlankStart(uint8_t set) {
   if (set) {
-    ppuRegisters.PPUStatus |= PPUSTATUS_VBLANK_STARTED_MASK;
-  } else ppuRegisters.PPUStatus &= ~PPUSTATUS_VBLANK_STARTED_MASK;
+    nes->ppuRegisters.PPUStatus |= PPUSTATUS_VBLANK_STARTED_MASK;
+  } else nes->ppuRegisters.PPUStatus &= ~PPUSTATUS_VBLANK_STARTED_MASK;
 }
 
 
@@ -221,15 +223,15 @@ void setVerticalBlankStart(uint8_t set) {
  */
 
 uint8_t getSpriteOverflow(void) {
-  return ppuRegisters.PPUStatus & PPUSTATUS_SPRITE_OVERFLOW_MASK;
+  return nes->ppuRegisters.PPUStatus & PPUSTATUS_SPRITE_OVERFLOW_MASK;
 }
 
 uint8_t getSpriteZeroHits(void) {
-  return ppuRegisters.PPUStatus & PPUSTATUS_SPRITE_ZERO_HIT_MASK;
+  return nes->ppuRegisters.PPUStatus & PPUSTATUS_SPRITE_ZERO_HIT_MASK;
 }
 
-uint8_t getVerticalBlankStart() { 
-  return ppuRegisters.PPUStatus & PPUSTATUS_VBLANK_STARTED_MASK;
+uint8_t getVerticalBlankStart(void) {
+  return nes->ppuRegisters.PPUStatus & PPUSTATUS_VBLANK_STARTED_MASK;
 }
 
 
@@ -239,7 +241,7 @@ uint8_t getVerticalBlankStart() {
  */
 
 void OAMAddressWrite(uint8_t addr) {
-  ppuRegisters.OAMAddress = addr;
+  nes->ppuRegisters.OAMAddress = addr;
 }
 
 /**
@@ -248,8 +250,8 @@ void OAMAddressWrite(uint8_t addr) {
  */
 
 void OAMDataWrite(uint8_t data) {
-  ppuRegisters.OAMData = data;
-  ppuRegisters.OAMAddress++;
+  nes->ppuRegisters.OAMData = data;
+  nes->ppuRegisters.OAMAddress++;
 
 }
 
@@ -259,9 +261,9 @@ void OAMDataWrite(uint8_t data) {
  */
 
 void scrollWrite(uint8_t data) {
-  ppuRegisters.PPUScroll = data;
-  ppuRegisters.PPUWriteLatch <<= 8;
-  ppuRegisters.PPUWriteLatch |= data;
+  nes->ppuRegisters.PPUScroll = data;
+  nes->ppuRegisters.PPUWriteLatch <<= 8;
+  nes->ppuRegisters.PPUWriteLatch |= data;
 }
 
 /**
@@ -270,9 +272,9 @@ void scrollWrite(uint8_t data) {
  */
 
 void addressWrite(uint8_t data) {
-  ppuRegisters.PPUAddress = data;
-  ppuRegisters.PPUWriteLatch <<= 8;
-  ppuRegisters.PPUWriteLatch |= data;
+  nes->ppuRegisters.PPUAddress = data;
+  nes->ppuRegisters.PPUWriteLatch <<= 8;
+  nes->ppuRegisters.PPUWriteLatch |= data;
 }
 
 /**
@@ -281,8 +283,8 @@ void addressWrite(uint8_t data) {
  */
 
 void dataWrite(uint8_t data) {
-  ppuRegisters.PPUData = data;
+  nes->ppuRegisters.PPUData = data;
   writePictureByte();
-  ppuRegisters.PPUWriteLatch += (getVRAMIncrement() ? 32 : 1);
+  nes->ppuRegisters.PPUWriteLatch += (getVRAMIncrement() ? 32 : 1);
 }
 
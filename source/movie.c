@@ -0,0 +1,194 @@
+/**
+ * Input movies. A movie is the savestate a run starts from and the
+ * buttons held on each controller port for every frame after it, one
+ * byte per port per frame. As the emulator is deterministic, replaying
+ * a movie reproduces the recorded run frame for frame.
+ *
+ * A movie is positioned by the console's count of input frames, which
+ * savestates hold: rewinding, run-ahead or loading a state moves the
+ * movie along with the console. A recording is kept in memory, so the
+ * frames after such a step back can be recorded over, and written out
+ * when the run ends.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "movie.h"
+#include "nes.h"
+#include "savestate.h"
+
+// The movie of a console, allocated by movieRecord() or movieLoad().
+struct Movie {
+  uint8_t recording;
+  uint8_t * start;             // Savestate the movie starts from.
+  size_t stateBytes;
+  uint8_t * input;             // MOVIE_PORTS bytes per frame.
+  uint64_t length, capacity;   // In frames.
+  uint64_t startFrame;         // Input frame count of the starting state.
+};
+
+
+/**
+ * Starts recording a movie of the bound console from its current state.
+ *
+ * @returns: 1 on success, 0 if out of memory.
+ */
+uint8_t movieRecord(void) {
+  struct Movie * m = calloc(1, sizeof(struct Movie));
+  if (!m) return 0;
+  m->recording = 1;
+  m->stateBytes = stateSize();
+  m->start = malloc(m->stateBytes);
+  if (!m->start) {
+    free(m);
+    return 0;
+  }
+  stateSave(m->start, m->stateBytes);
+  m->startFrame = nes->inputFrames;
+  movieRelease();
+  nes->movie = m;
+  return 1;
+}
+
+
+/**
+ * Loads a movie file to replay on the bound console, and restores
+ * the console to the state the movie starts from.
+ *
+ * @param fileName: Path of the movie file.
+ *
+ * @returns: 0 on success, -1 if the file can't be read or is not a
+ *           movie of this version, -2 if it belongs to another
+ *           cartridge.
+ */
+int movieLoad(const char * fileName) {
+  FILE * file = fopen(fileName, "rb");
+  if (!file) return -1;
+  long size = fseek(file, 0, SEEK_END) ? -1 : ftell(file);
+  rewind(file);
+  uint8_t * buffer = size > 0 ? malloc(size) : NULL;
+  int loaded = buffer && fread(buffer, size, 1, file) == 1;
+  fclose(file);
+
+  MovieHeader header;
+  int result = -1;
+  if (loaded && (size_t) size >= sizeof(header)) {
+    memcpy(&header, buffer, sizeof(header));
+    // Sizes from the file are checked against what is left of it, so
+    // a huge frame count cannot wrap around to a matching size.
+    size_t rest = size - sizeof(header);
+    if (header.magic == MOVIE_MAGIC && header.version == MOVIE_VERSION &&
+        header.ports == MOVIE_PORTS && header.stateSize <= rest &&
+        (rest - header.stateSize) % MOVIE_PORTS == 0 &&
+        header.frames == (rest - header.stateSize) / MOVIE_PORTS) {
+      result = stateLoad(buffer + sizeof(header), header.stateSize);
+    }
+  }
+  struct Movie * m = result ? NULL : calloc(1, sizeof(struct Movie));
+  if (!m) {
+    free(buffer);
+    return result ? result : -1;
+  }
+
+  // The movie keeps the file's buffer; its input follows the state.
+  m->start = buffer;
+  m->stateBytes = header.stateSize;
+  m->input = buffer + sizeof(header) + header.stateSize;
+  m->length = m->capacity = header.frames;
+  m->startFrame = nes->inputFrames;
+  movieRelease();
+  nes->movie = m;
+  return 0;
+}
+
+
+/**
+ * Frees the movie of the bound console, if it has one. A recording
+ * not saved with movieSave() is lost.
+ */
+void movieRelease(void) {
+  struct Movie * m = nes->movie;
+  if (!m) return;
+  if (m->recording) free(m->input);
+  free(m->start);
+  free(m);
+  nes->movie = NULL;
+}
+
+
+/**
+ * Sets the controller buttons of the bound console for the next frame.
+ * Called once before every frame but speculative ones. A movie being
+ * replayed supplies the buttons, until it runs out; otherwise the live
+ * buttons are used, and recorded if a movie is.
+ *
+ * @param live: Buttons held on each port, MOVIE_PORTS bytes.
+ */
+void movieInput(const uint8_t * live) {
+  struct Movie * m = nes->movie;
+  uint8_t buttons[MOVIE_PORTS] = { 0 };
+  // States from before the movie started play no input.
+  uint64_t position = m && nes->inputFrames >= m->startFrame ?
+    nes->inputFrames - m->startFrame : UINT64_MAX;
+  nes->inputFrames++;
+
+  if (!m) {
+    memcpy(buttons, live, MOVIE_PORTS);
+  } else if (!m->recording) {
+    if (position < m->length) memcpy(buttons, m->input + position * MOVIE_PORTS, MOVIE_PORTS);
+  } else if (position != UINT64_MAX) {
+    if (position >= m->capacity) {
+      m->capacity = m->capacity ? 2 * m->capacity : 3600;
+      m->input = realloc(m->input, m->capacity * MOVIE_PORTS);
+      if (!m->input) {
+        printf("Error: Out of memory.\n");
+        exit(1);
+      }
+    }
+    memcpy(buttons, live, MOVIE_PORTS);
+    memcpy(m->input + position * MOVIE_PORTS, buttons, MOVIE_PORTS);
+    m->length = position + 1;
+  }
+  nes->buttons[0] = buttons[0];
+  nes->buttons[1] = buttons[1];
+}
+
+
+/**
+ * Gives the number of frames in the movie of the bound console.
+ *
+ * @returns: Frames of input, or 0 without a movie.
+ */
+uint64_t movieLength(void) {
+  return nes->movie ? nes->movie->length : 0;
+}
+
+
+/**
+ * Writes the movie being recorded on the bound console to a file.
+ *
+ * @param fileName: Path of the file to write.
+ *
+ * @returns: 0 on success, -1 if the file could not be written or no
+ *           movie is being recorded.
+ */
+int movieSave(const char * fileName) {
+  struct Movie * m = nes->movie;
+  if (!m || !m->recording) return -1;
+  MovieHeader header = {
+    .magic = MOVIE_MAGIC,
+    .version = MOVIE_VERSION,
+    .ports = MOVIE_PORTS,
+    .stateSize = m->stateBytes,
+    .frames = m->length
+  };
+
+  FILE * file = fopen(fileName, "wb");
+  int written = file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+                fwrite(m->start, m->stateBytes, 1, file) == 1 &&
+                (!m->length || fwrite(m->input, m->length * MOVIE_PORTS, 1, file) == 1);
+  if (file && fclose(file) != 0) written = 0;
+  return written ? 0 : -1;
+}
@@ -0,0 +1,329 @@
+/**
+ * Console contexts. A struct nes holds the cartridge and all the
+ * state of the emulated hardware; every thread binds the console it
+ * runs with nesBind(), and the CPU, PPU, memory and mapper code work
+ * on the bound console through the thread-local nes pointer.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+#include "jit.h"
+#include "main.h"
+#include "mappers.h"
+#include "memory.h"
+#include "movie.h"
+#include "nes.h"
+#include "ppu.h"
+#include "registers.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "scheduler.h"
+
+#define KB 1024
+
+__thread struct nes * nes;
+
+
+/**
+ * Allocates a console in its power-on state, with no cartridge.
+ *
+ * @returns: The new console, or NULL if out of memory.
+ */
+struct nes * nesCreate(void) {
+  struct nes * console = calloc(1, sizeof(struct nes));
+  if (!console) return NULL;
+  console->cycle = 7;
+  console->instructionCycle = 7;
+  console->eventHorizon = UINT64_MAX;
+  console->cpuStep = step;
+  return console;
+}
+
+
+/**
+ * Frees a console, its translation cache, rewind history and
+ * cartridge mapping and tiles.
+ * The console must not be bound to any other thread.
+ *
+ * @param console: Console to free.
+ */
+void nesDestroy(struct nes * console) {
+  struct nes * bound = nes;
+  nes = console;
+  jitRelease();
+  rewindRelease();
+  movieRelease();
+  free(console->aheadState);
+  free(console->chrROMTiles);
+  if (console->image) munmap(console->image, console->imageSize);
+  nes = bound == console ? NULL : bound;
+  free(console);
+}
+
+
+/**
+ * Makes a console the one the calling thread runs.
+ *
+ * @param console: Console to bind.
+ */
+void nesBind(struct nes * console) {
+  nes = console;
+}
+
+
+/**
+ * Called once from nesLoadROM() to
+ * parse the header of the mapped .nes file into the header struct.
+ * The header of the .nes file is critical as it
+ * dictates how exactly the emulator will operate,
+ * especially with respect to the graphics.
+ *
+ * @param image: Start of the mapped .nes file.
+ * @param size: Size of the file in bytes.
+ * @param head: Header struct to fill in.
+ * @returns: Offset of the PRG data, -1 if the file is not a valid .nes file,
+ *           or -2 if it holds no PRG ROM.
+ */
+long loadHeader(const uint8_t * image, size_t size, struct Header* head) {
+  // The header is 16 bytes long; the last 7 contain no information.
+  if (size < 16) return -1;
+
+  // All .nes formats must begin with "NES" followed by 0x1A.
+  if (memcmp(image, "NES\x1A", 4) != 0) return -1;
+
+  // The number of 16 KB PRG banks and 8 KB CHR banks.
+  head->n_prg_banks = image[4];
+  head->n_chr_banks = image[5];
+  // Every cartridge needs PRG ROM to run; banks are taken modulo its size.
+  if (head->n_prg_banks == 0) return -2;
+
+  // Bits of the flags byte are looked at individually.
+  uint8_t inspectByte = image[6];
+  head->mirror = (inspectByte & 1);                 // first bit
+  head->batteryRamBit = (inspectByte & (1 << 1) );  // second bit
+  head->trainerBit = (inspectByte & (1 << 2) );     // third bit
+  head->fourScreenBit = (inspectByte & (1 << 3) );  // fourth bit
+  head->mapperNumber = inspectByte >> 4;            // four most significant bits
+
+  head->mapperNumber += (image[7] & 0xF0); // four most significant bits
+
+  // Load the number of 8 KB PRG RAM  (0 indicates 8 KB).
+  head->n_ram_banks = image[8];
+
+  // The optional 512 byte trainer sits between the header and the PRG data.
+  long offset = 16 + (head->trainerBit ? 512 : 0);
+
+  // The file must hold every bank the header declares.
+  if (size < (size_t) offset + 16*KB*head->n_prg_banks + 8*KB*head->n_chr_banks) return -1;
+  return offset;
+}
+
+
+/**
+ * Maps a .nes file read-only into the bound console. The banks are
+ * used in place, so the cartridge data is never copied and consoles
+ * and processes running the same ROM share one page cache copy.
+ *
+ * @param fileName: Path of the .nes file.
+ *
+ * @returns: 0 on success, -1 if the file can't be opened or mapped
+ *           or memory runs out, -2 if it is not a valid .nes file.
+ */
+int nesLoadROM(const char * fileName) {
+  int file = open(fileName, O_RDONLY);
+  if (file < 0) return -1;
+
+  struct stat info;
+  if (fstat(file, &info) < 0 || info.st_size == 0) {
+    close(file);
+    return -2;
+  }
+  uint8_t * image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  // The mapping stays valid once the descriptor is closed.
+  close(file);
+  if (image == MAP_FAILED) return -1;
+
+  long offset = loadHeader(image, info.st_size, &nes->head);
+  if (offset < 0) {
+    munmap(image, info.st_size);
+    return -2;
+  }
+  nes->image = image;
+  nes->imageSize = info.st_size;
+  // Point the program and graphic data into the mapping, past the
+  // header and trainer. Neither is ever written: PRG ROM pages have
+  // no write pointer and CHR writes only go to CHR RAM.
+  nes->programData = image + offset;
+  nes->graphicData = nes->programData + 16*KB*nes->head.n_prg_banks;
+  if (!decodeCharacterROM()) return -1;
+  return 0;
+}
+
+
+/**
+ * Hashes the PRG and CHR data of the bound console's cartridge, which
+ * ties savestates and movies to it. The hash is computed on the first
+ * call and cached, so consoles that never save don't read the whole
+ * ROM.
+ *
+ * @returns: FNV-1a hash of the cartridge data.
+ */
+uint64_t cartridgeHash(void) {
+  if (!nes->romHashed) {
+    size_t dataSize = 16*KB*nes->head.n_prg_banks + 8*KB*nes->head.n_chr_banks;
+    nes->romHash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < dataSize; i++) {
+      nes->romHash = (nes->romHash ^ nes->programData[i]) * 0x100000001B3ull;
+    }
+    nes->romHashed = 1;
+  }
+  return nes->romHash;
+}
+
+
+/**
+ * Selects the memory mapper that the .nes file is using.
+ * Will call the proper function to setup the memory mapper.
+ *
+ * @returns: 0 on success, -1 if the mapper is not supported, -2 if
+ *           it couldn't be set up.
+ */
+static int mapperSetup(void) {
+  uint8_t success;
+  switch(nes->head.mapperNumber) {
+    case 0:
+      success = NROMSetup();
+      break;
+    case 1:
+      success = MMC1Setup();
+      break;
+    case 2:
+      success = MMC2Setup();
+      break;
+    case 3:
+      success = MMC3Setup();
+      break;
+    default:
+      return -1;
+  }
+  return success ? 0 : -2;
+}
+
+
+/**
+ * Loads the on-power status of the memory mapper, the cpu registers
+ * and the ppu of the bound console, once its cartridge is loaded.
+ * initDispatchTable(), composeInit() and initColorTables() must have
+ * been called once beforehand.
+ *
+ * @returns: 0 on success, -1 if the cartridge's mapper is not
+ *           supported, -2 if it couldn't be set up.
+ */
+int nesPowerUp(void) {
+  initMemoryMap();
+  int status = mapperSetup();
+  if (status) return status;
+  setMirroring(nes->head.fourScreenBit ? FOUR_SCREEN : nes->head.mirror);
+  initInterrupts();
+  cpuRegisterPowerup(&nes->regs);
+  ppuRegisterPowerup();
+  ppuInit();
+  return 0;
+}
+
+
+/**
+ * Runs the CPU, and with it the PPU, until the PPU completes the
+ * current frame and enters vertical blank, or until a KIL opcode
+ * halts the CPU. Window and input events are left for the caller
+ * to poll once the frame is done.
+ *
+ * The PPU is run lazily: register accesses catch it up to the
+ * CPU, and so does the scheduled event for the next PPUSTATUS
+ * change, which is when a frame ends and a vertical blank NMI
+ * can be raised.
+ *
+ * @returns: Statistics of the emulated frame.
+ */
+FrameStats runFrame(void) {
+  struct timespec start, end;
+  uint64_t startCycle = nes->cycle, startInstructions = nes->instructionCount;
+  uint64_t frame = nes->frameCount;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (nes->frameCount == frame && !nes->halted) {
+    uint16_t pc = nes->regs.pc;
+    uint64_t currCycle = nes->cpuStep();
+    // A jump back to a side-effect-free polling loop that has stopped
+    // changing state: skip whole iterations up to the next PPU status
+    // change or other scheduled event.
+    if (!logger && nes->regs.pc <= pc &&
+        idleLoopIteration(nes->instructionCount, &nes->loopCycles, &nes->loopSteps)) {
+      uint64_t iterations = currCycle < nes->eventHorizon ?
+        (nes->eventHorizon - currCycle) / nes->loopCycles : 0;
+      nes->instructionCount += iterations * nes->loopSteps;
+      // Where the last skipped instruction, the jump back, started.
+      nes->instructionCycle += iterations * nes->loopCycles;
+      skipCycles(iterations * nes->loopCycles);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (FrameStats) {
+    .cycles = nes->cycle - startCycle,
+    .instructions = nes->instructionCount - startInstructions,
+    .wallTime = (end.tv_sec - start.tv_sec) * 1000000000ull + (end.tv_nsec - start.tv_nsec)
+  };
+}
+
+
+/**
+ * Runs a frame with run-ahead, hiding input latency: after the real
+ * frame, saves the state, runs the given number of frames further
+ * and presents the last of them, then restores the state. Input read
+ * during the frame thus shows up frames earlier than it otherwise
+ * would. Only the final speculative frame is composed and presented.
+ *
+ * @param frames: Frames to run ahead; 0 runs a plain frame.
+ *
+ * @returns: Statistics of the real frame, with the host time taken
+ *           by the whole run-ahead.
+ */
+FrameStats runFrameAhead(uint32_t frames) {
+  if (!frames) return runFrame();
+  size_t size = stateSize();
+  if (!nes->aheadState) {
+    nes->aheadState = malloc(size);
+    if (!nes->aheadState) {
+      printf("Error: Out of memory.\n");
+      exit(1);
+    }
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  nes->skipPicture = 1;
+  FrameStats stats = runFrame();
+  if (!nes->halted) {
+    stateSave(nes->aheadState, size);
+    for (uint32_t i = 0; i < frames && !nes->halted; i++) {
+      nes->skipPicture = i + 1 < frames;
+      runFrame();
+    }
+    stateLoad(nes->aheadState, size);
+  }
+  nes->skipPicture = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats.wallTime = (end.tv_sec - start.tv_sec) * 1000000000ull + (end.tv_nsec - start.tv_nsec);
+  return stats;
+}
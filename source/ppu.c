@@ -1,8 +1,15 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "ppu.h"
+#include "bench.h"
+#include "cpu.h"
+#include "main.h"
 #include "display.h"
 #include "memoryMappedIO.h"
+#include "scheduler.h"
+#include "nes.h"
 
 
 #define KB 1024
@@ -17,126 +24,153 @@
  */
 #define H_BLANK_START 258
 
-
-// 30 standard fetch cycles, two pre-render fetch cycles 
-#define FETCH_CYCLES_PER_SCANLINE 32
-
-#define PIXEL_BUF_SZ 3*FETCH_CYCLES_PER_SCANLINE
-
 // V-blank starts at scanline 241 (post-render line at 240).
 // Pre-render line at scanline 261 (V-blank lasts 20 cycles).
 #define V_BLANK_START 241
 
-// Declares the two patten tables in PPU memory.
-uint8_t pTable0[0x1000];
-uint8_t pTable1[0x1000];
+// Reads a byte of the pattern tables.
+#define PATTERN_BYTE(addr) (nes->chrBanks[((addr) >> 10) & 0x07][(addr) & 0x03FF])
+
+// The decoded row of the pattern tables holding a byte of either
+// bitplane: a 16 byte tile is 8 rows.
+#define TILE_ROW(addr) (nes->tileBanks[((addr) >> 10) & 0x07][(((addr) & 0x03F0) >> 1) | ((addr) & 0x07)])
+
+// Defines the palette for the NES.
+const struct color palette[64] = {
+  {{0x7C, 0x7C, 0x7C}},
+  {{0x00, 0x00, 0xFC}},
+  {{0x00, 0x00, 0xBC}},
+  {{0x44, 0x28, 0xBC}},
+  {{0x94, 0x00, 0x84}},
+  {{0xA8, 0x00, 0x20}},
+  {{0xA8, 0x10, 0x00}},
+  {{0x88, 0x14, 0x00}},
+  {{0x50, 0x30, 0x00}},
+  {{0x00, 0x78, 0x00}},
+  {{0x00, 0x68, 0x00}},
+  {{0x00, 0x58, 0x00}},
+  {{0x00, 0x40, 0x58}},
+  {{0x00, 0x00, 0x00}},
+  {{0x00, 0x00, 0x00}},
+  {{0x00, 0x00, 0x00}},
+  {{0xBC, 0xBC, 0xBC}},
+  {{0x00, 0x78, 0xF8}},
+  {{0x00, 0x58, 0xF8}},
+  {{0x68, 0x44, 0xFC}},
+  {{0xD8, 0x00, 0xCC}},
+  {{0xE4, 0x00, 0x58}},
+  {{0xF8, 0x38, 0x00}},
+  {{0xE4, 0x5C, 0x10}},
+  {{0xAC, 0x7C, 0x00}},
+  {{0x00, 0xB8, 0x00}},
+  {{0x00, 0xA8, 0x00}},
+  {{0x00, 0xA8, 0x44}},
+  {{0x00, 0x88, 0x88}},
+  {{0x00, 0x00, 0x00}},
+  {{0x00, 0x00, 0x00}},
+  {{0x00, 0x00, 0x00}},
+  {{0xF8, 0xF8, 0xF8}},
+  {{0x3C, 0xBC, 0xFC}},
+  {{0x68, 0x88, 0xFC}},
+  {{0x98, 0x78, 0xF8}},
+  {{0xF8, 0x78, 0xF8}},
+  {{0xF8, 0x58, 0x98}},
+  {{0xF8, 0x78, 0x58}},
+  {{0xFC, 0xA0, 0x44}},
+  {{0xF8, 0xB8, 0x00}},
+  {{0xB8, 0xF8, 0x18}},
+  {{0x58, 0xD8, 0x54}},
+  {{0x58, 0xF8, 0x98}},
+  {{0x00, 0xEB, 0xD8}},
+  {{0x78, 0x78, 0x78}},
+  {{0x00, 0x00, 0x00}},
+  {{0x00, 0x00, 0x00}},
+  {{0xFC, 0xFC, 0xFC}},
+  {{0xA4, 0xE4, 0xFC}},
+  {{0xB8, 0xB8, 0xF8}},
+  {{0xD8, 0xB8, 0xF8}},
+  {{0xF8, 0xB8, 0xF8}},
+  {{0xF8, 0xA4, 0xC0}},
+  {{0xF0, 0xD0, 0xB0}},
+  {{0xFC, 0xE0, 0xA8}},
+  {{0xF8, 0xD8, 0x78}},
+  {{0xD8, 0xF8, 0x78}},
+  {{0xD8, 0xF8, 0xB8}},
+  {{0xB8, 0xF8, 0xD8}},
+  {{0x00, 0xFC, 0xFC}},
+  {{0xF8, 0xD8, 0xF8}},
+  {{0x00, 0x00, 0x00}},
+  {{0x00, 0x00, 0x00}}
+};
 
-// Declares object attribute memory containing data for 64 sprites
-//Sprite OAM[64];
-uint8_t primaryOAM[256];
-uint8_t secondaryOAM[32];
+uint32_t emphasisColors[8][64];
 
-uint8_t activeSprite[4];
 
-uint8_t secondaryOAMAddr = 0;
-uint8_t spriteEvalIdx = 0;
-uint8_t allSpritesEvaluated = 0;
-uint8_t spriteByte;
+/**
+ * Builds the ARGB value of every NES colour under every combination
+ * of emphasis bits. Each emphasized channel dims the other two to
+ * three quarters. Called once, before any console renders.
+ */
+void initColorTables(void) {
+  for (int emphasis = 0; emphasis < 8; emphasis++) {
+    for (int i = 0; i < 64; i++) {
+      struct color c = palette[i];
+      for (int channel = 0; channel < 3; channel++) {
+        // Bits 5-7 of PPUMASK emphasize red, green and blue.
+        uint8_t others = emphasis & ~(1 << channel);
+        for (int bit = 0; bit < 3; bit++) {
+          if (others & (1 << bit)) c.rgb[channel] = c.rgb[channel] * 3 / 4;
+        }
+      }
+      emphasisColors[emphasis][i] = color2int(c);
+    }
+  }
+}
+
+
+/**
+ * Gives the NES colour of a palette entry under the greyscale bit of
+ * the bound console's PPUMASK. Palette RAM holds 6 bits per entry,
+ * and greyscale keeps only the brightness bits.
+ *
+ * @param entry: Value of the palette entry.
+ */
+static uint8_t paletteColor(uint8_t entry) {
+  return entry & (nes->ppuRegisters.PPUMask & PPUMASK_GREYSCALE_MASK ? 0x30 : 0x3F);
+}
 
-// Declares the four name tables in PPU memory.
-NameTable nTable0;  // $2000
-NameTable nTable1;  // $2400
-NameTable nTable2;  // $2800
-NameTable nTable3;  // $2C00
 
-// Stores the mirroring type for the name tables.
-// Stores frame and scanline status as an enumerated type.
-enum MirroringType mirror;
-enum FrameStatus lineType;
-enum ScanlineStatus cycleType;
+/**
+ * Recomputes the colours of all palette entries of the bound console,
+ * after its greyscale bit changes or its palettes are replaced.
+ */
+void updatePaletteColors(void) {
+  for (int i = 0; i < 0x10; i++) {
+    nes->paletteColors[i] = paletteColor(nes->imagePalette[i]);
+    nes->paletteColors[0x10 + i] = paletteColor(nes->spritePalette[i]);
+  }
+}
 
-// Stores the current count for the scanline and each cycle within.
-uint16_t scanCount = 0, cycleCount = 0; 
 
-// Stores the more recent nametable byte that was fetched.
-uint16_t NTByte;
+/**
+ * Gives the index in the nametable of the background tile fetched
+ * on the current cycle: the first two tiles of a scanline are
+ * fetched at the end of the one before.
+ */
+static uint16_t fetchTileIndex(void) {
+  uint16_t column = nes->cycleType == STANDARD_FETCH ? 2 + nes->cycleCount / 8 : (nes->cycleCount - 320) / 8;
+  return column % 32 + 32 * (nes->scanCount / 8);
+}
 
-// Declares the image and sprite palettes in PPU memory.
-uint8_t imagePalette[0x10];
-uint8_t spritePalette[0x10];
 
-/** Four bytes in a fetch cycle
- *  NT Byte, AT Byte, Low BG Tile Byte, High BG Tile Byte
+/**
+ * Gives the place in the fetch buffers of the background tile
+ * fetched on the current cycle.
  */
-uint8_t pixelBuffer[PIXEL_BUF_SZ];
+static uint8_t fetchBufferIndex(void) {
+  return nes->cycleType == PRE_FETCH ? (nes->cycleCount - 320) / 8 : nes->cycleCount / 8;
+}
 
-// Defines the palette for the NES.
-const struct color palette[64] = {
-  {0x7C, 0x7C, 0x7C},
-  {0x00, 0x00, 0xFC},
-  {0x00, 0x00, 0xBC},
-  {0x44, 0x28, 0xBC},
-  {0x94, 0x00, 0x84},
-  {0xA8, 0x00, 0x20},
-  {0xA8, 0x10, 0x00},
-  {0x88, 0x14, 0x00},
-  {0x50, 0x30, 0x00},
-  {0x00, 0x78, 0x00},
-  {0x00, 0x68, 0x00},
-  {0x00, 0x58, 0x00},
-  {0x00, 0x40, 0x58},
-  {0x00, 0x00, 0x00},
-  {0x00, 0x00, 0x00},
-  {0x00, 0x00, 0x00},
-  {0xBC, 0xBC, 0xBC},
-  {0x00, 0x78, 0xF8},
-  {0x00, 0x58, 0xF8},
-  {0x68, 0x44, 0xFC},
-  {0xD8, 0x00, 0xCC},
-  {0xE4, 0x00, 0x58},
-  {0xF8, 0x38, 0x00},
-  {0xE4, 0x5C, 0x10},
-  {0xAC, 0x7C, 0x00},
-  {0x00, 0xB8, 0x00},
-  {0x00, 0xA8, 0x00},
-  {0x00, 0xA8, 0x44},
-  {0x00, 0x88, 0x88},
-  {0x00, 0x00, 0x00},
-  {0x00, 0x00, 0x00},
-  {0x00, 0x00, 0x00},
-  {0xF8, 0xF8, 0xF8},
-  {0x3C, 0xBC, 0xFC},
-  {0x68, 0x88, 0xFC},
-  {0x98, 0x78, 0xF8},
-  {0xF8, 0x78, 0xF8},
-  {0xF8, 0x58, 0x98},
-  {0xF8, 0x78, 0x58},
-  {0xFC, 0xA0, 0x44},
-  {0xF8, 0xB8, 0x00},
-  {0xB8, 0xF8, 0x18},
-  {0x58, 0xD8, 0x54},
-  {0x58, 0xF8, 0x98},
-  {0x00, 0xEB, 0xD8},
-  {0x78, 0x78, 0x78},
-  {0x00, 0x00, 0x00},
-  {0x00, 0x00, 0x00},
-  {0xFC, 0xFC, 0xFC},
-  {0xA4, 0xE4, 0xFC},
-  {0xB8, 0xB8, 0xF8},
-  {0xD8, 0xB8, 0xF8},
-  {0xF8, 0xB8, 0xF8},
-  {0xF8, 0xA4, 0xC0},
-  {0xF0, 0xD0, 0xB0},
-  {0xFC, 0xE0, 0xA8},
-  {0xF8, 0xD8, 0x78},
-  {0xD8, 0xF8, 0x78},
-  {0xD8, 0xF8, 0xB8},
-  {0xB8, 0xF8, 0xD8},
-  {0x00, 0xFC, 0xFC},
-  {0xF8, 0xD8, 0xF8},
-  {0x00, 0x00, 0x00},
-  {0x00, 0x00, 0x00}
-};
 
 /**
  * Gets a byte at a specific index from the name table.
@@ -144,72 +178,120 @@ const struct color palette[64] = {
  * @param idx: offset in bytes from the start of the name table.
  */
 uint8_t fetchNTByte(uint16_t idx) {
-  uint8_t table = ppuRegisters.PPUControl & 0x03;
-  switch (table) {
-    case 0x00:
-      return nTable0.tbl[idx];
-      break;
-    case 0x01:
-      return nTable1.tbl[idx];
-      break;
-    case 0x02:
-      return nTable2.tbl[idx];
-      break;
-    default:
-      return nTable3.tbl[idx];
-      break;
-  }
+  return nes->nameTableSlots[nes->ppuRegisters.PPUControl & PPUCTRL_NAME_TBL_MASK][idx];
 }
 
 
 /**
- * Gets a byte at a specific index from the attribute table.
+ * Fetches the palette bits of a background tile from its attribute
+ * byte, as expanded when the byte was written.
  * 
- * @param idx: offset in bytes from the start of the
- *             attribute table.
+ * @param idx: Index of the tile in the name table.
  */
 void fetchATByte(uint16_t idx) {
-  if (lineType == PRE_RENDER) {
-    idx -= FETCH_CYCLES_PER_SCANLINE-2;
-  } else if (cycleType == PRE_FETCH) {
-    idx += ( (scanCount + 1) % 32 == 0 ? 8 : 0);
-  }
-  //printf("%x ", nTable0.attr[(idx/4)%8 + 8*(idx/32)]);
+  // The fetches past the last row, for the post-render line, are dropped.
+  const uint8_t * palettes = nes->paletteSlots[nes->ppuRegisters.PPUControl & PPUCTRL_NAME_TBL_MASK];
+  nes->pixelBuffer[fetchBufferIndex()] = idx < NT_TILES ? palettes[idx] : 0;
+}
+
+
+/**
+ * Fetches the decoded row of a background tile on a given cycle of
+ * the PPU. Both bitplanes come at once, in place of the separate
+ * low and high tile byte fetches.
+ *
+ * @param idx: Index of the tile in the pattern table.
+ */
+void fetchBGTileRow(uint16_t idx) {
+  uint16_t addr = 16 * idx + (nes->scanCount % 8) + (getSpritePatternAddress() ? 0x1000 : 0x0);
+  nes->tileRows[fetchBufferIndex()] = TILE_ROW(addr);
+}
 
-  pixelBuffer[idx] = nTable0.attr[(idx/4)%8 + 8*(idx/32)];
+/**
+ * Send the pixel data that is in the buffer 
+ * to the display which renders the scanline.
+ */
+void flushPixelBuffer(void) {
+  renderScanline(nes->pixelBuffer, nes->tileRows, nes->scanCount);
+  memset(nes->pixelBuffer, 0, sizeof(uint8_t)*PIXEL_BUF_SZ);
+  memset(nes->tileRows, 0, sizeof(nes->tileRows));
+}
+
+
+/**
+ * Decodes a row of a tile from its two bitplane bytes.
+ *
+ * @param low: Byte of the low bitplane; bit 7 is the leftmost pixel.
+ * @param high: Byte of the high bitplane.
+ */
+static TileRow decodeTileRow(uint8_t low, uint8_t high) {
+  TileRow row = 0;
+  for (int x = 0; x < 8; x++) {
+    uint8_t pixel = ((low >> (7 - x)) & 1) | (((high >> (7 - x)) & 1) << 1);
+    row |= (TileRow) pixel << (8 * x);
+  }
+  return row;
 }
 
 
 /**
- * Fetches a low background tile byte on a given cycle of the PPU.
+ * Decodes pattern data into tile rows.
+ *
+ * @param rows: Where to write the rows, size / 2 of them.
+ * @param chr: The pattern data, a whole number of 16 byte tiles.
+ * @param size: Size of the pattern data in bytes.
  */
-void fetchLowBGTileByte(uint16_t idx) {
-  pixelBuffer[(cycleType == PRE_FETCH ? (cycleCount-320) / 8 : cycleCount / 8)
-	  + FETCH_CYCLES_PER_SCANLINE] = 
-	  pTable0[(16 * (idx % 32)) + (512 * (idx / 32)) + (scanCount % 8) +
-	 	 (getSpritePatternAddress() ? 0x1000 : 0x0)];
+void decodeTiles(TileRow * rows, const uint8_t * chr, size_t size) {
+  for (size_t tile = 0; tile < size; tile += 16) {
+    for (int y = 0; y < 8; y++) {
+      rows[tile / 2 + y] = decodeTileRow(chr[tile + y], chr[tile + 8 + y]);
+    }
+  }
 }
 
+
 /**
- * Fetches a high background tile byte on a given cycle of the PPU.
+ * Decodes the CHR ROM of the bound console's cartridge, if it has
+ * any, so switching banks only moves pointers.
+ *
+ * @returns: 1 on success, 0 if out of memory.
  */
-void fetchHighBGTileByte(uint16_t idx) {
-  pixelBuffer[(cycleType == PRE_FETCH ? (cycleCount-320) / 8 : cycleCount / 8)
-	  + 2*FETCH_CYCLES_PER_SCANLINE] = 
-	  pTable0[(16 * (idx % 32)) + (512 * (idx / 32)) + (scanCount % 8) + 8 + 
-	  	(getSpritePatternAddress() ? 0x1000 : 0x0)];
+uint8_t decodeCharacterROM(void) {
+  size_t size = 8 * KB * nes->head.n_chr_banks;
+  free(nes->chrROMTiles);
+  nes->chrROMTiles = NULL;
+  if (!size) return 1;
+  nes->chrROMTiles = malloc(size / 2 * sizeof(TileRow));
+  if (!nes->chrROMTiles) return 0;
+  decodeTiles(nes->chrROMTiles, nes->graphicData, size);
+  return 1;
 }
 
 /**
- * Send the pixel data that is in the buffer 
- * to the display which renders the scanline.
+ * Maps a 1 KB bank of the cartridge CHR ROM into one of the
+ * pattern table windows, and its decoded tiles with it. Cartridges
+ * without CHR ROM have 8 KB of CHR RAM instead.
+ *
+ * @param window: 0-7 for $0000, $0400, ... $1C00.
+ * @param bank: Index of the 1 KB bank, wrapped to the CHR size.
  */
-void flushPixelBuffer(void) {
-  renderScanline(pixelBuffer, scanCount);
-  memset(pixelBuffer, 0, sizeof(uint8_t)*PIXEL_BUF_SZ);
+void mapCharacterBank(uint8_t window, uint32_t bank) {
+  if (nes->head.n_chr_banks) {
+    bank %= 8 * nes->head.n_chr_banks;
+    nes->chrBanks[window] = nes->graphicData + 0x400 * bank;
+    nes->tileBanks[window] = nes->chrROMTiles + 0x200 * bank;
+  } else {
+    bank %= 8;
+    nes->chrBanks[window] = nes->chrRAM + 0x400 * bank;
+    nes->tileBanks[window] = nes->chrRAMTiles + 0x200 * bank;
+  }
 }
 
+
 /**
+ * Points the four nametable slots of the bound console at its
+ * physical name tables.
+ *
  * HORIZONTAL:
  * Maps $2000 and $2400 of the ppu to the first physical name table.
  * Maps $2800 and $2C00 of the ppu to the second physical name table.
@@ -219,102 +301,144 @@ void flushPixelBuffer(void) {
  * Maps $2400 and $2C00 of the ppu to the second physical name table.
  *
  * ONE-SCREEN:
- * Maps all virtual name tables to the first physical name table.
+ * Maps all virtual name tables to the first physical name table, or
+ * to the second one for ONE_SCREEN_UPPER.
  *
  * FOUR-SCREEN:
  * Maps each virtual name table to a physical name table using
  * 2KB of RAM in the game cartridge.
+ *
+ * @param mirror: The MirroringType to use.
  */
-void setMirroring(uint8_t new_mirror) {
-  if (mirror == 0) new_mirror = HORIZONTAL;
-  else if (mirror == 1) new_mirror = VERTICAL;
-  else if (mirror == 2) new_mirror = ONE_SCREEN;
-  else new_mirror = FOUR_SCREEN;
+void setMirroring(uint8_t mirror) {
+  static const uint8_t layouts[][4] = {
+    [HORIZONTAL] = { 0, 0, 1, 1 },
+    [VERTICAL] = { 0, 1, 0, 1 },
+    [ONE_SCREEN] = { 0, 0, 0, 0 },
+    [FOUR_SCREEN] = { 0, 1, 2, 3 },
+    [ONE_SCREEN_UPPER] = { 1, 1, 1, 1 }
+  };
+  nes->mirror = mirror;
+  for (int slot = 0; slot < 4; slot++) {
+    nes->nameTableSlots[slot] = nes->nameTables[layouts[mirror][slot]].bytes;
+    nes->paletteSlots[slot] = nes->tilePalettes[layouts[mirror][slot]];
+  }
 }
 
 
 /**
- * Takes the ppu through a single cycle. 
- * The cycle of the ppu takes one-third
- * of the time of a cpu cycle.
- * Uses NTSC timing.
+ * Expands an attribute byte into the palette bits of the 4x4 tiles it
+ * covers, so fetches need not pick them out again. Each 2x2 tiles
+ * get two bits: top left in bits 0-1, top right in 2-3, bottom left
+ * in 4-5 and bottom right in 6-7.
+ *
+ * @param palettes: Palette bits of each tile of the name table.
+ * @param idx: Index of the attribute byte, 0-63.
+ * @param attr: Value of the attribute byte.
  */
-void ppuStep(void) {
-  // Handle state of the current scanline and cycle.
-  switch (cycleCount) {
+static void expandAttribute(uint8_t * palettes, uint16_t idx, uint8_t attr) {
+  int left = 4 * (idx % 8), top = 4 * (idx / 8);
+  // The last row of attribute bytes only covers two rows of tiles.
+  for (int y = top; y < top + 4 && y < 30; y++) {
+    for (int x = left; x < left + 4; x++) {
+      int shift = ((y & 2) << 1) | (x & 2);
+      palettes[32*y + x] = ((attr >> shift) & 0x03) << 2;
+    }
+  }
+}
+
+
+/**
+ * Handles the state of the current scanline and cycle.
+ * Only cycles 1, 241, 257, 321 and 337 change it.
+ */
+void ppuCycleEvent(void) {
+  switch (nes->cycleCount) {
     case 1:
-      cycleType = STANDARD_FETCH;
-      if (scanCount == 0) {
-        lineType = VISIBLE;
+      nes->cycleType = STANDARD_FETCH;
+      if (nes->scanCount == 0) {
+        nes->lineType = VISIBLE;
       }
-      else if (scanCount == 240) lineType = POST_RENDER;
-      else if (scanCount == 241) {
-        lineType = V_BLANK;
+      else if (nes->scanCount == 240) nes->lineType = POST_RENDER;
+      else if (nes->scanCount == 241) {
+        nes->lineType = V_BLANK;
         setVerticalBlankStart(1);
+        if (nes->ppuRegisters.PPUControl & PPUCTRL_NMI_GEN_MASK) raiseNMI();
+        // The picture is complete; show it.
+        nes->frameCount++;
+        presentScene();
       }
-      else if (scanCount == 261) {
-	lineType = PRE_RENDER;
+      else if (nes->scanCount == 261) {
+	nes->lineType = PRE_RENDER;
         setVerticalBlankStart(0);
       }
       break;
     case 241:
-      cycleType = UNUSED_FETCH;
+      nes->cycleType = UNUSED_FETCH;
       break;
     case 257:
-      cycleType = H_BLANK;
-      secondaryOAMAddr = 0;
+      nes->cycleType = H_BLANK;
+      nes->secondaryOAMAddr = 0;
       break;
     case 321:
-      cycleType = PRE_FETCH;
+      nes->cycleType = PRE_FETCH;
       flushPixelBuffer();
       break;
     case 337:
-      cycleType = UNUSED_FETCH;
+      nes->cycleType = UNUSED_FETCH;
       break;
     default:
       break;
   }
-  if (cycleCount < 65) {
-    secondaryOAM[ cycleCount % 32 ] = 0xFF;
-  } else if (cycleCount <= 256) {
-    if (!allSpritesEvaluated) {
-      spriteEvalIdx++;
-    } else if (cycleCount % 2 == 1) {
-      uint8_t y = primaryOAM[spriteEvalIdx];
-      if (secondaryOAMAddr < 32) {
-	secondaryOAM[secondaryOAMAddr] = y;
-	if (y > scanCount && y < scanCount + 9) {
-	  secondaryOAM[++secondaryOAMAddr] = primaryOAM[spriteEvalIdx + 1];
-	  secondaryOAM[++secondaryOAMAddr] = primaryOAM[spriteEvalIdx + 2];
-	  secondaryOAM[++secondaryOAMAddr] = primaryOAM[spriteEvalIdx + 3];
-	  secondaryOAMAddr++;
+}
+
+
+/**
+ * Performs the work done on every cycle of the ppu: sprite
+ * evaluation, background fetches and the cycle/scanline counters.
+ */
+void ppuDot(void) {
+  if (nes->cycleCount < 65) {
+    nes->secondaryOAM[ nes->cycleCount % 32 ] = 0xFF;
+  } else if (nes->cycleCount <= 256) {
+    if (!nes->allSpritesEvaluated) {
+      nes->spriteEvalIdx++;
+    } else if (nes->cycleCount % 2 == 1) {
+      uint8_t y = nes->primaryOAM[nes->spriteEvalIdx];
+      if (nes->secondaryOAMAddr < 32) {
+	nes->secondaryOAM[nes->secondaryOAMAddr] = y;
+	if (y > nes->scanCount && y < nes->scanCount + 9) {
+	  nes->secondaryOAM[++nes->secondaryOAMAddr] = nes->primaryOAM[nes->spriteEvalIdx + 1];
+	  nes->secondaryOAM[++nes->secondaryOAMAddr] = nes->primaryOAM[nes->spriteEvalIdx + 2];
+	  nes->secondaryOAM[++nes->secondaryOAMAddr] = nes->primaryOAM[nes->spriteEvalIdx + 3];
+	  nes->secondaryOAMAddr++;
 	}
       } else {
-	if (y > scanCount && y < scanCount + 9) {
+	if (y > nes->scanCount && y < nes->scanCount + 9) {
 	  setSpriteOverflow(1);
-	  if (++spriteByte % 4 == 0) {
-	    spriteByte = 0;
-	    spriteEvalIdx += 4;
+	  if (++nes->spriteByte % 4 == 0) {
+	    nes->spriteByte = 0;
+	    nes->spriteEvalIdx += 4;
 	  }
 	} else {
-	  spriteEvalIdx += 4;
+	  nes->spriteEvalIdx += 4;
 	  // incrementing of spriteByte below replicates hardware bug that
 	  // causes false positives and false negatives of sprite overflow flag
-	  if (++spriteByte % 4 == 0) {
-	    spriteByte = 0;
+	  if (++nes->spriteByte % 4 == 0) {
+	    nes->spriteByte = 0;
 	  }
 	}
       }
-      spriteEvalIdx += 4;
-      if (spriteEvalIdx == 0) {
-	allSpritesEvaluated = 1;
+      nes->spriteEvalIdx += 4;
+      if (nes->spriteEvalIdx == 0) {
+	nes->allSpritesEvaluated = 1;
       }
     } else {
       // even cycle, write to secondary OAM? Already did that during odd cycle..
     }
-  } else if (cycleCount < 321) {
-    if (cycleCount % 8 == 0) {
-      secondaryOAMAddr++;
+  } else if (nes->cycleCount < 321) {
+    if (nes->cycleCount % 8 == 0) {
+      nes->secondaryOAMAddr++;
       //uint8_t bufferIdx, x;
       //if (getSpriteSize()) {
         // 8x16 sprites
@@ -328,40 +452,144 @@ void ppuStep(void) {
 
 	//}
       //}
-    } else if (cycleCount % 8 < 5) {
-      activeSprite[cycleCount] = secondaryOAM[secondaryOAMAddr + cycleCount];
-    } else activeSprite[3] = secondaryOAM[secondaryOAMAddr + 3];  // redundant hardware operation
+    } else if (nes->cycleCount % 8 < 5) {
+      // secondaryOAMAddr counts sprites here; each takes 4 bytes.
+      uint8_t byte = nes->cycleCount % 8 - 1;
+      nes->activeSprite[byte] = nes->secondaryOAM[nes->secondaryOAMAddr * 4 + byte];
+    } else nes->activeSprite[3] = nes->secondaryOAM[nes->secondaryOAMAddr * 4 + 3];  // redundant hardware operation
 
 
   } else {
     // read the first byte in secondary OAM
   }
-  if (cycleCount >= 257 && cycleCount <= 320) ppuRegisters.OAMAddress = 0;
-  if ((cycleType == STANDARD_FETCH || cycleType == PRE_FETCH) && lineType == VISIBLE) {
-    if (cycleCount % 8 == 1) {
-      NTByte = fetchNTByte( ( cycleType == STANDARD_FETCH ? 2 + (cycleCount / 8 ) % 32 : 
-	( (cycleCount - 320) / 8) % 32 ) + 32 * ( ( scanCount ) / 8 ) );
+  if (nes->cycleCount >= 257 && nes->cycleCount <= 320) nes->ppuRegisters.OAMAddress = 0;
+  if ((nes->cycleType == STANDARD_FETCH || nes->cycleType == PRE_FETCH) && nes->lineType == VISIBLE) {
+    if (nes->cycleCount % 8 == 1) {
+      nes->NTByte = fetchNTByte(fetchTileIndex());
     } 
-    else if (cycleCount % 8 == 3) {
-      fetchATByte( ( cycleCount / 32 ) + ( 8 * (scanCount / 32) ) );
+    else if (nes->cycleCount % 8 == 3) {
+      fetchATByte(fetchTileIndex());
     }
-    else if (cycleCount % 8 == 5) {
-      fetchLowBGTileByte(NTByte);
-    } else if (cycleCount % 8 == 7) {
-      fetchHighBGTileByte(NTByte);
+    else if (nes->cycleCount % 8 == 5) {
+      fetchBGTileRow(nes->NTByte);
     }
-  } else if (lineType == POST_RENDER && cycleType == PRE_RENDER) {
-    if (cycleCount % 8 == 1) {
-      NTByte = fetchNTByte( (cycleCount - 320) / 8 );
+  } else if (nes->lineType == POST_RENDER && nes->cycleType == PRE_FETCH) {
+    if (nes->cycleCount % 8 == 1) {
+      nes->NTByte = fetchNTByte( (nes->cycleCount - 320) / 8 );
     }
   }
 
-  if (cycleCount == 256) { scanCount = (lineType == PRE_RENDER ? 0 : scanCount+1); }
+  if (nes->cycleCount == 256) { nes->scanCount = (nes->lineType == PRE_RENDER ? 0 : nes->scanCount+1); }
   // Increment the cycle and reset it if it equals 340.
-  cycleCount = cycleCount == 340 ? 0 : cycleCount + 1;
+  nes->cycleCount = nes->cycleCount == 340 ? 0 : nes->cycleCount + 1;
+}
+
+
+/**
+ * Takes the ppu through a single cycle. 
+ * The cycle of the ppu takes one-third
+ * of the time of a cpu cycle.
+ * Uses NTSC timing.
+ */
+void ppuStep(void) {
+  ppuCycleEvent();
+  ppuDot();
 }
 
 
+/**
+ * Counts the cycles from the given cycle of a scanline up to the
+ * next one handled by ppuCycleEvent().
+ */
+static uint16_t cyclesUntilEvent(uint16_t cycle) {
+  if (cycle <= 1) return 1 - cycle;
+  if (cycle <= 241) return 241 - cycle;
+  if (cycle <= 257) return 257 - cycle;
+  if (cycle <= 321) return 321 - cycle;
+  if (cycle <= 337) return 337 - cycle;
+  return 342 - cycle;
+}
+
+
+/**
+ * Takes the ppu through several cycles at once. Equivalent to
+ * calling ppuStep() n times, but the scanline state is only
+ * updated on the cycles that change it.
+ *
+ * @param n: Number of ppu cycles to run.
+ */
+void ppuRun(uint32_t n) {
+  while (n) {
+    ppuCycleEvent();
+    ppuDot();
+    n--;
+    uint32_t span = cyclesUntilEvent(nes->cycleCount);
+    if (span > n) span = n;
+    n -= span;
+    while (span--) ppuDot();
+  }
+}
+
+
+
+/**
+ * Counts the ppuStep() calls that can run before PPUSTATUS next
+ * changes on its own. That is when scanline 241 starts and sets the
+ * vertical blank flag (raising an NMI), or when scanline 261 starts
+ * and clears it. Sprite overflow can only be raised once sprite
+ * evaluation is active, in which case no calls are guaranteed to be quiet.
+ *
+ * @returns: Number of ppuStep() calls before the status changes.
+ */
+uint32_t ppuDotsUntilStatusChange(void) {
+  uint32_t dots, line, toSet, toClear;
+  if (nes->allSpritesEvaluated) return 0;
+  // The next call at cycle 1, and the scanline it will see.
+  // The scanline counter advances on cycle 256.
+  if (nes->cycleCount <= 1) {
+    dots = 1 - nes->cycleCount;
+    line = nes->scanCount;
+  } else {
+    dots = 342 - nes->cycleCount;
+    line = nes->cycleCount > 256 ? nes->scanCount : (nes->scanCount == 261 ? 0 : nes->scanCount + 1);
+  }
+  toSet = (V_BLANK_START - line + 262) % 262;
+  toClear = (261 - line + 262) % 262;
+  return dots + 341 * (toSet < toClear ? toSet : toClear);
+}
+
+
+/**
+ * Runs the ppu up to a point in CPU time. The PPU is only brought
+ * up to date when the CPU can observe it: on an access to its
+ * registers, and when PPUSTATUS is about to change (EVENT_PPU).
+ *
+ * @param cpuCycle: CPU cycle to advance the PPU to.
+ */
+void ppuCatchUp(uint64_t cpuCycle) {
+  if (cpuCycle > nes->ppuCycle) {
+    uint64_t start = benchProfiling ? benchClock() : 0;
+    ppuRun(3 * (cpuCycle - nes->ppuCycle));
+    nes->ppuCycle = cpuCycle;
+    if (benchProfiling) benchPPUTime += benchClock() - start;
+  }
+  // The first CPU cycle whose catch-up runs the status change.
+  scheduleEvent(EVENT_PPU, nes->ppuCycle + ppuDotsUntilStatusChange() / 3 + 1);
+}
+
+
+/**
+ * Starts timing the ppu against the CPU clock.
+ */
+void ppuInit(void) {
+  updatePaletteColors();
+  // Dots not drawn yet show black.
+  memset(nes->frameBuffer, 0x0F, sizeof(nes->frameBuffer));
+  memset(nes->preRenderPixels, 0x0F, sizeof(nes->preRenderPixels));
+  registerEventHandler(EVENT_PPU, ppuCatchUp);
+  scheduleEvent(EVENT_PPU, 0);
+}
+
 
 /**
  * Reads a byte from PPU memory.
@@ -382,93 +610,51 @@ uint8_t readPictureByte(uint16_t addr) {
     addr = addr%0x0020 + 0x3F00;
   }
   
-  // Addressing first pattern table in PPU memory.
-  if (addr < 0x1000) {
-    return pTable0[addr];
-  }
-  // Addressing second pattern table in PPU memory.
-  else if (addr < 0x2000) {
-    return pTable1[addr - 0x1000];
-  } else { 
-    uint8_t tbl;
-    fetchEffectiveNametableAddress(&addr, &tbl);
-    switch(tbl) {
-      case 0:
-        return (addr < 0x3C0 ? nTable0.tbl[addr] : nTable0.attr[addr - 0x3C0]);
-      case 1:  
-        return (addr < 0x3C0 ? nTable1.tbl[addr] : nTable1.attr[addr - 0x3C0]);
-      case 2:  
-        return (addr < 0x3C0 ? nTable2.tbl[addr] : nTable2.attr[addr - 0x3C0]);
-      case 3:  
-        return (addr < 0x3C0 ? nTable3.tbl[addr] : nTable3.attr[addr - 0x3C0]);
-    }
-  }
+  // Addressing the pattern tables in PPU memory.
+  if (addr < 0x2000) {
+    return PATTERN_BYTE(addr);
+  } else if (addr < 0x3F00) {
+    // Each 1 KB from $2000 goes through a nametable slot.
+    return nes->nameTableSlots[(addr >> 10) & 0x03][addr & 0x03FF];
+  } else if (addr < 0x3F10) {
+    return nes->imagePalette[addr - 0x3F00];
+  } else return nes->spritePalette[addr - 0x3F10];
 }
 
-int i = 0;
-void writePictureByte() {
-  uint16_t addr = ppuRegisters.PPUWriteLatch;
-  uint8_t data = ppuRegisters.PPUData;
+void writePictureByte(void) {
+  uint16_t addr = nes->ppuRegisters.PPUWriteLatch;
+  uint8_t data = nes->ppuRegisters.PPUData;
   if (addr >= 0x4000) addr %= 0x4000; 
 
   if (addr >= 0x3F20) addr = 0x3F00 + (addr % 0x20);
 
   if (addr >= 0x3000 && addr < 0x3F00) addr -= 0x1000;
 
-  if (addr < 0x1000) {
-    pTable0[addr] = data;
-  } 
-  else if (addr < 0x2000) {
-    pTable1[addr-0x1000] = data;
+  if (addr < 0x2000) {
+    // Pattern tables are only writable on cartridges with CHR RAM.
+    // The tile row holding the byte is decoded again.
+    if (!nes->head.n_chr_banks) {
+      PATTERN_BYTE(addr) = data;
+      uint16_t low = addr & ~0x0008;
+      TILE_ROW(addr) = decodeTileRow(PATTERN_BYTE(low), PATTERN_BYTE(low | 0x0008));
+    }
   }
   else if (addr < 0x3F00) {
-    uint8_t tbl;
-    fetchEffectiveNametableAddress(&addr, &tbl);
-    switch(tbl) {
-      case 0:
-        *(addr < 0x3C0 ? nTable0.tbl + addr : nTable0.attr + addr - 0x3C0) = data;
-        break;
-      case 1:  
-        *(addr < 0x3C0 ? nTable1.tbl + addr : nTable1.attr + addr - 0x3C0) = data;
-        break;
-      case 2:  
-        *(addr < 0x3C0 ? nTable2.tbl + addr : nTable2.attr + addr - 0x3C0) = data;
-        break;
-      case 3:  
-        *(addr < 0x3C0 ? nTable3.tbl + addr : nTable3.attr + addr - 0x3C0) = data;
-        break;
-  
-    }
+    // Each 1 KB from $2000 goes through a nametable slot. Attribute
+    // bytes are expanded into the palette bits of their tiles.
+    uint8_t slot = (addr >> 10) & 0x03;
+    addr &= 0x03FF;
+    nes->nameTableSlots[slot][addr] = data;
+    if (addr >= NT_TILES) expandAttribute(nes->paletteSlots[slot], addr - NT_TILES, data);
   }
   else if (addr < 0x3F10) {
-    imagePalette[addr-0x3F00] = data;
+    nes->imagePalette[addr-0x3F00] = data;
+    nes->paletteColors[addr-0x3F00] = paletteColor(data);
   } 
-  else spritePalette[addr-0x3F10] = data;
-}
-
-
-void fetchEffectiveNametableAddress(uint16_t *addr, uint8_t *tbl) {
-  switch(mirror) {
-    case HORIZONTAL:
-      {
-      *tbl = (*addr < 0x2800 ? 0 : 1);
-      break;
-      }
-
-    case VERTICAL:
-      *addr = 0x2000 + ( *addr % 0x800 );
-      *tbl = (*addr < 0x2400 ? 0 : 1);
-      break;
-
-    case ONE_SCREEN:
-      *tbl = 0;
-      break;
-
-    case FOUR_SCREEN:
-      *tbl = (*addr - 0x2000) / 0x400;
-      break;
+  else {
+    nes->spritePalette[addr-0x3F10] = data;
+    nes->paletteColors[addr-0x3F00] = paletteColor(data);
   }
-  *addr = *addr % 0x400;
 }
 
 
@@ -479,9 +665,9 @@ void fetchEffectiveNametableAddress(uint16_t *addr, uint8_t *tbl) {
  * @note Data defined by OAMDATA
  */ 
 void writeToOAM(void) {
-  uint8_t addr = ppuRegisters.OAMAddress;
-  uint8_t data = ppuRegisters.OAMData;
-  primaryOAM[addr] = data;
+  uint8_t addr = nes->ppuRegisters.OAMAddress;
+  uint8_t data = nes->ppuRegisters.OAMData;
+  nes->primaryOAM[addr] = data;
 }
 
 
@@ -489,27 +675,27 @@ void writeToOAM(void) {
 void devPrintPatternTable0() {
   uint8_t bits;
   for (int i = 0; i < 0x1000; i++) {
-    bits =  (pTable0[(i/8)*2 + 8] & 1 << (7-(i%8))) >> (7-(i%8)-1);
-    bits |= (pTable0[(i/8)*2    ] & 1 << (7-(i%8))) >> (7-(i%8)  ); 
+    bits =  (PATTERN_BYTE((i/8)*2 + 8) & 1 << (7-(i%8))) >> (7-(i%8)-1);
+    bits |= (PATTERN_BYTE((i/8)*2    ) & 1 << (7-(i%8))) >> (7-(i%8)  ); 
     printf("%X ", bits); 
   }
 }
 
 void devPrintNameTable0() {
   for (int i = 0; i < 0x3C0; i++) {
-    printf("%X: %X\n", 0x2000 + i, nTable0.tbl[i]);
+    printf("%X: %X\n", 0x2000 + i, nes->nameTables[0].bytes[i]);
   }
 }
 
 void devPrintAttributeTable0() {
   for (int i = 0; i < 64; i++) {
-    printf("%X ", nTable0.attr[i]);
+    printf("%X ", nes->nameTables[0].bytes[NT_TILES + i]);
   }
 }
 
 void devPrintPalettes() {
   for (int i = 0; i < 0x20; i++) {
-    printf("%X ", (i < 0x10 ? imagePalette[i] : spritePalette[i-0x10]));
+    printf("%X ", (i < 0x10 ? nes->imagePalette[i] : nes->spritePalette[i-0x10]));
     if ( (i & 0x0F) == 0x0F) printf("\n");
   }
 }
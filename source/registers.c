@@ -2,6 +2,7 @@
 #include "memory.h"
 #include "main.h"
 #include "memoryMappedIO.h"
+#include "nes.h"
 
 /**
  * Sets the CPU registers to their expected
@@ -21,18 +22,30 @@ void cpuRegisterPowerup(struct registers* regs) {
 }
 
 
+/**
+ * Compares two sets of CPU registers field by field, leaving out
+ * the padding of the struct.
+ *
+ * @returns: 1 if every register is equal, 0 otherwise.
+ */
+uint8_t registersEqual(const struct registers * a, const struct registers * b) {
+  return a->pc == b->pc && a->sp == b->sp && a->p == b->p &&
+         a->a == b->a && a->x == b->x && a->y == b->y;
+}
+
+
 /**
  * Sets the PPU registers within the CPU to their
  * expected power-on values.
  */
 void ppuRegisterPowerup(void) {
-  ppuRegisters.PPUControl = 0;
-  ppuRegisters.PPUMask = 0;
-  ppuRegisters.PPUStatus = 0b10100000;
-  ppuRegisters.OAMAddress = 0;
-  ppuRegisters.OAMData = 0;
-  ppuRegisters.PPUScroll = 0;
-  ppuRegisters.PPUAddress = 0;
-  ppuRegisters.PPUData = 0;
-  ppuRegisters.PPUWriteLatch = 0;
+  nes->ppuRegisters.PPUControl = 0;
+  nes->ppuRegisters.PPUMask = 0;
+  nes->ppuRegisters.PPUStatus = 0b10100000;
+  nes->ppuRegisters.OAMAddress = 0;
+  nes->ppuRegisters.OAMData = 0;
+  nes->ppuRegisters.PPUScroll = 0;
+  nes->ppuRegisters.PPUAddress = 0;
+  nes->ppuRegisters.PPUData = 0;
+  nes->ppuRegisters.PPUWriteLatch = 0;
 }
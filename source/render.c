@@ -0,0 +1,96 @@
+/**
+ * Converts the pixel data fetched by the PPU into the frame
+ * buffer, and hands each completed frame to the video backend:
+ * the SDL display window or the headless frame output.
+ * The frame buffer holds NES colours; backends convert them to
+ * the pixel format they need. Nothing here depends on SDL.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bench.h"
+#include "compose.h"
+#include "display.h"
+#include "nes.h"
+#include "ppu.h"
+
+
+/**
+ * Sets the video backend function that completed frames are passed to.
+ *
+ * @param sink: Called with the frame buffer once per frame, or NULL.
+ */
+void setFrameSink(FrameSink sink) {
+  nes->frameSink = sink;
+}
+
+
+/**
+ * Hands the finished frame to the video backend. Called
+ * once per frame, when the PPU enters vertical blank.
+ */
+void presentScene(void) {
+  if (nes->frameSink && !nes->skipPicture) nes->frameSink(nes->frameBuffer, nes->frameEmphasis);
+}
+
+
+/**
+ * Hashes the frame buffer of the bound console with FNV-1a, to
+ * check runs against each other.
+ *
+ * @returns: Hash of the NES colours and emphasis of the frame.
+ */
+uint64_t frameHash(void) {
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (size_t i = 0; i < sizeof(nes->frameBuffer); i++) {
+    hash = (hash ^ nes->frameBuffer[i]) * 0x100000001B3ull;
+  }
+  for (size_t i = 0; i < sizeof(nes->frameEmphasis); i++) {
+    hash = (hash ^ nes->frameEmphasis[i]) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+
+/**
+ * Converts color struct to a uint32_t value.
+ *
+ * @param c: struct color instance that contains an RGB value.
+ *
+ * @returns: uint32_t value that is a convert struct color instance.
+ */
+uint32_t color2int(struct color c) {
+  uint32_t val = 0xFF000000 | (c.rgb[0] << 16) | (c.rgb[1] << 8) | (c.rgb[2]);
+  return val;
+}
+
+
+/**
+ * Renders a scanline of pixel data into the frame buffer.
+ * Scanlines outside of the visible picture are discarded.
+ * While the picture is skipped only the pixels carried over
+ * to the next scanline are produced.
+ *
+ * @param buffer: Palette bits (0, 4, 8 or 12) of each tile of the scanline.
+ * @param rows: Decoded pattern row of each tile of the scanline.
+ * @param scanline: current scanline (row) that is being displayed.
+ */
+void renderScanline(const uint8_t *buffer, const TileRow *rows, uint16_t scanline) {
+  uint64_t start = benchProfiling ? benchClock() : 0;
+  uint8_t rowPixels[SCREEN_WIDTH];
+  uint8_t * scanlinePixels = scanline < SCREEN_HEIGHT ? 
+    nes->frameBuffer + SCREEN_WIDTH * scanline : rowPixels;
+  if (!nes->skipPicture) {
+    memcpy(scanlinePixels, nes->preRenderPixels, sizeof(nes->preRenderPixels));
+    if (scanline < SCREEN_HEIGHT) nes->frameEmphasis[scanline] = nes->ppuRegisters.PPUMask >> 5;
+  }
+  // Pixels are composed through the colours of the 16 background
+  // palette entries, several at a time where the host allows.
+  if (!nes->skipPicture) {
+    composeTiles(scanlinePixels + 16, rows, buffer, 30, nes->paletteColors);
+  }
+  composeTiles(nes->preRenderPixels, rows + 30, buffer + 30, 2, nes->paletteColors);
+  if (benchProfiling) benchRenderTime += benchClock() - start;
+}
@@ -0,0 +1,314 @@
+/**
+ * Rewind. Every frame's savestate is captured into a fixed-size ring
+ * of records. A keyframe is stored every REWIND_KEYFRAME_INTERVAL
+ * frames; the frames between are stored as the XOR of their state
+ * with the keyframe's, run-length encoded, which is mostly zeros as
+ * little of the state changes from frame to frame.
+ *
+ * Records are written one after another, wrapping to the start of the
+ * ring when the end is reached. When the ring is full the oldest
+ * keyframe is dropped along with every frame that depends on it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "nes.h"
+#include "rewind.h"
+#include "savestate.h"
+
+// A recorded frame and the keyframe its delta is against
+// (itself, for a keyframe). Frames are numbered by sequence.
+typedef struct RewindRecord {
+  size_t offset;
+  size_t size;
+  uint64_t keyframe;
+} RewindRecord;
+
+// The rewind history of a console, allocated by rewindInit().
+struct RewindBuffer {
+  uint8_t * ring;
+  size_t capacity;
+  size_t head;                 // Where the next record is written.
+
+  // Records of frames first to next - 1, indexed by sequence
+  // modulo maxRecords.
+  RewindRecord * records;
+  uint64_t maxRecords;
+  uint64_t first, next;
+
+  size_t stateBytes;
+  uint8_t * keyframe;          // Decoded state of the newest keyframe.
+  uint64_t keyframeSeq;
+  uint8_t * state;             // Scratch for the state being captured or restored.
+  uint8_t * encoded;           // Scratch for an encoded record.
+};
+
+
+/**
+ * Appends an unsigned LEB128 number.
+ *
+ * @returns: Number of bytes written.
+ */
+static size_t putNumber(uint8_t * out, size_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = value | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+
+/**
+ * Reads an unsigned LEB128 number and advances past it.
+ */
+static size_t getNumber(const uint8_t ** in) {
+  size_t value = 0;
+  for (int shift = 0; ; shift += 7) {
+    uint8_t byte = *(*in)++;
+    value |= (size_t) (byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+}
+
+
+/**
+ * Encodes a state as runs against a base state: each run is the number
+ * of bytes equal to the base, the number that differ, and the XOR of
+ * the differing bytes. Trailing equal bytes are left out.
+ *
+ * @param state: The state to encode.
+ * @param base: The state to encode against, or NULL for all zeros.
+ * @param size: Size of both states in bytes.
+ * @param out: Where to write the record; size + 16 bytes suffice.
+ *
+ * @returns: Size of the record in bytes.
+ */
+static size_t encodeDelta(const uint8_t * state, const uint8_t * base, size_t size, uint8_t * out) {
+#define DIFF(i) (base ? state[i] ^ base[i] : state[i])
+  size_t i = 0, o = 0;
+  while (i < size) {
+    size_t start = i;
+    // Equal bytes, compared a word at a time where possible.
+    while (i + 8 <= size) {
+      uint64_t a, b = 0;
+      memcpy(&a, state + i, 8);
+      if (base) memcpy(&b, base + i, 8);
+      if (a != b) break;
+      i += 8;
+    }
+    while (i < size && !DIFF(i)) i++;
+    if (i == size) break;
+    size_t equal = i - start;
+
+    // Differing bytes, until eight in a row are equal again.
+    start = i;
+    size_t same = 0;
+    while (i < size && same < 8) {
+      same = DIFF(i) ? 0 : same + 1;
+      i++;
+    }
+    i -= same;
+
+    o += putNumber(out + o, equal);
+    o += putNumber(out + o, i - start);
+    for (size_t k = start; k < i; k++) out[o++] = DIFF(k);
+  }
+  return o;
+#undef DIFF
+}
+
+
+/**
+ * Applies a record made by encodeDelta() to a copy of its base state.
+ *
+ * @param record: The encoded record.
+ * @param size: Size of the record in bytes.
+ * @param state: Holds the base state (or zeros), and the decoded state
+ *               on return.
+ */
+static void decodeDelta(const uint8_t * record, size_t size, uint8_t * state) {
+  const uint8_t * in = record, * end = record + size;
+  size_t i = 0;
+  while (in < end) {
+    i += getNumber(&in);
+    size_t length = getNumber(&in);
+    for (size_t k = 0; k < length; k++) state[i++] ^= *in++;
+  }
+}
+
+
+/**
+ * Allocates the rewind history of the bound console.
+ *
+ * @param capacity: Size of the ring in bytes.
+ *
+ * @returns: 1 on success, 0 if out of memory.
+ */
+uint8_t rewindInit(size_t capacity) {
+  struct RewindBuffer * r = calloc(1, sizeof(struct RewindBuffer));
+  if (!r) return 0;
+  r->capacity = capacity;
+  r->stateBytes = stateSize();
+  // Even frames where nothing but the clocks moved take a few bytes.
+  r->maxRecords = capacity / 16 + 1;
+  r->ring = malloc(capacity);
+  r->records = malloc(r->maxRecords * sizeof(RewindRecord));
+  r->keyframe = malloc(r->stateBytes);
+  r->state = malloc(r->stateBytes);
+  r->encoded = malloc(r->stateBytes + 16);
+  if (!r->ring || !r->records || !r->keyframe || !r->state || !r->encoded) {
+    free(r->ring);
+    free(r->records);
+    free(r->keyframe);
+    free(r->state);
+    free(r->encoded);
+    free(r);
+    return 0;
+  }
+  nes->rewindBuffer = r;
+  return 1;
+}
+
+
+/**
+ * Frees the rewind history of the bound console, if it has one.
+ */
+void rewindRelease(void) {
+  struct RewindBuffer * r = nes->rewindBuffer;
+  if (!r) return;
+  free(r->ring);
+  free(r->records);
+  free(r->keyframe);
+  free(r->state);
+  free(r->encoded);
+  free(r);
+  nes->rewindBuffer = NULL;
+}
+
+
+/**
+ * Drops the oldest keyframe and the frames that depend on it.
+ */
+static void dropOldest(struct RewindBuffer * r) {
+  r->first++;
+  while (r->first < r->next && r->records[r->first % r->maxRecords].keyframe != r->first) {
+    r->first++;
+  }
+}
+
+
+/**
+ * Finds room for a record in the ring, without dropping anything.
+ *
+ * @param size: Size of the record in bytes.
+ * @param at: Set to the offset the record can be written at.
+ *
+ * @returns: 1 if there is room, 0 otherwise.
+ */
+static uint8_t findRoom(const struct RewindBuffer * r, size_t size, size_t * at) {
+  if (r->first == r->next) {
+    *at = 0;
+    return size <= r->capacity;
+  }
+  size_t oldest = r->records[r->first % r->maxRecords].offset;
+  if (r->head > oldest) {
+    // Free space after the newest record, then before the oldest.
+    if (size <= r->capacity - r->head) *at = r->head;
+    else if (size <= oldest) *at = 0;
+    else return 0;
+    return 1;
+  }
+  *at = r->head;
+  return size <= oldest - r->head;
+}
+
+
+/**
+ * Records the current state of the bound console as the newest frame
+ * of its history. Called once per frame, after runFrame().
+ */
+void rewindCapture(void) {
+  struct RewindBuffer * r = nes->rewindBuffer;
+  if (!r) return;
+  stateSave(r->state, r->stateBytes);
+
+  uint8_t keyframe = r->first == r->next || r->keyframeSeq < r->first ||
+                     r->next - r->keyframeSeq >= REWIND_KEYFRAME_INTERVAL;
+  size_t size = encodeDelta(r->state, keyframe ? NULL : r->keyframe, r->stateBytes, r->encoded);
+
+  while (r->next - r->first >= r->maxRecords) dropOldest(r);
+  size_t at;
+  while (!findRoom(r, size, &at)) {
+    if (r->first == r->next) return;   // Larger than the whole ring.
+    dropOldest(r);
+    if (!keyframe && r->keyframeSeq < r->first) {
+      // The keyframe this delta is against was just dropped.
+      keyframe = 1;
+      size = encodeDelta(r->state, NULL, r->stateBytes, r->encoded);
+    }
+  }
+
+  memcpy(r->ring + at, r->encoded, size);
+  r->head = at + size;
+  RewindRecord * record = &r->records[r->next % r->maxRecords];
+  record->offset = at;
+  record->size = size;
+  if (keyframe) {
+    r->keyframeSeq = r->next;
+    memcpy(r->keyframe, r->state, r->stateBytes);
+  }
+  record->keyframe = r->keyframeSeq;
+  r->next++;
+}
+
+
+/**
+ * Rewinds the bound console by one frame: drops the newest frame of
+ * its history and restores the one before it. The frame buffer is not
+ * part of the state; run a frame to draw the picture again.
+ *
+ * @returns: 1 if the console was rewound, 0 if the history is empty.
+ */
+uint8_t rewindBack(void) {
+  struct RewindBuffer * r = nes->rewindBuffer;
+  if (!r || r->next - r->first < 2) return 0;
+
+  r->next--;
+  r->head = r->records[r->next % r->maxRecords].offset;
+  const RewindRecord * target = &r->records[(r->next - 1) % r->maxRecords];
+
+  if (target->keyframe != r->keyframeSeq) {
+    // Stepped back past a keyframe: decode the one before it.
+    const RewindRecord * key = &r->records[target->keyframe % r->maxRecords];
+    memset(r->keyframe, 0, r->stateBytes);
+    decodeDelta(r->ring + key->offset, key->size, r->keyframe);
+    r->keyframeSeq = target->keyframe;
+  }
+  memcpy(r->state, r->keyframe, r->stateBytes);
+  if (r->next - 1 != r->keyframeSeq) decodeDelta(r->ring + target->offset, target->size, r->state);
+  stateLoad(r->state, r->stateBytes);
+  return 1;
+}
+
+
+/**
+ * Reports how much of the rewind ring of the bound console is in use.
+ *
+ * @param stats: Filled in with the ring's occupancy.
+ */
+void rewindGetStats(RewindStats * stats) {
+  struct RewindBuffer * r = nes->rewindBuffer;
+  memset(stats, 0, sizeof(RewindStats));
+  if (!r) return;
+  stats->capacity = r->capacity;
+  stats->frames = r->next - r->first;
+  for (uint64_t seq = r->first; seq < r->next; seq++) {
+    const RewindRecord * record = &r->records[seq % r->maxRecords];
+    stats->used += record->size;
+    stats->keyframes += record->keyframe == seq;
+  }
+}
@@ -0,0 +1,204 @@
+/**
+ * Savestates. A savestate is a StateHeader followed by the console
+ * state fields listed below, the PRG and CHR bank mappings as bank
+ * numbers, and the CHR RAM if the cartridge has any. Fields are
+ * stored in host byte order, so states move between consoles running
+ * the same ROM but not between hosts of different endianness.
+ *
+ * Saving and loading copy a few tens of KB with no allocation. The
+ * expanded tile palettes are stored as well, so loading only rebinds
+ * pointers and palette colours afterwards and states can be taken
+ * every frame for rewind and run-ahead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "memory.h"
+#include "nes.h"
+#include "ppu.h"
+#include "savestate.h"
+
+#define FIELD(name) { offsetof(struct nes, name), sizeof(((struct nes *) 0)->name) }
+
+// Parts of struct nes a savestate holds, in order. Pointers, handlers,
+// the cartridge and caches derived from memory are left out.
+static const struct {
+  size_t offset;
+  size_t size;
+} stateFields[] = {
+  FIELD(mmc1),
+  FIELD(regs), FIELD(cycle), FIELD(instructionCycle), FIELD(instructionCount),
+  FIELD(irqLine), FIELD(interruptCount), FIELD(halted),
+  FIELD(lazyFlags), FIELD(lazyResult), FIELD(lazyCarry),
+  FIELD(lazyOverflowA), FIELD(lazyOverflowB), FIELD(lazyOverflowResult),
+  FIELD(ram), FIELD(apu_io_reg), FIELD(exp_rom), FIELD(sram),
+  FIELD(buttons), FIELD(buttonShift), FIELD(controllerStrobe), FIELD(inputFrames),
+  FIELD(scheduler.heap), FIELD(scheduler.slot), FIELD(scheduler.heapSize), FIELD(eventHorizon),
+  FIELD(ppuRegisters),
+  FIELD(primaryOAM), FIELD(secondaryOAM), FIELD(activeSprite), FIELD(secondaryOAMAddr),
+  FIELD(spriteEvalIdx), FIELD(allSpritesEvaluated), FIELD(spriteByte),
+  FIELD(nameTables), FIELD(tilePalettes),
+  FIELD(mirror), FIELD(lineType), FIELD(cycleType), FIELD(scanCount), FIELD(cycleCount),
+  FIELD(frameCount), FIELD(ppuCycle), FIELD(NTByte),
+  FIELD(imagePalette), FIELD(spritePalette), FIELD(pixelBuffer), FIELD(tileRows), FIELD(preRenderPixels)
+};
+
+#define FIELD_COUNT (sizeof(stateFields) / sizeof(stateFields[0]))
+
+// Bank numbers of the four PRG ROM and eight CHR windows.
+typedef struct StateBanks {
+  uint32_t prg[4];
+  uint32_t chr[8];
+} StateBanks;
+
+
+/**
+ * Computes the size of a savestate of the bound console.
+ *
+ * @returns: Size in bytes.
+ */
+size_t stateSize(void) {
+  size_t size = sizeof(StateHeader) + sizeof(StateBanks);
+  for (size_t i = 0; i < FIELD_COUNT; i++) size += stateFields[i].size;
+  if (!nes->head.n_chr_banks) size += sizeof(nes->chrRAM);
+  return size;
+}
+
+
+/**
+ * Saves the state of the bound console into a buffer.
+ *
+ * @param buffer: Where to write the savestate.
+ * @param size: Size of the buffer in bytes.
+ *
+ * @returns: Size of the savestate, or 0 if the buffer is too small.
+ */
+size_t stateSave(uint8_t * buffer, size_t size) {
+  size_t total = stateSize();
+  if (size < total) return 0;
+
+  StateHeader header = {
+    .magic = STATE_MAGIC,
+    .version = STATE_VERSION,
+    .size = total,
+    .flags = nes->head.n_chr_banks ? 0 : STATE_CHR_RAM,
+    .romHash = cartridgeHash()
+  };
+  memcpy(buffer, &header, sizeof(header));
+  uint8_t * p = buffer + sizeof(header);
+
+  const uint8_t * console = (const uint8_t *) nes;
+  for (size_t i = 0; i < FIELD_COUNT; i++) {
+    memcpy(p, console + stateFields[i].offset, stateFields[i].size);
+    p += stateFields[i].size;
+  }
+
+  StateBanks banks;
+  for (int i = 0; i < 4; i++) {
+    banks.prg[i] = (nes->prgBanks[i] - nes->programData) / 0x2000;
+  }
+  const uint8_t * chrBase = (header.flags & STATE_CHR_RAM) ? nes->chrRAM : nes->graphicData;
+  for (int i = 0; i < 8; i++) {
+    banks.chr[i] = (nes->chrBanks[i] - chrBase) / 0x400;
+  }
+  memcpy(p, &banks, sizeof(banks));
+  p += sizeof(banks);
+
+  if (header.flags & STATE_CHR_RAM) memcpy(p, nes->chrRAM, sizeof(nes->chrRAM));
+  return total;
+}
+
+
+/**
+ * Restores the bound console from a savestate. The console must be
+ * running the cartridge the state was saved from.
+ *
+ * @param buffer: The savestate.
+ * @param size: Size of the buffer in bytes.
+ *
+ * @returns: 0 on success, -1 if the buffer is not a savestate of
+ *           this version, -2 if it belongs to another cartridge.
+ */
+int stateLoad(const uint8_t * buffer, size_t size) {
+  StateHeader header;
+  if (size < sizeof(header)) return -1;
+  memcpy(&header, buffer, sizeof(header));
+  if (header.magic != STATE_MAGIC || header.version != STATE_VERSION) return -1;
+  if (header.romHash != cartridgeHash()) return -2;
+  if (header.size > size || header.size != stateSize()) return -1;
+  const uint8_t * p = buffer + sizeof(header);
+
+  uint8_t * console = (uint8_t *) nes;
+  for (size_t i = 0; i < FIELD_COUNT; i++) {
+    memcpy(console + stateFields[i].offset, p, stateFields[i].size);
+    p += stateFields[i].size;
+  }
+
+  // Remapping only flushes the windows whose bank changes.
+  StateBanks banks;
+  memcpy(&banks, p, sizeof(banks));
+  p += sizeof(banks);
+  for (int i = 0; i < 4; i++) mapProgramBank(i, banks.prg[i]);
+  for (int i = 0; i < 8; i++) mapCharacterBank(i, banks.chr[i]);
+
+  if (header.flags & STATE_CHR_RAM) {
+    memcpy(nes->chrRAM, p, sizeof(nes->chrRAM));
+    decodeTiles(nes->chrRAMTiles, nes->chrRAM, sizeof(nes->chrRAM));
+  }
+  updatePaletteColors();
+  setMirroring(nes->mirror);
+
+  // Decoded RAM instructions and the idle loop candidate describe
+  // the memory that was just replaced.
+  memset(nes->decodedRAM, 0, sizeof(nes->decodedRAM));
+  nes->decodedUncached.valid = 0;
+  memset(&nes->idle, 0, sizeof(nes->idle));
+  return 0;
+}
+
+
+/**
+ * Saves the state of the bound console to a file.
+ *
+ * @param fileName: Path of the file to write.
+ *
+ * @returns: 0 on success, -1 if the file could not be written.
+ */
+int stateSaveFile(const char * fileName) {
+  size_t size = stateSize();
+  uint8_t * buffer = malloc(size);
+  if (!buffer) return -1;
+  stateSave(buffer, size);
+
+  FILE * file = fopen(fileName, "wb");
+  int written = file && fwrite(buffer, size, 1, file) == 1;
+  if (file && fclose(file) != 0) written = 0;
+  free(buffer);
+  return written ? 0 : -1;
+}
+
+
+/**
+ * Restores the bound console from a savestate file.
+ *
+ * @param fileName: Path of the file to read.
+ *
+ * @returns: 0 on success, -1 if the file can't be read or is not a
+ *           savestate of this version, -2 if it belongs to another
+ *           cartridge.
+ */
+int stateLoadFile(const char * fileName) {
+  FILE * file = fopen(fileName, "rb");
+  if (!file) return -1;
+  long size = fseek(file, 0, SEEK_END) ? -1 : ftell(file);
+  rewind(file);
+  uint8_t * buffer = size > 0 ? malloc(size) : NULL;
+  int result = -1;
+  if (buffer && fread(buffer, size, 1, file) == 1) result = stateLoad(buffer, size);
+  fclose(file);
+  free(buffer);
+  return result;
+}
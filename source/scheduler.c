@@ -0,0 +1,104 @@
+/**
+ * Event scheduler driven by the CPU cycle counter, the emulator's
+ * master clock. Components schedule timestamped events instead of
+ * being polled after every instruction; the CPU only compares its
+ * clock against eventHorizon and calls runEvents() once it is reached.
+ */
+#include <stdint.h>
+
+#include "nes.h"
+#include "scheduler.h"
+
+static void placeEvent(uint8_t idx, Event event) {
+  nes->scheduler.heap[idx] = event;
+  nes->scheduler.slot[event.type] = idx + 1;
+}
+
+static void siftUp(uint8_t idx) {
+  Event event = nes->scheduler.heap[idx];
+  while (idx > 0) {
+    uint8_t parent = (idx - 1) / 2;
+    if (nes->scheduler.heap[parent].time <= event.time) break;
+    placeEvent(idx, nes->scheduler.heap[parent]);
+    idx = parent;
+  }
+  placeEvent(idx, event);
+}
+
+static void siftDown(uint8_t idx) {
+  Event event = nes->scheduler.heap[idx];
+  while (2 * idx + 1 < nes->scheduler.heapSize) {
+    uint8_t child = 2 * idx + 1;
+    if (child + 1 < nes->scheduler.heapSize && nes->scheduler.heap[child + 1].time < nes->scheduler.heap[child].time) child++;
+    if (event.time <= nes->scheduler.heap[child].time) break;
+    placeEvent(idx, nes->scheduler.heap[child]);
+    idx = child;
+  }
+  placeEvent(idx, event);
+}
+
+
+/**
+ * Sets the function called when an event of a type comes due.
+ *
+ * @param type: Event type.
+ * @param handler: Called with the event's timestamp.
+ */
+void registerEventHandler(enum EventType type, EventHandler handler) {
+  nes->scheduler.handlers[type] = handler;
+}
+
+
+/**
+ * Schedules an event, replacing a pending event of the same type.
+ *
+ * @param type: Event type.
+ * @param time: CPU cycle at which the event comes due.
+ */
+void scheduleEvent(enum EventType type, uint64_t time) {
+  uint8_t idx;
+  if (nes->scheduler.slot[type]) {
+    idx = nes->scheduler.slot[type] - 1;
+  } else {
+    idx = nes->scheduler.heapSize++;
+  }
+  placeEvent(idx, (Event) { .time = time, .type = type });
+  siftUp(idx);
+  siftDown(nes->scheduler.slot[type] - 1);
+  nes->eventHorizon = nes->scheduler.heap[0].time;
+}
+
+
+/**
+ * Removes the pending event of a type, if any.
+ *
+ * @param type: Event type.
+ */
+void cancelEvent(enum EventType type) {
+  if (!nes->scheduler.slot[type]) return;
+  uint8_t idx = nes->scheduler.slot[type] - 1;
+  nes->scheduler.slot[type] = 0;
+  if (idx != --nes->scheduler.heapSize) {
+    // Fill the hole with the last event and restore heap order.
+    uint8_t moved = nes->scheduler.heap[nes->scheduler.heapSize].type;
+    placeEvent(idx, nes->scheduler.heap[nes->scheduler.heapSize]);
+    siftUp(idx);
+    siftDown(nes->scheduler.slot[moved] - 1);
+  }
+  nes->eventHorizon = nes->scheduler.heapSize ? nes->scheduler.heap[0].time : UINT64_MAX;
+}
+
+
+/**
+ * Dispatches, in timestamp order, every event due by a point in time.
+ * Handlers may schedule further events, including ones already due.
+ *
+ * @param now: Current CPU cycle.
+ */
+void runEvents(uint64_t now) {
+  while (nes->scheduler.heapSize && nes->scheduler.heap[0].time <= now) {
+    Event event = nes->scheduler.heap[0];
+    cancelEvent(event.type);
+    if (nes->scheduler.handlers[event.type]) nes->scheduler.handlers[event.type](event.time);
+  }
+}